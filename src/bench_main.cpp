@@ -0,0 +1,772 @@
+#define DOCTEST_CONFIG_DISABLE
+#include <doctest.h>
+#include <fmt/core.h>
+#include <folly/MPMCQueue.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/dynamic_bitset.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ingestor.h"
+#include "query_plan.h"
+#include "query_service.h"
+#include "types.h"
+
+/*
+ * Ad-hoc benchmarks for the hot paths of llq. Not part of the test suite; run
+ * by hand on a Release build, e.g.
+ *
+ *   bench_main gen big.json 5000000
+ *   bench_main ingest big.json
+ *   bench_main parse log2.json
+ *   bench_main memory big.json
+ *   bench_main query big.json "http.response.status" "level == 'warn', msg"
+ *   bench_main predicates big.json "level == 'warn', count > 10, name"
+ *   bench_main segments big.json "level == 'warn', msg" "count < 100"
+ *   bench_main bitset 100000000
+ *   bench_main merge 1000000
+ *   bench_main scan 100000000
+ *   bench_main follow /tmp/llq_follow.json
+ */
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(
+    const std::string& name,
+    std::size_t        lines,
+    std::size_t        bytes,
+    double             seconds
+) {
+    fmt::println(
+        "{:<10} {:>10} lines  {:>8.3f} s  {:>12.0f} lines/s  {:>8.1f} MB/s",
+        name, lines, seconds, static_cast<double>(lines) / seconds,
+        static_cast<double>(bytes) / seconds / 1e6
+    );
+}
+
+// Write `n` synthetic log lines shaped like the output of logProducerBin.
+void generate(const std::string& path, std::size_t n) {
+    std::ofstream out(path);
+    const char*   tags[]   = {"even", "three", "five", "7"};
+    const char*   levels[] = {"info", "debug", "warn", "error"};
+    for (std::size_t i = 0; i < n; ++i) {
+        json line = {
+            {"level", levels[i % 4]},
+            {"msg", fmt::format("Synthetic message number {}", i)},
+            {"count", i},
+            {"name", fmt::format("Bobby {}", i % 1000)},
+        };
+        if (i % 3 == 0) {
+            line["tag"] = tags[i % 4];
+        }
+        if (i % 2 == 0) {
+            line["http"] = {{"method", i % 4 == 0 ? "GET" : "POST"}};
+        }
+        if (i % 10 == 0) {
+            line["http"]["response"] = {
+                {"status", 200 + (i % 7) * 50}, {"bytes", i}
+            };
+        }
+        out << line.dump() << '\n';
+    }
+}
+
+std::size_t countLines(const std::string& path) {
+    MappedFile  file(path);
+    std::size_t n = 0;
+    for (char c : file.view()) {
+        n += c == '\n' ? 1 : 0;
+    }
+    return n;
+}
+
+// Time from spawning an ingestor until `expectedLines` lines have arrived at
+// the receiving end of the channel.
+double timeIngest(
+    std::size_t expectedLines,
+    const std::function<std::thread(
+        folly::MPMCQueue<Msg>&, std::atomic<bool>&
+    )>&         spawn
+) {
+    folly::MPMCQueue<Msg> channel(100);
+    std::atomic<bool>     shouldShutdown(false);
+
+    auto        start    = Clock::now();
+    std::thread ingestor = spawn(channel, shouldShutdown);
+
+    std::size_t received = 0;
+    Msg         msg;
+    while (received < expectedLines) {
+        channel.blockingRead(msg);
+        if (auto* index = std::get_if<Index>(&msg)) {
+            received += index->size();
+        }
+    }
+    double seconds = secondsSince(start);
+
+    shouldShutdown.store(true);
+    ingestor.join();
+    return seconds;
+}
+
+void benchIngest(const std::string& path) {
+    const auto lines = countLines(path);
+    const auto bytes = std::filesystem::file_size(path);
+
+    double stream = timeIngest(lines, [&](auto& channel, auto& flag) {
+        return std::thread([&]() {
+            std::ifstream file(path);
+            startIngesting(channel, file, flag);
+        });
+    });
+    report("stream", lines, bytes, stream);
+
+    double mmap = timeIngest(lines, [&](auto& channel, auto& flag) {
+        return spawnIngestor(channel, path, flag);
+    });
+    report("mmap", lines, bytes, mmap);
+
+    // time to first full index with the existing contents split across workers
+    const unsigned cores = std::max(std::thread::hardware_concurrency(), 1U);
+    for (unsigned threads = 2; threads <= cores; threads *= 2) {
+        IndexConfig config{.initialThreads = threads};
+        double      parallel =
+            timeIngest(lines, [&](auto& channel, auto& flag) {
+                return std::thread([&, config]() {
+                    FileWatcher watcher(path, FollowMode::Poll);
+                    startIngestingMapped(channel, path, watcher, flag, config);
+                });
+            });
+        report(fmt::format("mmap x{}", threads), lines, bytes, parallel);
+    }
+}
+
+std::vector<std::string_view> splitLines(std::string_view data) {
+    std::vector<std::string_view> lines;
+    for (std::size_t pos = 0; pos < data.size();) {
+        std::size_t nl = data.find('\n', pos);
+        if (nl == std::string_view::npos) {
+            break;
+        }
+        lines.push_back(data.substr(pos, nl - pos));
+        pos = nl + 1;
+    }
+    return lines;
+}
+
+// Throughput of each parse backend, both for pulling the top-level keys out of
+// a line on its own and for the whole `updateIndexRaw` step.
+void benchParse(const std::string& path) {
+    MappedFile file(path);
+    const auto lines = splitLines(file.view());
+    const auto bytes = file.size();
+
+    std::size_t sink    = 0;
+    auto        keyHash = std::hash<std::string_view>();
+
+    auto start = Clock::now();
+    for (auto line : lines) {
+        json obj = json::parse(line, nullptr, false);
+        for (const auto& it : obj.items()) {
+            sink += keyHash(it.key());
+        }
+    }
+    report("keys/dom", lines.size(), bytes, secondsSince(start));
+
+    start = Clock::now();
+    for (auto line : lines) {
+        json_scan::forEachTopLevelKey(line, [&](std::string_view key) {
+            sink += keyHash(key);
+        });
+    }
+    report("keys/scan", lines.size(), bytes, secondsSince(start));
+
+    for (auto backend : {ParseBackend::Dom, ParseBackend::Scan}) {
+        Index index;
+        index.config.parser = backend;
+        start               = Clock::now();
+        for (auto line : lines) {
+            updateIndexRaw(index, line);
+        }
+        report(
+            backend == ParseBackend::Dom ? "index/dom" : "index/scan",
+            lines.size(), bytes, secondsSince(start)
+        );
+        sink += index.bitsets.size();
+    }
+    fmt::println("(checksum {})", sink % 10);
+}
+
+// Resident anonymous memory of this process in bytes, i.e. leaving out pages
+// of the mapped log file
+std::size_t residentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    std::size_t   pages    = 0;
+    std::size_t   resident = 0;
+    std::size_t   shared   = 0;
+    statm >> pages >> resident >> shared;
+    return (resident - shared) * sysconf(_SC_PAGESIZE);
+}
+
+// Resident memory of a fully built Index per million lines, for each line
+// layout. Each layout is measured in a forked child so freed memory from one
+// doesn't flatter the next.
+void benchMemory(const std::string& path) {
+    MappedFile file(path);
+    const auto lines = splitLines(file.view());
+
+    const std::pair<const char*, IndexConfig> layouts[] = {
+        {"dom", {}},
+        {"raw/dom", {.storage = LineStorage::Raw}},
+        {"raw/scan", {.parser = ParseBackend::Scan, .storage = LineStorage::Raw}
+        },
+        {"offs/scan",
+         {.parser = ParseBackend::Scan, .storage = LineStorage::Offsets}},
+    };
+    for (const auto& [name, config] : layouts) {
+        if (fork() != 0) {
+            wait(nullptr);
+            continue;
+        }
+        const std::size_t before = residentBytes();
+        const auto        start  = Clock::now();
+        Index             index;
+        index.config = config;
+        index.source = std::make_shared<const LineSource>(path);
+        for (auto line : lines) {
+            updateIndexRaw(index, line, line.data() - file.data());
+        }
+        const double seconds = secondsSince(start);
+        const double mb      = (residentBytes() - before) / 1e6;
+        fmt::println(
+            "{:<10} {:>10} lines  {:>8.3f} s  {:>8.1f} MB  {:>8.1f} MB per 1M "
+            "lines  ({:.1f} MB raw text)",
+            name, index.size(), seconds, mb, mb * 1e6 / lines.size(),
+            file.size() / 1e6
+        );
+        std::exit(0);
+    }
+}
+
+// Candidate lines after the bitset prefilter and time per query, over an Index
+// of the whole file with raw storage and the scan parser. Each query runs
+// against top-level key bitsets only ("keys") and against the default nested
+// key paths, value bitmaps and numeric columns ("full"), and the latter again
+// with lines read back from the file ("offs").
+void benchQuery(const std::string& path, const std::vector<std::string>& qs) {
+    MappedFile file(path);
+    Index      index;
+    index.config = {.parser = ParseBackend::Scan, .storage = LineStorage::Raw};
+    indexLines(index, file.view());
+    Index offsets;
+    offsets.config = {
+        .parser = ParseBackend::Scan, .storage = LineStorage::Offsets
+    };
+    offsets.source = std::make_shared<const LineSource>(path);
+    indexLines(offsets, file.view());
+
+    constexpr int     rounds = 5;
+    const IndexConfig full   = index.config;
+    IndexConfig       keys   = full;
+    keys.pathDepth           = 1;
+    keys.valueCap            = 0;
+    keys.numericColumns      = false;
+
+    auto run = [&](const std::string& q, const char* name, Index& target,
+                   IndexConfig config) {
+        auto query = Query::parse(q);
+        if (!query) {
+            fmt::println("Failed to parse query: {}", q);
+            return;
+        }
+        query->maxMatches = std::numeric_limits<int>::max();
+        target.config     = config;
+
+        const auto  candidates = linesWithPathRoot(target, *query).count();
+        std::size_t matches    = 0;
+        const auto  start      = Clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            auto result = runQueryOnIndex(target, query->clone());
+            matches     = result ? result->lines.size() : 0;
+        }
+        fmt::println(
+            "{:<32} {:<5} {:>10} candidates  {:>10} matches  {:>8.2f} ms", q,
+            name, candidates, matches, secondsSince(start) * 1e3 / rounds
+        );
+    };
+    for (const auto& q : qs) {
+        run(q, "keys", index, keys);
+        run(q, "full", index, full);
+        run(q, "offs", offsets, offsets.config);
+    }
+}
+
+// Lines checked per second against each query on its own, with no index to
+// narrow the candidates: each Expr's `matches` against the QueryPlan compiled
+// from them. Lines are parsed up front, the first kPredicateLines of them.
+void benchPredicates(
+    const std::string& path, const std::vector<std::string>& qs
+) {
+    constexpr std::size_t kPredicateLines = 200'000;
+    constexpr int         rounds          = 5;
+
+    MappedFile        file(path);
+    std::vector<json> lines;
+    for (auto line : splitLines(file.view())) {
+        if (lines.size() == kPredicateLines) {
+            break;
+        }
+        lines.push_back(json::parse(line, nullptr, false));
+    }
+
+    auto time = [&](const std::string& q, const char* name, auto&& matches) {
+        std::size_t count = 0;
+        const auto  start = Clock::now();
+        for (int r = 0; r < rounds; ++r) {
+            count = std::ranges::count_if(lines, matches);
+        }
+        const double seconds = secondsSince(start) / rounds;
+        fmt::println(
+            "{:<40} {:<5} {:>8} matches  {:>8.2f} ms  {:>12.0f} lines/s", q,
+            name, count, seconds * 1e3,
+            static_cast<double>(lines.size()) / seconds
+        );
+    };
+    for (const auto& q : qs) {
+        const auto query = Query::parse(q);
+        if (!query) {
+            fmt::println("Failed to parse query: {}", q);
+            continue;
+        }
+        const QueryPlan plan(query->exprs);
+        time(q, "expr", [&](const json& line) {
+            return std::ranges::all_of(query->exprs, [&](const Expr& expr) {
+                return expr.matches(line);
+            });
+        });
+        time(q, "plan", [&](const json& line) { return plan.matches(line); });
+    }
+}
+
+// The query service's side of following a file: merge it into the master
+// index a batch of `kBatch` lines at a time, as one flat Index and as a
+// SegmentedIndex, reporting the total and the slowest single merge. Then the
+// time each takes to answer the queries, newest 1000 matches, and the
+// segmented index's time with a worker per core.
+void benchSegments(
+    const std::string& path, const std::vector<std::string>& qs
+) {
+    constexpr std::size_t kBatch = 4096;
+    MappedFile            file(path);
+    const auto            lines  = splitLines(file.view());
+    const IndexConfig     config = {
+            .parser = ParseBackend::Scan, .storage = LineStorage::Raw
+    };
+
+    auto merge = [&](const char* name, auto& index) {
+        double total = 0;
+        double worst = 0;
+        for (std::size_t from = 0; from < lines.size(); from += kBatch) {
+            Index batch;
+            batch.config    = config;
+            batch.start_idx = from;
+            const auto to   = std::min(lines.size(), from + kBatch);
+            for (auto i = from; i < to; ++i) {
+                updateIndexRaw(batch, lines[i]);
+            }
+            const auto start = Clock::now();
+            mergeIndex(index, batch);
+            const double seconds = secondsSince(start);
+            total += seconds;
+            worst  = std::max(worst, seconds);
+        }
+        fmt::println(
+            "{:<10} merge {:>10} lines  {:>8.1f} ms total  {:>8.2f} ms worst",
+            name, index.size(), total * 1e3, worst * 1e3
+        );
+    };
+    auto query = [&](const std::string& name, auto&& run) {
+        constexpr int rounds = 5;
+        for (const auto& q : qs) {
+            auto parsed = Query::parse(q);
+            if (!parsed) {
+                fmt::println("Failed to parse query: {}", q);
+                continue;
+            }
+            std::size_t matches = 0;
+            const auto  start   = Clock::now();
+            for (int i = 0; i < rounds; ++i) {
+                auto result = run(parsed->clone());
+                matches     = result ? result->lines.size() : 0;
+            }
+            fmt::println(
+                "{:<10} {:<32} {:>6} matches  {:>8.2f} ms", name, q, matches,
+                secondsSince(start) * 1e3 / rounds
+            );
+        }
+    };
+
+    Index          flat;
+    SegmentedIndex segmented;
+    merge("flat", flat);
+    merge("segmented", segmented);
+    query("flat", [&](Query&& q) {
+        return runQueryOnIndex(flat, std::move(q));
+    });
+    query("segmented", [&](Query&& q) {
+        return runQueryOnIndex(segmented, std::move(q));
+    });
+    const unsigned cores = std::max(std::thread::hardware_concurrency(), 1U);
+    WorkerPool     workers(cores - 1);
+    query(fmt::format("seg/{}t", cores), [&](Query&& q) {
+        return runQueryOnIndex(segmented, std::move(q), {}, 0, &workers);
+    });
+}
+
+// Memory and intersection time of BitSet against a dense
+// boost::dynamic_bitset, for key frequencies seen in real logs: keys on every
+// line, on a random share of lines, and keys that only show up in bursts.
+// BitSet is timed with scalar and with the CPU's widest word kernels, and
+// with the fused intersectAll.
+void benchBitset(std::size_t n) {
+    std::uint64_t state = 7;
+    auto          rand  = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    using Dense = boost::dynamic_bitset<>;
+    auto build  = [&](auto&& has) {
+        Dense  dense(n);
+        BitSet bs;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (has(i)) {
+                dense.set(i);
+                bs.set(i, true);
+            }
+        }
+        return std::pair{std::move(dense), std::move(bs)};
+    };
+    const std::pair<const char*, std::function<bool(std::size_t)>> keys[] = {
+        {"every line", [](std::size_t) { return true; }},
+        {"50%", [&](std::size_t) { return rand() % 2 == 0; }},
+        {"10%", [&](std::size_t) { return rand() % 10 == 0; }},
+        {"1%", [&](std::size_t) { return rand() % 100 == 0; }},
+        {"0.01%", [&](std::size_t) { return rand() % 10000 == 0; }},
+        {"bursts", [](std::size_t i) { return i % 100000 < 2000; }},
+    };
+    // the other side of each intersection, like a common `level` key
+    auto [halfDense, half] =
+        build([&](std::size_t) { return rand() % 2 == 0; });
+
+    constexpr int rounds = 5;
+    fmt::println(
+        "{:<12} {:>12} {:>12}  {:>9} {:>10} {:>10} {:>9}", "key", "dense bytes",
+        "bitset bytes", "dense ms", "scalar ms", "bitset ms", "fused ms"
+    );
+    for (const auto& [name, has] : keys) {
+        auto [dense, bs] = build(has);
+
+        std::size_t sink  = 0;
+        auto        start = Clock::now();
+        for (int r = 0; r < rounds; ++r) {
+            Dense filter(n);
+            filter.set();
+            filter &= dense;
+            filter &= halfDense;
+            sink += filter.count();
+        }
+        const double denseMs = secondsSince(start) * 1e3 / rounds;
+
+        // the way linesWithPathRoot used to narrow a full-size mask
+        auto sequential = [&]() {
+            auto start = Clock::now();
+            for (int r = 0; r < rounds; ++r) {
+                BitSet filter = BitSet::trueMask(n);
+                filter &= bs;
+                filter &= half;
+                sink += filter.count();
+            }
+            return secondsSince(start) * 1e3 / rounds;
+        };
+        bit_kernels::setLevel(bit_kernels::Level::Scalar);
+        const double scalarMs = sequential();
+        bit_kernels::setLevel(bit_kernels::supported());
+        const double bitsetMs = sequential();
+
+        start = Clock::now();
+        for (int r = 0; r < rounds; ++r) {
+            const BitSet* sets[] = {&bs, &half};
+            sink += BitSet::intersectAll(sets, n).count();
+        }
+        const double fusedMs = secondsSince(start) * 1e3 / rounds;
+
+        fmt::println(
+            "{:<12} {:>12} {:>12}  {:>9.2f} {:>10.2f} {:>10.2f} {:>9.2f}  "
+            "(checksum {})",
+            name, dense.num_blocks() * sizeof(Dense::block_type),
+            bs.memoryUsage(), denseMs, scalarMs, bitsetMs, fusedMs, sink % 10
+        );
+    }
+}
+
+// Time to merge one batch's bitset into the query service's copy, the way
+// mergeIndex did it (one `set` per bit) and with `appendRange`, at a
+// word-aligned and an unaligned destination.
+void benchMerge(std::size_t n) {
+    std::uint64_t state = 11;
+    auto          rand  = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    const std::pair<const char*, std::function<bool(std::size_t)>> keys[] = {
+        {"every line", [](std::size_t) { return true; }},
+        {"50%", [&](std::size_t) { return rand() % 2 == 0; }},
+        {"1%", [&](std::size_t) { return rand() % 100 == 0; }},
+        {"bursts", [](std::size_t i) { return i % 100000 < 2000; }},
+    };
+
+    fmt::println(
+        "{:<12} {:>10} {:>14} {:>14} {:>9}", "key", "offset", "per bit ms",
+        "appendRange ms", "speedup"
+    );
+    for (const auto& [name, has] : keys) {
+        BitSet batch;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (has(i)) {
+                batch.set(i, true);
+            }
+        }
+        for (std::size_t offset : {std::size_t{1} << 20, (1 << 20) + 12345UL}) {
+            auto start = Clock::now();
+            BitSet perBit;
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                perBit.set(offset + i, batch[i]);
+            }
+            const double perBitMs = secondsSince(start) * 1e3;
+
+            start = Clock::now();
+            BitSet bulk;
+            bulk.appendRange(batch, 0, offset);
+            const double bulkMs = secondsSince(start) * 1e3;
+
+            fmt::println(
+                "{:<12} {:>10} {:>14.2f} {:>14.3f} {:>8.0f}x{}", name, offset,
+                perBitMs, bulkMs, perBitMs / bulkMs,
+                perBit == bulk ? "" : "  MISMATCH"
+            );
+        }
+    }
+}
+
+// Time to walk every set bit newest-first, the way runQueryOnIndex visits
+// candidate lines: with the reverse iterator and in batches from
+// `prevSetBits`. Then the time to the newest 1000 lines of an intersection,
+// materialized and lazily streamed.
+void benchScan(std::size_t n) {
+    std::uint64_t state = 13;
+    auto          rand  = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    const std::pair<const char*, std::function<bool(std::size_t)>> keys[] = {
+        {"every line", [](std::size_t) { return true; }},
+        {"50%", [&](std::size_t) { return rand() % 2 == 0; }},
+        {"10%", [&](std::size_t) { return rand() % 10 == 0; }},
+        {"1%", [&](std::size_t) { return rand() % 100 == 0; }},
+        {"0.01%", [&](std::size_t) { return rand() % 10000 == 0; }},
+    };
+
+    fmt::println(
+        "{:<12} {:>10} {:>14} {:>12}", "key", "set bits", "iterator ms",
+        "batch ms"
+    );
+    for (const auto& [name, has] : keys) {
+        BitSet bs;
+        for (std::size_t i = 0; i < n; ++i) {
+            bs.set(i, has(i));
+        }
+
+        std::size_t sink  = 0;
+        auto        start = Clock::now();
+        for (auto it = bs.rbegin(); it != bs.rend(); ++it) {
+            sink += *it;
+        }
+        const double iterMs = secondsSince(start) * 1e3;
+
+        std::size_t batchSink = 0;
+        start                 = Clock::now();
+        std::array<std::size_t, 256> batch;
+        for (std::size_t from = bs.size() - 1, got;
+             (got = bs.prevSetBits(from, batch.data(), batch.size())) > 0;
+             from = batch[got - 1] - 1) {
+            for (std::size_t i = 0; i < got; ++i) {
+                batchSink += batch[i];
+            }
+        }
+        const double batchMs = secondsSince(start) * 1e3;
+
+        fmt::println(
+            "{:<12} {:>10} {:>14.2f} {:>12.2f}{}", name, bs.count(), iterMs,
+            batchMs, sink == batchSink ? "" : "  MISMATCH"
+        );
+    }
+
+    // the newest 1000 lines holding three keys, as the query service asks
+    // for them: materializing the intersection first, and streaming it
+    BitSet a;
+    BitSet b;
+    BitSet c;
+    for (std::size_t i = 0; i < n; ++i) {
+        a.set(i, rand() % 2 == 0);
+        b.set(i, rand() % 3 != 0);
+        c.set(i, rand() % 10 == 0);
+    }
+    const BitSet*                 sets[] = {&a, &b, &c};
+    std::array<std::size_t, 1000> newest;
+
+    auto         start = Clock::now();
+    const BitSet all   = BitSet::intersectAll(sets, n);
+    const auto   eager = all.prevSetBits(n - 1, newest.data(), newest.size());
+    const double eagerMs = secondsSince(start) * 1e3;
+
+    start = Clock::now();
+    BitCursor    cursor(BitAllOf(sets, n));
+    const auto   lazy = cursor.prevSetBits(n - 1, newest.data(), newest.size());
+    const double lazyMs = secondsSince(start) * 1e3;
+    fmt::println(
+        "newest {} of a & b & c: intersectAll {:.2f} ms, BitCursor {:.3f} ms{}",
+        newest.size(), eagerMs, lazyMs, eager == lazy ? "" : "  MISMATCH"
+    );
+}
+
+double cpuSeconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    auto tv = [](timeval t) { return t.tv_sec + t.tv_usec / 1e6; };
+    return tv(usage.ru_utime) + tv(usage.ru_stime);
+}
+
+// Append-to-visible latency: time from writing one line to the followed file
+// until the Index holding it arrives on the channel. Also reports the CPU the
+// process burns while the file sits idle.
+void benchFollow(const std::string& path, FollowMode mode) {
+    constexpr int rounds = 200;
+
+    std::ofstream out(path, std::ios::trunc);
+    out << json{{"msg", "warmup"}}.dump() << std::endl;
+
+    folly::MPMCQueue<Msg> channel(100);
+    std::atomic<bool>     shouldShutdown(false);
+    FileWatcher           watcher(path, mode);
+    std::thread           ingestor =
+        spawnIngestor(channel, path, watcher, shouldShutdown);
+
+    Msg msg;
+    channel.blockingRead(msg);
+
+    double idleStart = cpuSeconds();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    double idleCpu = cpuSeconds() - idleStart;
+
+    std::vector<double> latencies;
+    for (int i = 0; i < rounds; ++i) {
+        // stagger writes across the poll interval
+        std::this_thread::sleep_for(std::chrono::microseconds(1000 + i * 37));
+        auto start = Clock::now();
+        out << json{{"count", i}}.dump() << std::endl;
+        channel.blockingRead(msg);
+        latencies.push_back(secondsSince(start) * 1e3);
+    }
+
+    shouldShutdown.store(true);
+    watcher.wake();
+    ingestor.join();
+    std::filesystem::remove(path);
+
+    std::ranges::sort(latencies);
+    double mean = 0;
+    for (double l : latencies) {
+        mean += l / rounds;
+    }
+    fmt::println(
+        "{:<10} latency ms: mean {:.3f}  p50 {:.3f}  p99 {:.3f}  "
+        "idle cpu: {:.1f} ms/s",
+        mode == FollowMode::Poll ? "poll" : "inotify", mean,
+        latencies[rounds / 2], latencies[rounds * 99 / 100], idleCpu * 1e3
+    );
+}
+
+int main(int argc, char** argv) {
+    constexpr const char* usage =
+        "Usage:\n"
+        "  bench_main gen <file> <lines>\n"
+        "  bench_main ingest <file>\n"
+        "  bench_main parse <file>\n"
+        "  bench_main memory <file>\n"
+        "  bench_main query <file> <query>...\n"
+        "  bench_main predicates <file> <query>...\n"
+        "  bench_main segments <file> <query>...\n"
+        "  bench_main bitset <lines>\n"
+        "  bench_main merge <lines>\n"
+        "  bench_main scan <lines>\n"
+        "  bench_main follow <scratch file>";
+
+    if (argc < 3) {
+        fmt::println("{}", usage);
+        return 1;
+    }
+    std::string cmd  = argv[1];
+    std::string path = argv[2];
+
+    if (cmd == "gen" && argc == 4) {
+        generate(path, std::stoull(argv[3]));
+    } else if (cmd == "ingest") {
+        benchIngest(path);
+    } else if (cmd == "parse") {
+        benchParse(path);
+    } else if (cmd == "memory") {
+        benchMemory(path);
+    } else if (cmd == "query" && argc > 3) {
+        benchQuery(path, std::vector<std::string>(argv + 3, argv + argc));
+    } else if (cmd == "predicates" && argc > 3) {
+        benchPredicates(path, std::vector<std::string>(argv + 3, argv + argc));
+    } else if (cmd == "segments" && argc > 3) {
+        benchSegments(path, std::vector<std::string>(argv + 3, argv + argc));
+    } else if (cmd == "bitset") {
+        benchBitset(std::stoull(path));
+    } else if (cmd == "merge") {
+        benchMerge(std::stoull(path));
+    } else if (cmd == "scan") {
+        benchScan(std::stoull(path));
+    } else if (cmd == "follow") {
+        benchFollow(path, FollowMode::Poll);
+        if (kInotifySupported) {
+            benchFollow(path, FollowMode::Inotify);
+        }
+    } else {
+        fmt::println("{}", usage);
+        return 1;
+    }
+}
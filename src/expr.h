@@ -2,30 +2,28 @@
 
 #include <fmt/core.h>
 
+#include <algorithm>
 #include <boost/fusion/include/adapt_struct.hpp>
+#include <cctype>
+#include <cstdint>
+#include <limits>
 #include <nlohmann/json.hpp>
 #include <optional>
+#include <span>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <variant>
+#include <vector>
 
+#include "utils/key_dictionary.h"
 #include "utils/string_utils.h"
 
 using json = nlohmann::ordered_json;
 
 struct Value {
    public:
-    static std::optional<Value> from_json(const json& val) {
-        if (val.is_number()) {
-            return Value(val.get<double>());
-        }
-        if (val.is_string()) {
-            return Value(val.get<std::string>());
-        }
-        return std::nullopt;
-    }
-
     explicit Value(double val) : v(val) {}
     explicit Value(const std::string& val) : v(val) {}
 
@@ -80,6 +78,38 @@ struct Value {
         return v > other.v;
     }
 
+    // Sign of `val` <=> this value in the order above, where every string
+    // sorts before every number, read from the json in place. nullopt if
+    // `val` is neither a number nor a string, or either is NaN.
+    [[nodiscard]] std::optional<int> orderOf(const json& val) const {
+        if (val.is_number()) {
+            const auto* num = std::get_if<double>(&v);
+            if (num == nullptr) {
+                return 1;
+            }
+            const auto x = val.get<double>();
+            if (x < *num) {
+                return -1;
+            }
+            if (x > *num) {
+                return 1;
+            }
+            if (x == *num) {
+                return 0;
+            }
+            return std::nullopt;
+        }
+        if (val.is_string()) {
+            const auto* str = std::get_if<std::string>(&v);
+            if (str == nullptr) {
+                return -1;
+            }
+            const int c = val.get_ref<const std::string&>().compare(*str);
+            return (c > 0) - (c < 0);
+        }
+        return std::nullopt;
+    }
+
     [[nodiscard]] bool is_num() const {
         return std::holds_alternative<double>(v);
     }
@@ -89,10 +119,31 @@ struct Value {
     double& get_num() {
         return std::get<double>(v);
     }
+    [[nodiscard]] double get_num() const {
+        return std::get<double>(v);
+    }
     std::string& get_str() {
         return std::get<std::string>(v);
     }
 
+    // Key of this value in an Index's per-value bitmaps, see ValueBitsets.
+    // Strings and numbers never share a key, matching `operator==`.
+    [[nodiscard]] std::string indexKey() const {
+        if (const auto* val = std::get_if<double>(&v)) {
+            return numberKey(*val);
+        }
+        return stringKey(std::get<std::string>(v));
+    }
+    static std::string numberKey(double val) {
+        // -0 == 0, so they share a key
+        return fmt::format("n:{}", val == 0 ? 0.0 : val);
+    }
+    static std::string stringKey(std::string_view val) {
+        std::string key = "s:";
+        key.append(val);
+        return key;
+    }
+
     [[nodiscard]] std::string to_string() const {
         if (const auto* val = std::get_if<double>(&v)) {
             return fmt::format("{}", *val);
@@ -105,10 +156,72 @@ struct Value {
     std::variant<std::string, double> v;
 };
 
+// One segment of a Path: the key when the value it's looked up in is an
+// object, or the position when that's an array (kNoIndex if the key isn't
+// one, as json_pointer reads it)
+struct PathStep {
+    static constexpr std::size_t kNoIndex =
+        std::numeric_limits<std::size_t>::max();
+
+    std::string key;
+    std::size_t index = kNoIndex;
+
+    explicit PathStep(std::string k) : key(std::move(k)) {
+        if (!key.empty() && key.size() <= 18 &&
+            (key.size() == 1 || key.front() != '0') &&
+            std::ranges::all_of(key, ::isdigit)) {
+            index = std::stoull(key);
+        }
+    }
+};
+
+// The value at `steps` in `line`, or nullptr if it isn't there. Walks the line
+// once, unlike `contains` followed by `at`. If given, `hints` holds a guess per
+// step of the key's position in its object, tried before searching and updated
+// after: lines of one shape then find each key with a single comparison.
+const json* resolvePath(
+    const json&               line,
+    std::span<const PathStep> steps,
+    std::uint32_t*            hints = nullptr
+) {
+    const json* value = &line;
+    for (std::size_t s = 0; s < steps.size(); ++s) {
+        const PathStep& step = steps[s];
+        if (value->is_object()) {
+            const auto& obj   = value->get_ref<const json::object_t&>();
+            const auto  first = obj.begin();
+            std::size_t at    = hints != nullptr ? hints[s] : 0;
+            if (at >= obj.size() || first[at].first != step.key) {
+                at = 0;
+                while (at < obj.size() && first[at].first != step.key) {
+                    ++at;
+                }
+                if (at == obj.size()) {
+                    return nullptr;
+                }
+                if (hints != nullptr) {
+                    hints[s] = at;
+                }
+            }
+            value = &first[at].second;
+        } else if (value->is_array() && step.index < value->size()) {
+            value = &(*value)[step.index];
+        } else {
+            return nullptr;
+        }
+    }
+    return value;
+}
+
 struct Path {
     json::json_pointer ptr{""};
-    std::size_t        frontHash{};
-    bool               isWildCard = false;
+    // The leading segments the ingestor files the path under, each key nested
+    // in the one before it. Stops before the first segment that could be an
+    // array index, since keys below arrays aren't indexed.
+    std::vector<std::string> keys;
+    std::vector<PathStep>    steps;    // every segment; none for a wildcard
+    std::size_t              depth{};  // number of segments
+    bool                     isWildCard = false;
 
     Path() = default;
 
@@ -130,9 +243,6 @@ struct Path {
     }
 
     bool operator==(const Path& other) const {
-        if (this->frontHash != other.frontHash) {
-            return false;
-        }
         return this->ptr == other.ptr;
     }
 
@@ -140,12 +250,42 @@ struct Path {
         return ptr.to_string();
     }
 
+    // The value at this path in `line`, or nullptr if it isn't there
+    [[nodiscard]] const json* find(const json& line) const {
+        return resolvePath(line, steps);
+    }
+
+    // prefixIds()[i] is the id of the first i + 1 keys in `dict`. Stops at the
+    // first prefix that was never interned, since no line holds it.
+    [[nodiscard]] std::vector<KeyId> prefixIds(
+        const KeyDictionary& dict = KeyDictionary::global()
+    ) const {
+        std::vector<KeyId> ids;
+        KeyId              parent = KeyDictionary::kRoot;
+        for (const auto& key : keys) {
+            const auto id = dict.find(parent, key);
+            if (!id) {
+                break;
+            }
+            ids.push_back(parent = *id);
+        }
+        return ids;
+    }
+
    private:
     void make(const std::vector<std::string>& segments) {
         for (const auto& seg : segments) {
             ptr.push_back(seg);
+            steps.emplace_back(seg);
+        }
+        depth = segments.size();
+
+        for (const auto& seg : segments) {
+            if (!seg.empty() && std::ranges::all_of(seg, ::isdigit)) {
+                break;
+            }
+            keys.push_back(seg);
         }
-        frontHash = std::hash<std::string>()(segments.front());
     }
 };
 
@@ -183,41 +323,40 @@ class Expr {
     }
 
     [[nodiscard]] bool matches(const json& line) const {
-        if (!line.contains(path.ptr)) {
-            return false;
-        }
-        return opMatches(line);
+        return matchesValue(path.find(line));
     }
 
-    [[nodiscard]] bool opMatches(const json& line) const {
+    // Whether `value`, found at `path` in a line (nullptr if it isn't there),
+    // satisfies this expr
+    [[nodiscard]] bool matchesValue(const json* value) const {
+        if (value == nullptr) {
+            return false;
+        }
         if (!op) {
             // trivially true
             return true;
         }
         // rhs better be there if op is
         assert(rhs);
-        auto val = Value::from_json(line.at(path.ptr));
-        if (!val) {
-            return false;
-        }
+        const auto order = rhs->orderOf(*value);
+        return order && holds(*op, *order);
+    }
 
-        switch (*op) {
-            case Expr::Op::eq:
-                // Log::info("[FilterLine]: op is eq");
-                return val == rhs;
-            case Expr::Op::lt:
-                // Log::info("[FilterLine]: op is lt");
-                return val < rhs;
-            case Expr::Op::gt:
-                // Log::info("[FilterLine]: op is gt");
-                return val > rhs;
-            case Expr::Op::in:
-                // Log::info("[FilterLine]: op is in");
-                return false;
-            case Expr::Op::fzf:
-                // Log::info("[FilterLine]: op is fzf");
+    // Whether `op` holds between a value and the rhs when `order` is the sign
+    // of value <=> rhs, see Value::orderOf
+    static bool holds(Op op, int order) {
+        switch (op) {
+            case Op::lt:
+                return order < 0;
+            case Op::eq:
+                return order == 0;
+            case Op::gt:
+                return order > 0;
+            case Op::in:
+            case Op::fzf:
                 return false;
         }
+        return false;
     }
 
     static std::string op_str(Op op) {
@@ -251,6 +390,30 @@ class Expr {
         return j;
     }
 
+    // Whether every line this matches is also matched by `other`, e.g.
+    // `count > 10` implies `count > 5` and `count`
+    [[nodiscard]] bool implies(const Expr& other) const {
+        if (!(path == other.path)) {
+            return false;
+        }
+        if (!other.op) {
+            return true;  // `other` only needs the path to be there
+        }
+        if (!op || !rhs || !other.rhs) {
+            return false;
+        }
+        switch (*other.op) {
+            case Op::gt:
+                return (*op == Op::gt && !(*rhs < *other.rhs)) ||
+                       (*op == Op::eq && *rhs > *other.rhs);
+            case Op::lt:
+                return (*op == Op::lt && !(*rhs > *other.rhs)) ||
+                       (*op == Op::eq && *rhs < *other.rhs);
+            default:
+                return *this == other;
+        }
+    }
+
     bool operator==(const Expr& a) const {
         return path == a.path && op == a.op && rhs == a.rhs;
     }
@@ -2,22 +2,385 @@
 
 #include <folly/MPMCQueue.h>
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <thread>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "utils/bitset.h"
+#include "utils/file_watcher.h"
+#include "utils/json_scan.h"
+#include "utils/line_source.h"
 #include "utils/logging.h"
+#include "utils/mapped_file.h"
+#include "utils/worker_pool.h"
 #include "types.h"
 
-void updateIndex(Index& index, json&& obj) {
-    auto        keyHash = std::hash<std::string>();
-    std::size_t lineNum = index.lines.size();
+// Record that line `lineNum` holds a string or number at the key path `key`,
+// demoting the path once it goes past `index.config.valueCap`
+// distinct values. `makeKey()` returns the value's `Value::indexKey()` and is
+// only called while the path is still tracked.
+template <typename MakeKey>
+void indexValue(
+    Index&      index,
+    std::size_t lineNum,
+    KeyId       key,
+    MakeKey&&   makeKey
+) {
+    if (index.config.valueCap == 0) {
+        return;
+    }
+    ValueBitsets& values = index.values[key];
+    if (values.demoted) {
+        return;
+    }
+    std::string value = makeKey();
+    auto        it    = values.lines.find(value);
+    if (it == values.lines.end()) {
+        if (values.lines.size() == index.config.valueCap) {
+            values.demote();
+            return;
+        }
+        it = values.lines.emplace(std::move(value), BitSet()).first;
+    }
+    it->second.set(lineNum, true);
+}
+
+// Put `num` in the numeric column of `key` at line `lineNum`
+void indexNumber(Index& index, std::size_t lineNum, KeyId key, double num) {
+    if (index.config.numericColumns) {
+        index.columns[key].set(lineNum, num);
+    }
+}
+
+// Note that the key path `key` holds a string on some line
+void markMixed(Index& index, KeyId key) {
+    if (index.config.numericColumns) {
+        index.columns[key].mixed = true;
+    }
+}
+
+// Set the key bitsets for line `lineNum` of `index` from its parsed form, one
+// per key path through nested objects down to `index.config.pathDepth`, and
+// the value bitmaps of the strings and numbers found along the way
+void indexKeys(
+    Index&      index,
+    std::size_t lineNum,
+    const json& obj,
+    KeyId       parent = KeyDictionary::kRoot,
+    std::size_t depth  = 1
+) {
+    if (!obj.is_object() || depth > index.config.pathDepth) {
+        return;
+    }
+    auto& dict = KeyDictionary::global();
     for (const auto& it : obj.items()) {
-        const auto& key  = it.key();
-        std::size_t hash = keyHash(key);
-        index.bitsets[hash].set(lineNum, true);
+        const KeyId key = dict.intern(parent, it.key());
+        index.bitsets[key].set(lineNum, true);
+
+        const json& value = it.value();
+        if (value.is_string()) {
+            markMixed(index, key);
+            indexValue(index, lineNum, key, [&]() {
+                return Value::stringKey(value.get_ref<const std::string&>());
+            });
+        } else if (value.is_number()) {
+            const auto num = value.get<double>();
+            indexNumber(index, lineNum, key, num);
+            indexValue(index, lineNum, key, [&]() {
+                return Value::numberKey(num);
+            });
+        } else {
+            indexKeys(index, lineNum, value, key, depth + 1);
+        }
+    }
+}
+
+// Whether a raw token from `json_scan::forEachKey` is a string or number, as
+// opposed to an object, array, true, false or null
+bool isRawValue(std::string_view token) {
+    return !token.empty() && token.front() != '{' && token.front() != '[' &&
+           token.front() != 't' && token.front() != 'f' && token.front() != 'n';
+}
+
+// Index a raw string or number token as the value of the key path `key` on
+// line `lineNum`
+void indexRawValue(
+    Index&           index,
+    std::size_t      lineNum,
+    KeyId            key,
+    std::string_view token
+) {
+    if (token.front() == '"') {
+        markMixed(index, key);
+        indexValue(index, lineNum, key, [&]() {
+            auto str = token.substr(1, token.size() - 2);
+            return Value::stringKey(
+                str.find('\\') == std::string_view::npos
+                    ? std::string(str)
+                    : json_scan::unescapeKey(str)
+            );
+        });
+        return;
+    }
+    double     num{};
+    const auto end = token.data() + token.size();
+    if (std::from_chars(token.data(), end, num).ec != std::errc()) {
+        // out of range for a double: read it the way the DOM parser does,
+        // which takes underflow as 0 and rejects overflow, and leave a number
+        // it rejects out of the columns and value bitmaps
+        const json parsed = json::parse(token, nullptr, false);
+        if (!parsed.is_number()) {
+            return;
+        }
+        num = parsed.get<double>();
+    }
+    indexNumber(index, lineNum, key, num);
+    indexValue(index, lineNum, key, [&]() {
+        return Value::numberKey(num);
+    });
+}
+
+void updateIndex(Index& index, json&& obj) {
+    if (index.config.storage == LineStorage::Offsets) {
+        throw std::runtime_error(
+            "Offsets storage needs lines read from a file"
+        );
+    }
+    indexKeys(index, index.size(), obj);
+    if (index.config.storage == LineStorage::Raw) {
+        index.raw.append(obj.dump());
+    } else {
+        index.lines.push_back(std::move(obj));
     }
-    index.lines.push_back(std::move(obj));
+}
+
+// Index one raw line (without its newline) using `index.config.parser`. With
+// raw storage and the scan parser the line is never parsed into a DOM here.
+// `offset` is where the line starts in `index.source`, for Offsets storage.
+void updateIndexRaw(
+    Index&           index,
+    std::string_view line,
+    std::uint64_t    offset = 0
+) {
+    const std::size_t lineNum = index.size();
+    switch (index.config.parser) {
+        case ParseBackend::Dom: {
+            json obj = json::parse(line, nullptr, false);
+            if (index.config.storage == LineStorage::Dom) {
+                updateIndex(index, std::move(obj));
+                return;
+            }
+            indexKeys(index, lineNum, obj);
+            break;
+        }
+        case ParseBackend::Scan: {
+            // keys[d] is the key path of the latest key seen at depth d + 1
+            thread_local std::vector<KeyId> keys;
+            keys.resize(index.config.pathDepth + 1);
+            auto& dict = KeyDictionary::global();
+            json_scan::forEachKey(
+                line, index.config.pathDepth,
+                [&](std::size_t      depth,
+                    std::string_view raw,
+                    std::string_view value) {
+                    const KeyId parent =
+                        depth > 1 ? keys[depth - 2] : KeyDictionary::kRoot;
+                    const KeyId key =
+                        raw.find('\\') == std::string_view::npos
+                            ? dict.intern(parent, raw)
+                            : dict.intern(parent, json_scan::unescapeKey(raw));
+                    keys[depth - 1] = key;
+                    index.bitsets[key].set(lineNum, true);
+                    if (isRawValue(value)) {
+                        indexRawValue(index, lineNum, key, value);
+                    }
+                }
+            );
+            if (index.config.storage == LineStorage::Dom) {
+                // the line is kept as DOM, so it's materialized anyway
+                index.lines.push_back(json::parse(line, nullptr, false));
+                return;
+            }
+            break;
+        }
+    }
+    if (index.config.storage == LineStorage::Offsets) {
+        if (!index.source) {
+            throw std::runtime_error("Offsets storage needs a LineSource");
+        }
+        index.offsets.append(index.source, offset, line.size());
+    } else {
+        index.raw.append(line);
+    }
+}
+
+// Index every complete line in `data`, which starts at byte `offset` of
+// `index.source`, returning the number of bytes consumed (up to and including
+// the last newline).
+std::size_t indexLines(
+    Index&           index,
+    std::string_view data,
+    std::uint64_t    offset = 0
+) {
+    std::size_t committed = 0;
+    while (committed < data.size()) {
+        const auto* begin = data.data() + committed;
+        const auto* nl    = static_cast<const char*>(
+            std::memchr(begin, '\n', data.size() - committed)
+        );
+        if (nl == nullptr) {
+            break;
+        }
+        updateIndexRaw(
+            index, std::string_view(begin, nl - begin), offset + committed
+        );
+        committed = nl - data.data() + 1;
+    }
+    return committed;
+}
+
+// Smallest range of bytes `indexInParallel` hands a worker by default
+constexpr std::size_t kMinChunkBytes = 1 << 20;
+
+// Index the complete lines of `data` on `config.initialThreads` workers. The
+// bytes are split into ranges on newline boundaries, each worker builds a
+// partial Index of its range, and the partials are stitched together with a
+// tree of `mergeIndex` calls (pairs merged concurrently at each level).
+// Returns the Index, starting at line `startIdx`, and the bytes consumed.
+// Ranges are kept to at least `minChunkBytes` so small files stay on one
+// thread. For Offsets storage, `data` is the bytes of `source` from `offset`.
+// The work runs on this thread and `pool`, or on threads started for the call
+// if there's no pool to reuse.
+std::pair<Index, std::size_t> indexInParallel(
+    std::string_view                  data,
+    std::size_t                       startIdx,
+    IndexConfig                       config,
+    std::size_t                       minChunkBytes = kMinChunkBytes,
+    std::shared_ptr<const LineSource> source        = {},
+    std::uint64_t                     offset        = 0,
+    WorkerPool*                       pool          = nullptr
+) {
+    const auto lastNewline = data.rfind('\n');
+    data = lastNewline == std::string_view::npos
+             ? std::string_view()
+             : data.substr(0, lastNewline + 1);
+
+    const std::size_t workers = std::clamp<std::size_t>(
+        data.size() / minChunkBytes, 1, std::max(config.initialThreads, 1U)
+    );
+    std::vector<std::string_view> chunks;
+    for (std::size_t w = 1, pos = 0; pos < data.size(); ++w) {
+        std::size_t end = data.size();
+        if (w < workers) {
+            end = data.find('\n', std::max(pos, data.size() * w / workers));
+            end = end == std::string_view::npos ? data.size() : end + 1;
+        }
+        chunks.push_back(data.substr(pos, end - pos));
+        pos = end;
+    }
+
+    std::optional<WorkerPool> own;
+    if (pool == nullptr) {
+        pool = &own.emplace(chunks.size() > 1 ? chunks.size() - 1 : 0);
+    }
+    // call `f(i)` for each i in [0, n), spread over the workers
+    const auto forEach = [&](std::size_t n, const auto& f) {
+        std::atomic<std::size_t> next{0};
+        pool->run(
+            [&]() {
+                for (std::size_t i = 0; (i = next.fetch_add(1)) < n;) {
+                    f(i);
+                }
+            },
+            n
+        );
+    };
+
+    std::vector<Index> parts(std::max<std::size_t>(chunks.size(), 1));
+    for (auto& part : parts) {
+        part.config = config;
+        part.source = source;
+    }
+    forEach(chunks.size(), [&](std::size_t i) {
+        const auto at = offset + (chunks[i].data() - data.data());
+        indexLines(parts[i], chunks[i], at);
+    });
+
+    parts[0].start_idx = startIdx;
+    parts[0].config    = config;
+    parts[0].source    = source;
+    for (std::size_t i = 1; i < parts.size(); ++i) {
+        const auto& prev   = parts[i - 1];
+        parts[i].start_idx = prev.start_idx + prev.size();
+    }
+
+    for (std::size_t step = 1; step < parts.size(); step *= 2) {
+        const std::size_t pairs = (parts.size() - 1 + step) / (2 * step);
+        forEach(pairs, [&](std::size_t pair) {
+            const std::size_t i = pair * 2 * step;
+            mergeIndex(parts[i], parts[i + step]);
+        });
+    }
+
+    return {std::move(parts[0]), data.size()};
+}
+
+// How the ingestor reads the log file. `Mmap` scans newline boundaries directly
+// in a memory mapping of the file, `Stream` is the original istream loop.
+enum class IngestMode {
+    Stream,
+    Mmap
+};
+
+// Where mapped ingestion starts in the log: the byte offset of the first line
+// to index and that line's number
+struct ResumePoint {
+    std::size_t byte{};
+    std::size_t line{};
+};
+
+// Upper bound on lines per Index sent while catching up on a large file, so the
+// query service sees the first lines without waiting for the whole file.
+constexpr std::size_t kMaxBatchLines = 1 << 16;
+
+// Bytes indexed per round while catching up in parallel: a full chunk for
+// every worker, and at least a few batches' worth at typical line lengths, so
+// each round is sent on and its memory freed before the next one is read.
+std::size_t catchUpWindowBytes(const IndexConfig& config) {
+    return std::max(config.initialThreads, 16U) * kMinChunkBytes;
+}
+
+// Send `index` to the query service if it's non-empty, then reset it so the
+// next batch starts right after the lines just sent.
+void sendIndex(
+    folly::MPMCQueue<Msg>& sender,
+    Index&                 index,
+    std::size_t&           lastLineNumberSent
+) {
+    if (index.size() == 0) {
+        return;
+    }
+    if (index.start_idx > lastLineNumberSent + 1) {
+        throw std::runtime_error(
+            "Tried to send an Index with start_idx greater than 1 + "
+            "lastLineNumberSent"
+        );
+    }
+    auto new_start_idx = index.start_idx + index.size();
+    lastLineNumberSent = new_start_idx - 1;
+    sender.blockingWrite(std::move(index));
+    // reset index after sending
+    index.start_idx = new_start_idx;
+    index.clear();
 }
 
 // call like: std::thread producerThread(startIngesting, std::ref(queue),
@@ -25,12 +388,14 @@ void updateIndex(Index& index, json&& obj) {
 void startIngesting(
     folly::MPMCQueue<Msg>& sender,
     std::istream&          file,
-    std::atomic<bool>&     shouldShutdown
+    std::atomic<bool>&     shouldShutdown,
+    IndexConfig            config = {}
 ) {
     Index          index;
     std::string    line;
     std::streampos lastPosition;
-    std::size_t    lastLineNumberSent;
+    std::size_t    lastLineNumberSent{};
+    index.config = config;
 
     while (!shouldShutdown.load()) {
         lastPosition = file.tellg();
@@ -41,7 +406,7 @@ void startIngesting(
             }
 
             try {
-                updateIndex(index, json::parse(line, nullptr, false));
+                updateIndexRaw(index, line);
             } catch (const json::parse_error& e) {
                 Log::info(
                     "Failed to parse line",
@@ -52,22 +417,7 @@ void startIngesting(
             lastPosition = file.tellg();
         }
 
-        // send index if it's non-empty
-        if (index.lines.size() > 0) {
-            if (index.start_idx > lastLineNumberSent + 1) {
-                throw std::runtime_error(
-                    "Tried to send an Index with start_idx greater than 1 + "
-                    "lastLineNumberSent"
-                );
-            }
-            auto new_start_idx = index.start_idx + index.lines.size();
-            lastLineNumberSent = new_start_idx - 1;
-            sender.blockingWrite(std::move(index));
-            // reset index after sending
-            index.start_idx = new_start_idx;
-            index.lines.clear();
-            index.bitsets.clear();
-        }
+        sendIndex(sender, index, lastLineNumberSent);
 
         file.clear();              // Clear the EOF flag
         file.seekg(lastPosition);  // Reset cursor to the last position
@@ -76,10 +426,169 @@ void startIngesting(
     }
 }
 
+// Same contract as `startIngesting`, but reads through a memory mapping of
+// `path`, starting at `from` (e.g. where an index sidecar left off).
+// `committed` is the byte offset just past the last complete line handed to
+// `updateIndexRaw`; a trailing partial line stays uncommitted until its newline
+// shows up. Between scans the thread blocks in `watcher.wait()`. If the file is
+// rotated away, whatever was left in it is drained before following the new
+// file at `path` from its first byte. A file truncated in place (copytruncate)
+// is likewise followed again from its first byte, as soon as a scan sees it
+// shorter than before. With Offsets storage each file is also opened as the
+// LineSource its lines are read back from, and a truncation sends
+// LogTruncated so the lines indexed before it are dropped.
+void startIngestingMapped(
+    folly::MPMCQueue<Msg>& sender,
+    const std::string&     path,
+    FileWatcher&           watcher,
+    std::atomic<bool>&     shouldShutdown,
+    IndexConfig            config = {},
+    ResumePoint            from   = {}
+) {
+    std::optional<MappedFile> file(std::in_place, path);
+    Index                     index;
+    std::size_t               committed = std::min(from.byte, file->size());
+    std::size_t               lastLineNumberSent{};
+    index.config    = config;
+    index.start_idx = from.line;
+    if (from.line > 0) {
+        lastLineNumberSent = from.line - 1;
+    }
+    const auto openSource = [&]() {
+        return config.storage == LineStorage::Offsets
+                   ? std::make_shared<const LineSource>(path)
+                   : nullptr;
+    };
+    index.source = openSource();
+
+    // catch up on what's already in the file with all workers, a window at a
+    // time, then follow the tail on this thread
+    if (config.initialThreads > 1) {
+        WorkerPool workers(config.initialThreads - 1);
+        while (committed < file->size() && !shouldShutdown.load()) {
+            auto [window, consumed] = indexInParallel(
+                file->view().substr(committed, catchUpWindowBytes(config)),
+                index.start_idx, config, kMinChunkBytes, index.source,
+                committed, &workers
+            );
+            if (consumed == 0) {
+                break;  // a line longer than the window; drain() takes it
+            }
+            committed += consumed;
+            sendIndex(sender, window, lastLineNumberSent);
+            index.start_idx = window.start_idx;
+        }
+    }
+
+    auto drain = [&]() {
+        if (file->remap() == MappedFile::Change::Shrank) {
+            index.source = openSource();
+            committed    = 0;
+            // lines sent so far only point at bytes that are gone now
+            if (config.storage == LineStorage::Offsets) {
+                sender.blockingWrite(LogTruncated{});
+                index.start_idx    = 0;
+                lastLineNumberSent = 0;
+            }
+        }
+        const char* data = file->data();
+        const auto  size = file->size();
+
+        while (committed < size && !shouldShutdown.load()) {
+            const auto* begin = data + committed;
+            const auto* nl    = static_cast<const char*>(
+                std::memchr(begin, '\n', size - committed)
+            );
+            if (nl == nullptr) {
+                break;
+            }
+            updateIndexRaw(
+                index, std::string_view(begin, nl - begin), committed
+            );
+            committed = nl - data + 1;
+
+            if (index.size() >= kMaxBatchLines) {
+                sendIndex(sender, index, lastLineNumberSent);
+            }
+        }
+        sendIndex(sender, index, lastLineNumberSent);
+    };
+
+    // the replacement can vanish or be unreadable by the time it is opened;
+    // keep waiting for the next event rather than taking the thread down
+    const auto reopen = [&]() {
+        try {
+            file.emplace(path);
+            index.source = openSource();
+            committed    = 0;
+        } catch (const std::runtime_error&) {
+            file.reset();
+        }
+    };
+
+    while (!shouldShutdown.load()) {
+        if (!file) {
+            reopen();
+        }
+        if (file) {
+            drain();
+        }
+
+        const unsigned events = watcher.wait();
+        if ((events & FileWatcher::Replaced) != 0U && watcher.rewatch()) {
+            if (file) {
+                drain();
+            }
+            reopen();
+        }
+    }
+}
+
+void startIngestingMapped(
+    folly::MPMCQueue<Msg>& sender,
+    const std::string&     path,
+    std::atomic<bool>&     shouldShutdown
+) {
+    FileWatcher watcher(path, FollowMode::Poll);
+    startIngestingMapped(sender, path, watcher, shouldShutdown);
+}
+
 std::thread spawnIngestor(
     folly::MPMCQueue<Msg>& sender,
     std::istream&          file,
+    std::atomic<bool>&     shouldShutdown,
+    IndexConfig            config = {}
+) {
+    return std::thread([&, config]() {
+        startIngesting(sender, file, shouldShutdown, config);
+    });
+}
+
+std::thread spawnIngestor(
+    folly::MPMCQueue<Msg>& sender,
+    const std::string&     path,
     std::atomic<bool>&     shouldShutdown
 ) {
-    return std::thread([&]() { startIngesting(sender, file, shouldShutdown); });
+    return std::thread([&sender, path, &shouldShutdown]() {
+        startIngestingMapped(sender, path, shouldShutdown);
+    });
+}
+
+// `watcher` must outlive the thread; call `watcher.wake()` after setting
+// `shouldShutdown` so a blocked wait returns promptly.
+std::thread spawnIngestor(
+    folly::MPMCQueue<Msg>& sender,
+    const std::string&     path,
+    FileWatcher&           watcher,
+    std::atomic<bool>&     shouldShutdown,
+    IndexConfig            config = {},
+    ResumePoint            from   = {}
+) {
+    return std::thread(
+        [&sender, path, &watcher, &shouldShutdown, config, from]() {
+            startIngestingMapped(
+                sender, path, watcher, shouldShutdown, config, from
+            );
+        }
+    );
 }
@@ -6,13 +6,17 @@
 #include <folly/Synchronized.h>
 
 #include <atomic>
+#include <filesystem>
 #include <fstream>
+#include <optional>
 #include <string>
 #include <thread>
 
 #include "ingestor.h"
+#include "options.h"
 #include "utils/logging.h"
 #include "query_service.h"
+#include "sidecar.h"
 #include "ui.h"
 
 /*
@@ -20,12 +24,15 @@
  * - start_idx: int // the line number from the log file this index begins with;
  * used for partial indexes
  * - lines: Vec<json>
- * - bitsets: HashMap<"Hash of first key in json pointer", Bitset>
+ * - bitsets: Vec<Bitset> indexed by the KeyDictionary id of each key path
  * - Merge function updates first Index to include 2nd Index,
  *     Note: start_idx + lines.size() ranges must be overlapping or adjacent so
  *     final range is contiguous
  *
- * Ingestor: Continuously reads lines from file.
+ * Ingestor: Continuously reads lines from file, either through a memory
+ * mapping (default) or an istream (`--ingest=stream`).
+ * With the memory mapping it blocks on inotify between reads (`--follow=poll`
+ * keeps the fixed sleep).
  * When it finds a new line:
  * - parse line into json
  * - Update Index:
@@ -33,22 +40,29 @@
  *   - push json line into vec of lines
  * - When no more lines left to read, send partial Index through output channel
  * (to QueryService)
- * - Sleep then check for more lines in file
+ * - Wait for the file to change then check for more lines
  *
  * QueryService: Responsible for maaintaining full Index and running queries
  * against it
- * - Reads from in-channel either Query or Index msgs
+ * - Reads from an in-channel of two lanes: a latest-wins slot for Queries,
+ *   serviced first, and a bounded queue of Index msgs, taken several at once
  *   - On Index: merge incoming w/ master index, then re-run last query with new
  * Index
- *   - On Query: run query on master index
+ *   - On Query: run query on master index, giving up partway if the UI has
+ *     sent a newer one since
  *     - && together bitsets for all paths in query to make a single bitset
  *       filter
  *     - Iterate `lines` and apply any filter ops from query, then format output
+ *       (segments scanned newest first on `--query-threads` workers)
  *     - Update QueryResult shared state, call onResult cb to trigger ftxui
  * re-render
  *
+ * Sidecar (`<log file>.llq-idx`): the QueryService appends each sealed 64K-line
+ * segment of its index to it. On startup, if the sidecar still matches the log
+ * file, its segments are loaded and the Ingestor resumes after them.
+ *
  * UI Thread:
- * - If input parses, send to query service
+ * - If input parses, send to query service (never blocks)
  * - On render, read from shared QueryResult to populate ui
  * - If Query is invalid or returns empty result, continue showing last
  * non-empty query
@@ -57,13 +71,15 @@
 // TODO: scrollable results
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        fmt::println(
-            "LLQ (Live Log Query)\nInvalid usage, must specify a log file\n\nExample :> llq log.json"
-        );
+    std::optional<Options> opts = Options::parse(argc, argv);
+    if (!opts) {
+        fmt::println("{}", Options::usage);
+        exit(1);
+    }
+    if (!std::filesystem::exists(opts->fname)) {
+        fmt::println("File not found: {}", opts->fname);
         exit(1);
     }
-    std::string fname = argv[1];
 
     Log::disable();
     // Log::init("log.json");
@@ -75,13 +91,37 @@ int main(int argc, char** argv) {
         Log::info(s, tag);
     };
 
-    // TODO: think about correct number here
-    folly::MPMCQueue<Msg> channel(100);
+    // TODO: think about correct number of queued batches here
+    ServiceChannel channel;
+
+    // pick up from the index sidecar, if it still matches the log
+    SegmentedIndex         restored;
+    ResumePoint            resume;
+    std::optional<Sidecar> sidecar;
+    if (opts->sidecar && opts->ingestMode == IngestMode::Mmap) {
+        sidecar.emplace(opts->fname, opts->index);
+        resume = sidecar->restore(restored);
+    }
 
     // spawn ingestor to listen to log file
     std::atomic<bool> shouldShutdown(false);
-    std::ifstream     file(fname, std::ifstream::in);
-    std::thread       ingestor = spawnIngestor(channel, file, shouldShutdown);
+    FileWatcher       watcher(opts->fname, opts->followMode);
+    std::ifstream     file;
+    std::thread       ingestor;
+    switch (opts->ingestMode) {
+        case IngestMode::Mmap:
+            ingestor = spawnIngestor(
+                channel.batches, opts->fname, watcher, shouldShutdown,
+                opts->index, resume
+            );
+            break;
+        case IngestMode::Stream:
+            file.open(opts->fname, std::ifstream::in);
+            ingestor = spawnIngestor(
+                channel.batches, file, shouldShutdown, opts->index
+            );
+            break;
+    }
 
     // create onResult callback to re-render ftxui after successful query
     // evaluation
@@ -92,8 +132,10 @@ int main(int argc, char** argv) {
 
     // spawn query service
     folly::Synchronized<QueryResult> queryResult;
-    std::thread                      queryService =
-        spawnQueryService(channel, queryResult, threadSafeReRender);
+    std::thread                      queryService = spawnQueryService(
+        channel, queryResult, threadSafeReRender, std::move(restored),
+        sidecar ? &*sidecar : nullptr, opts->queryThreads
+    );
 
     // run ui
     ui(screen, channel, queryResult);
@@ -102,7 +144,8 @@ int main(int argc, char** argv) {
     {
         info("Shutting down workers...");
         shouldShutdown.store(true);
-        channel.blockingWrite(StopSignal{});
+        watcher.wake();
+        channel.batches.blockingWrite(StopSignal{});
         ingestor.join();
         queryService.join();
         info("Workers shutdown");
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <charconv>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "ingestor.h"
+
+// Command line options, e.g. `llq --ingest=stream log.json`
+struct Options {
+    std::string fname;
+    IngestMode  ingestMode = IngestMode::Mmap;
+    FollowMode  followMode =
+        kInotifySupported ? FollowMode::Inotify : FollowMode::Poll;
+    IndexConfig index{
+        .initialThreads = std::max(std::thread::hardware_concurrency(), 1U)
+    };
+    bool     sidecar      = true;
+    unsigned queryThreads = std::max(std::thread::hardware_concurrency(), 1U);
+
+    static constexpr const char* usage =
+        "LLQ (Live Log Query)\n"
+        "Usage: llq [options] <log file>\n\n"
+        "Options:\n"
+        "  --ingest=mmap|stream   how the log file is read (default: mmap)\n"
+        "  --follow=inotify|poll  how appended lines are noticed by mmap\n"
+        "                         ingestion (default: inotify if supported)\n"
+        "  --parser=dom|scan      how lines are parsed for indexing\n"
+        "                         (default: dom)\n"
+        "  --storage=dom|raw|offsets\n"
+        "                         keep lines parsed, as raw bytes parsed on\n"
+        "                         demand, or only as their place in the log\n"
+        "                         file, read back when needed (mmap ingestion\n"
+        "                         only; default: dom)\n"
+        "  --threads=N            threads indexing existing file contents with\n"
+        "                         mmap ingestion (default: all cores)\n"
+        "  --query-threads=N      threads a query scans index segments on\n"
+        "                         (default: all cores)\n"
+        "  --depth=N              index key paths down to N nested objects\n"
+        "                         (default: 4)\n"
+        "  --value-cap=N          keep per-value line bitmaps for key paths\n"
+        "                         with at most N distinct values, 0 for none\n"
+        "                         (default: 64)\n"
+        "  --columns=on|off       keep numbers in per-path columns with zone\n"
+        "                         maps for range predicates (default: on)\n"
+        "  --sidecar=on|off       keep the index in <log file>.llq-idx and\n"
+        "                         reload it on the next open, with mmap\n"
+        "                         ingestion (default: on)\n\n"
+        "Example :> llq log.json";
+
+    // Set `out` to the number after the first `prefix` chars of `arg`, if
+    // all of the rest is a number of at least `min`
+    template <typename T>
+    static bool parseNumber(
+        std::string_view arg, std::size_t prefix, T& out, T min
+    ) {
+        const auto text  = arg.substr(prefix);
+        T          value{};
+        const auto [end, ec] =
+            std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec != std::errc() || end != text.data() + text.size() ||
+            value < min) {
+            fmt::println("Invalid value: {}\n", arg);
+            return false;
+        }
+        out = value;
+        return true;
+    }
+
+    static std::optional<Options> parse(int argc, char** argv) {
+        Options opts;
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (arg == "--ingest=mmap") {
+                opts.ingestMode = IngestMode::Mmap;
+            } else if (arg == "--ingest=stream") {
+                opts.ingestMode = IngestMode::Stream;
+            } else if (arg == "--follow=inotify" && kInotifySupported) {
+                opts.followMode = FollowMode::Inotify;
+            } else if (arg == "--follow=poll") {
+                opts.followMode = FollowMode::Poll;
+            } else if (arg == "--parser=dom") {
+                opts.index.parser = ParseBackend::Dom;
+            } else if (arg == "--parser=scan") {
+                opts.index.parser = ParseBackend::Scan;
+            } else if (arg == "--storage=dom") {
+                opts.index.storage = LineStorage::Dom;
+            } else if (arg == "--storage=raw") {
+                opts.index.storage = LineStorage::Raw;
+            } else if (arg == "--storage=offsets") {
+                opts.index.storage = LineStorage::Offsets;
+            } else if (arg.starts_with("--threads=")) {
+                if (!parseNumber(arg, 10, opts.index.initialThreads, 1U)) {
+                    return std::nullopt;
+                }
+            } else if (arg.starts_with("--query-threads=")) {
+                if (!parseNumber(arg, 16, opts.queryThreads, 1U)) {
+                    return std::nullopt;
+                }
+            } else if (arg.starts_with("--depth=")) {
+                if (!parseNumber(
+                        arg, 8, opts.index.pathDepth, std::size_t{1}
+                    )) {
+                    return std::nullopt;
+                }
+            } else if (arg.starts_with("--value-cap=")) {
+                if (!parseNumber(
+                        arg, 12, opts.index.valueCap, std::size_t{0}
+                    )) {
+                    return std::nullopt;
+                }
+            } else if (arg == "--columns=on") {
+                opts.index.numericColumns = true;
+            } else if (arg == "--columns=off") {
+                opts.index.numericColumns = false;
+            } else if (arg == "--sidecar=on") {
+                opts.sidecar = true;
+            } else if (arg == "--sidecar=off") {
+                opts.sidecar = false;
+            } else if (arg.starts_with("--") || !opts.fname.empty()) {
+                fmt::println("Unrecognized argument: {}\n", arg);
+                return std::nullopt;
+            } else {
+                opts.fname = arg;
+            }
+        }
+        if (opts.fname.empty()) {
+            return std::nullopt;
+        }
+        if (opts.index.storage == LineStorage::Offsets &&
+            opts.ingestMode == IngestMode::Stream) {
+            fmt::println("--storage=offsets needs --ingest=mmap\n");
+            return std::nullopt;
+        }
+        return opts;
+    }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "expr.h"
+
+// A query's exprs compiled once into flat predicate nodes for checking many
+// lines: each path's steps laid out back to back and each line walked once
+// per expr, then compared in place with Value::orderOf. Checking a line
+// copies and allocates nothing, and agrees with Expr::matches on every line.
+// Key positions found in one line are tried first in the next, so a plan is
+// for one thread at a time; copy it to check lines on another.
+class QueryPlan {
+   public:
+    explicit QueryPlan(const std::vector<Expr>& exprs) {
+        nodes_.reserve(exprs.size());
+        for (const Expr& expr : exprs) {
+            nodes_.push_back({
+                .firstStep = static_cast<std::uint32_t>(steps_.size()),
+                .steps = static_cast<std::uint32_t>(expr.path.steps.size()),
+                .op    = expr.rhs ? expr.op : std::nullopt,
+                .rhs   = expr.rhs,
+            });
+            steps_.insert(
+                steps_.end(), expr.path.steps.begin(), expr.path.steps.end()
+            );
+        }
+        hints_.assign(steps_.size(), 0);
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return nodes_.size();
+    }
+
+    // The value at expr `i`'s path in `line`, or nullptr if it isn't there
+    [[nodiscard]] const json* find(std::size_t i, const json& line) const {
+        const Node& node = nodes_[i];
+        return resolvePath(
+            line, std::span(steps_).subspan(node.firstStep, node.steps),
+            hints_.data() + node.firstStep
+        );
+    }
+
+    // Whether `value`, found by find(i, line), satisfies expr `i`
+    [[nodiscard]] bool holds(std::size_t i, const json* value) const {
+        const Node& node = nodes_[i];
+        if (value == nullptr) {
+            return false;
+        }
+        if (!node.op) {
+            return true;
+        }
+        const auto order = node.rhs->orderOf(*value);
+        return order && Expr::holds(*node.op, *order);
+    }
+
+    // Whether `line` satisfies expr `i`
+    [[nodiscard]] bool matches(std::size_t i, const json& line) const {
+        return holds(i, find(i, line));
+    }
+
+    // Whether `line` satisfies every expr
+    [[nodiscard]] bool matches(const json& line) const {
+        for (std::size_t i = 0; i < nodes_.size(); ++i) {
+            if (!matches(i, line)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // matches(line), leaving the value found for each expr in `values` for
+    // projecting the line; valid only if every expr held
+    [[nodiscard]] bool matches(
+        const json& line, std::vector<const json*>& values
+    ) const {
+        values.resize(nodes_.size());
+        for (std::size_t i = 0; i < nodes_.size(); ++i) {
+            if (!holds(i, values[i] = find(i, line))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+   private:
+    struct Node {
+        std::uint32_t           firstStep;
+        std::uint32_t           steps;
+        std::optional<Expr::Op> op;  // unset: the path being there is enough
+        std::optional<Value>    rhs;
+    };
+
+    std::vector<Node>                  nodes_;
+    std::vector<PathStep>              steps_;  // every node's path in turn
+    mutable std::vector<std::uint32_t> hints_;  // see resolvePath
+};
@@ -5,11 +5,20 @@
 #include <folly/Synchronized.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <functional>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <stdexcept>
+#include <thread>
 
+#include "query_plan.h"
+#include "sidecar.h"
 #include "types.h"
 #include "utils/logging.h"
+#include "utils/worker_pool.h"
 
 // helper type for the visitor
 template <class... Ts>
@@ -20,65 +29,121 @@ struct overloaded : Ts... {
 template <class... Ts>
 overloaded(Ts...) -> overloaded<Ts...>;
 
-bool mergeIndex(Index& index, Index& other, bool throw_on_gap = true) {
-    // assumption:
-    assert(index.start_idx <= other.start_idx);
-
-    const auto a_s     = index.start_idx;
-    const auto a_e     = a_s + index.lines.size() - 1;
-    const auto b_s     = other.start_idx;
-    const auto b_e     = b_s + other.lines.size() - 1;
-    const bool a_gap_b = b_s > a_e + 1;
-    if (a_gap_b) {
-        // can't merge if combining ranges results in a gap (i.e. result must be
-        // contiguous)
-        if (throw_on_gap) {
-            throw std::runtime_error(fmt::format(
-                "Merging incoming index results in a gap. a_e: {}, b_s: {}",
-                a_e, b_s
-            ));
-        }
+// Whether `path` has its own bitsets in `index`, as opposed to being
+// covered only through a prefix
+bool indexedInFull(const Index& index, const Path& path) {
+    return !path.isWildCard && path.depth <= index.config.pathDepth &&
+           path.keys.size() == path.depth;
+}
+
+// Whether `index` can answer `expr` from its value bitmaps alone: an equality
+// on a path indexed in full whose values haven't been demoted
+bool answeredByValues(const Index& index, const Expr& expr) {
+    if (index.config.valueCap == 0 || expr.op != Expr::Op::eq || !expr.rhs ||
+        !indexedInFull(index, expr.path)) {
         return false;
     }
+    const auto* values =
+        index.values.find(KeyDictionary::global().find(expr.path.keys));
+    return values == nullptr || !values->demoted;
+}
 
-    // fmt::println("{} {}, {} {}", a_s, a_e, b_s, b_e);
-
-    const auto b_start_idx      = a_e + 1 - b_s;
-    const auto a_idx_from_b_idx = [=](std::size_t b_idx) {
-        return b_idx + b_s;
-    };
-
-    for (auto b_idx = b_start_idx; b_idx < other.lines.size(); ++b_idx) {
-        index.lines.push_back(std::move(other.lines[b_idx]));
+// The numeric column that answers `expr` on its own, if there is one: a
+// comparison with a number on a path indexed in full. Strings sort before
+// numbers, so `<` and `>` also need the path to never hold a string.
+const NumericColumn* answeringColumn(const Index& index, const Expr& expr) {
+    if (!index.config.numericColumns || !expr.op || !expr.rhs ||
+        !expr.rhs->is_num() || !indexedInFull(index, expr.path)) {
+        return nullptr;
+    }
+    if (*expr.op != Expr::Op::lt && *expr.op != Expr::Op::gt &&
+        *expr.op != Expr::Op::eq) {
+        return nullptr;
     }
+    const auto* column =
+        index.columns.find(KeyDictionary::global().find(expr.path.keys));
+    if (column == nullptr || (column->mixed && *expr.op != Expr::Op::eq)) {
+        return nullptr;
+    }
+    return column;
+}
+
+// Whether the filter from `linesWithPathRoot` already guarantees `expr` holds
+bool answeredByIndex(const Index& index, const Expr& expr) {
+    return answeredByValues(index, expr) ||
+           answeringColumn(index, expr) != nullptr;
+}
 
-    for (const auto& [k, other_bitset] : other.bitsets) {
-        BitSet& bitset = index.bitsets[k];
-        for (std::size_t i = a_e + 1 - b_s; i < other_bitset.size(); ++i) {
-            bitset.set(a_idx_from_b_idx(i), other_bitset[i]);
+// Whether `line` satisfies `query`, whose compiled form is `plan`
+bool queryMatches(
+    const Index&     index,
+    const Query&     query,
+    const QueryPlan& plan,
+    const json&      line
+) {
+    for (std::size_t i = 0; i < query.exprs.size(); ++i) {
+        if (!answeredByIndex(index, query.exprs[i]) &&
+            !plan.matches(i, line)) {
+            return false;
         }
     }
     return true;
 }
 
-bool queryMatches(const Query& query, const json& line) {
-    return std::ranges::all_of(query.exprs, [&](auto expr) {
-        return expr.matches(line);
-    });
-}
-
-BitSet linesWithPathRoot(const Index& index, const Query& query) {
-    // and (&) together bitsets to find indices of lines that have all the roots
-    // of paths in the expr
-    BitSet filter = BitSet::trueMask(index.lines.size());
+// The bitsets whose intersection is the candidate lines for `query`; nullopt
+// when some path (or value) is on no line at all. Bitsets selected from
+// numeric columns are built into `scanned`.
+std::optional<std::vector<const BitSet*>> candidateSets(
+    const Index& index, const Query& query, std::vector<BitSet>& scanned
+) {
+    // lines that have the paths in the expr, or their longest indexed prefix
+    // if a path is nested deeper than `pathDepth`. Equalities on
+    // low-cardinality paths use the lines holding that exact value instead,
+    // and comparisons with a number scan the path's numeric column.
+    std::vector<const BitSet*> sets;
+    scanned.reserve(scanned.size() + query.exprs.size());  // keep `sets` valid
     for (const Expr& expr : query.exprs) {
-        if (expr.path.isWildCard ||
-            !index.bitsets.contains(expr.path.frontHash)) {
+        const auto& keys = expr.path.keys;
+        if (expr.path.isWildCard || keys.empty()) {
             continue;
         }
-        filter &= index.bitsets.at(expr.path.frontHash);
+        const auto depth    = std::min(keys.size(), index.config.pathDepth);
+        const auto prefixes = expr.path.prefixIds();
+        if (prefixes.size() < depth) {
+            return std::nullopt;  // a key no line has ever held
+        }
+        const BitSet* lines = nullptr;
+        if (answeredByValues(index, expr)) {
+            if (const auto* values = index.values.find(prefixes.back())) {
+                const auto it = values->lines.find(expr.rhs->indexKey());
+                if (it != values->lines.end()) {
+                    lines = &it->second;
+                }
+            }
+        } else if (const auto* column = answeringColumn(index, expr)) {
+            const double rhs = expr.rhs->get_num();
+            lines = &scanned.emplace_back(
+                column->select(*expr.op, rhs, index.size())
+            );
+        } else {
+            lines = index.bitsets.find(prefixes[depth - 1]);
+        }
+        if (lines == nullptr) {
+            return std::nullopt;
+        }
+        sets.push_back(lines);
+    }
+    return sets;
+}
+
+BitSet linesWithPathRoot(const Index& index, const Query& query) {
+    // and (&) together the candidate sets in one pass
+    std::vector<BitSet> scanned;
+    const auto          sets = candidateSets(index, query, scanned);
+    if (!sets) {
+        return BitSet(index.size());
     }
-    return std::move(filter);
+    return BitSet::intersectAll(*sets, index.size());
 }
 
 std::string formatResult(const json& obj) {
@@ -94,34 +159,319 @@ std::string formatResult(const json& obj) {
     return out;
 }
 
-std::optional<QueryResult> runQueryOnIndex(Index& index, Query&& query) {
+// Candidate lines a scan checks between looks at its CancelToken
+constexpr std::size_t kCancelCheckLines = 4096;
+
+// Which lines of an Index collectMatches looks at, and what else it reports
+struct ScanOptions {
+    CancelToken cancel;
+    std::size_t begin = 0;             // first line to look at
+    std::size_t end   = BitSet::npos;  // one past the last
+    // if set, gets the line number of each match, newest first
+    std::vector<std::size_t>* matched = nullptr;
+    // the query compiled; if unset, the scan compiles its own
+    const QueryPlan* plan = nullptr;
+    // if set, the scan gives up like a cancelled one once this is true
+    const std::atomic<bool>* stop = nullptr;
+    // if set, a scan of a SegmentedIndex splits its segments among the
+    // calling thread and these workers
+    WorkerPool* workers = nullptr;
+};
+
+// Append a matching line, cut down to the paths `query` mentions, to `out`.
+// values[i] is the line's value at the path of expr `i`, as found while
+// checking it, so the line isn't searched again.
+void appendMatch(
+    const Query&                 query,
+    std::span<const json* const> values,
+    std::vector<std::string>&    out,
+    json&                        filtered  // cache to reduce allocations
+) {
+    filtered.clear();  // clear from previous iteration
+    for (std::size_t i = 0; i < query.exprs.size(); ++i) {
+        filtered[query.exprs[i].path.ptr] =
+            values[i] != nullptr ? *values[i] : json();
+    }
+    out.push_back(formatResult(filtered));
+}
+
+// Format the lines of `index` in [scan.begin, scan.end) that match `query`
+// into `out`, newest first, until `out` holds query.maxMatches lines.
+// `lineAt(i)` returns line `i` of `index` as json. Returns false if
+// scan.cancel fired before the scan finished.
+template <typename LineAt>
+bool collectMatches(
+    const Index&              index,
+    const Query&              query,
+    LineAt&&                  lineAt,
+    std::vector<std::string>& out,
+    const ScanOptions&        scan = {}
+) {
+    json filtered;  // cache to reduce allocations
+
+    std::vector<BitSet> scanned;
+    const auto          sets = candidateSets(index, query, scanned);
+    if (!sets) {
+        return true;
+    }
+    std::optional<QueryPlan> compiled;
+    const QueryPlan&         plan =
+        scan.plan != nullptr ? *scan.plan : compiled.emplace(query.exprs);
+    // the exprs the candidate sets don't already guarantee, and the rest
+    std::vector<std::size_t> unchecked;
+    std::vector<std::size_t> answered;
+    for (std::size_t e = 0; e < query.exprs.size(); ++e) {
+        (answeredByIndex(index, query.exprs[e]) ? answered : unchecked)
+            .push_back(e);
+    }
+    // each expr's value in the line being checked, found once for both the
+    // check and the projection
+    std::vector<const json*> values(query.exprs.size());
+
+    // iterate over candidate lines newest first, a batch of indices at a time.
+    // The intersection is evaluated lazily, a chunk at a time, so chunks
+    // older than the last match needed are never computed.
+    BitCursor filter(BitAllOf(*sets, index.size()));
+    const std::size_t end = std::min(scan.end, filter.size());
+    std::array<std::size_t, 256> batch;
+    std::size_t                  n     = 0;
+    std::size_t                  from  = end - 1;  // npos if empty
+    std::size_t                  since = 0;  // lines since `cancel` was checked
+    while (out.size() < query.maxMatches &&
+           (n = filter.prevSetBits(from, batch.data(), batch.size())) > 0) {
+        from = batch[n - 1] - 1;
+        if ((since += n) >= kCancelCheckLines) {
+            since = 0;
+            if (scan.cancel.cancelled() ||
+                (scan.stop != nullptr && scan.stop->load())) {
+                return false;
+            }
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            if (batch[i] < scan.begin) {
+                return true;
+            }
+            if (out.size() == query.maxMatches) {
+                break;
+            }
+
+            const json& jsonLine = lineAt(batch[i]);
+
+            // ensure query matches before copying results into `filtered`
+            if (!std::ranges::all_of(unchecked, [&](std::size_t e) {
+                    return plan.holds(e, values[e] = plan.find(e, jsonLine));
+                })) {
+                continue;
+            }
+            for (const auto e : answered) {
+                values[e] = plan.find(e, jsonLine);
+            }
+            appendMatch(query, values, out, filtered);
+            if (scan.matched != nullptr) {
+                scan.matched->push_back(batch[i]);
+            }
+        }
+    }
+    return true;
+}
+
+// Matches of `query` among the lines from `begin` on, newest first; nullopt if
+// nothing matched or `cancel` fired first
+std::optional<QueryResult> runQueryOnIndex(
+    Index&             index,
+    Query&&            query,
+    const CancelToken& cancel = {},
+    std::size_t        begin  = 0
+) {
     std::vector<std::string> formattedLines;  // return type
-    json                     filtered;        // cache to reduce allocations
+    const auto lineAt = [&](std::size_t i) -> const json& {
+        return index.line(i);
+    };
+    if (!collectMatches(
+            index, query, lineAt, formattedLines,
+            {.cancel = cancel, .begin = begin}
+        )) {
+        return std::nullopt;
+    }
 
-    // iterate over valid jsonLines indices
-    BitSet     filter = linesWithPathRoot(index, query);
-    const auto rend   = filter.rend();
-    for (auto it = filter.rbegin(); it != rend; ++it) {
-        if (formattedLines.size() == query.maxMatches) {
+    // if query resulted in no matches, do not update query result
+    if (formattedLines.size() == 0) {
+        return std::nullopt;
+    }
+
+    return QueryResult(std::move(query), std::move(formattedLines));
+}
+
+// collectMatches over the segments of `index` in [scan.begin, scan.end) on
+// the calling thread and those of scan.workers. Segments are handed out newest
+// first, and each is scanned into its own results with the worker's own copy
+// of the plan and its own LineReader, so workers share nothing but the counter
+// of the next segment. Results are put together newest first. Once the
+// segments finished without a gap from the newest hold enough matches, no more
+// are handed out and scans of older ones give up. Raw and Offsets lines are
+// parsed per worker, bypassing the index's parse cache.
+bool collectMatchesInParallel(
+    const SegmentedIndex&     index,
+    const Query&              query,
+    std::vector<std::string>& out,
+    const ScanOptions&        scan
+) {
+    constexpr auto    kSegment = SegmentedIndex::kSegmentLines;
+    const std::size_t end      = std::min(scan.end, index.size());
+    const std::size_t wanted   = query.maxMatches - out.size();
+
+    struct Part {
+        std::size_t              segment{};
+        std::vector<std::string> out{};
+        std::vector<std::size_t> matched{};
+        bool                     done = false;
+    };
+    std::vector<Part> parts;  // newest first
+    for (auto s = index.segmentCount(); s-- > 0;) {
+        if (s * kSegment < end && (s + 1) * kSegment > scan.begin) {
+            parts.push_back({.segment = s});
+        }
+    }
+
+    std::atomic<std::size_t> next{0};
+    std::atomic<bool>        enough{false};
+    std::mutex               mutex;         // guards done, confirmed, found
+    std::size_t              confirmed = 0;  // parts[0, confirmed) are done
+    std::size_t              found     = 0;  // their matches
+
+    const auto work = [&]() {
+        const QueryPlan plan = scan.plan ? *scan.plan : QueryPlan(query.exprs);
+        LineReader      reader;
+        json            parsed;
+        for (std::size_t p = 0;
+             !enough.load() && (p = next.fetch_add(1)) < parts.size();) {
+            Part&        part = parts[p];
+            const Index& seg  = index.segment(part.segment);
+            const auto   base = part.segment * kSegment;
+            const auto   lineAt = [&](std::size_t i) -> const json& {
+                if (seg.config.storage == LineStorage::Dom) {
+                    return seg.lines[i];
+                }
+                parsed = json::parse(seg.bytes(i, reader), nullptr, false);
+                return parsed;
+            };
+            const ScanOptions local{
+                .cancel  = scan.cancel,
+                .begin   = scan.begin > base ? scan.begin - base : 0,
+                .end     = end - base,
+                .matched = scan.matched ? &part.matched : nullptr,
+                .plan    = &plan,
+                .stop    = &enough,
+            };
+            if (!collectMatches(seg, query, lineAt, part.out, local)) {
+                return;
+            }
+            std::lock_guard lock(mutex);
+            part.done = true;
+            for (; confirmed < parts.size() && parts[confirmed].done;
+                 ++confirmed) {
+                found += parts[confirmed].out.size();
+            }
+            if (found >= wanted) {
+                enough = true;
+            }
+        }
+    };
+    scan.workers->run(work, parts.size());
+    if (scan.cancel.cancelled()) {
+        return false;
+    }
+
+    for (const Part& part : parts) {
+        if (!part.done || out.size() == query.maxMatches) {
             break;
         }
+        const auto take =
+            std::min(part.out.size(), query.maxMatches - out.size());
+        out.insert(out.end(), part.out.begin(), part.out.begin() + take);
+        if (scan.matched != nullptr) {
+            for (std::size_t i = 0; i < take; ++i) {
+                scan.matched->push_back(
+                    part.matched[i] + part.segment * kSegment
+                );
+            }
+        }
+    }
+    return true;
+}
 
-        const json& jsonLine = index.lines[*it];
+// collectMatches over lines [scan.begin, scan.end) of `index`, one segment at
+// a time, newest first, so older segments are never looked at once `out` holds
+// query.maxMatches results. Matched line numbers are the index's, not the
+// segment's. With scan.workers, a range spanning several segments is scanned
+// by collectMatchesInParallel instead.
+bool collectMatches(
+    const SegmentedIndex&     index,
+    const Query&              query,
+    std::vector<std::string>& out,
+    const ScanOptions&        scan = {}
+) {
+    constexpr auto kSegment = SegmentedIndex::kSegmentLines;
+    const auto     end      = std::min(scan.end, index.size());
+    if (scan.workers != nullptr && scan.workers->size() > 0 &&
+        end > scan.begin &&
+        (end - 1) / kSegment > scan.begin / kSegment &&
+        out.size() < query.maxMatches) {
+        return collectMatchesInParallel(index, query, out, scan);
+    }
 
-        // ensure query matches before copying results into `filtered`
-        if (!queryMatches(query, jsonLine)) {
+    std::optional<QueryPlan> compiled;
+    const QueryPlan&         plan =
+        scan.plan != nullptr ? *scan.plan : compiled.emplace(query.exprs);
+    for (auto s = index.segmentCount();
+         s-- > 0 && (s + 1) * kSegment > scan.begin &&
+         out.size() < query.maxMatches;) {
+        const auto base = s * kSegment;
+        if (base >= end) {
             continue;
         }
-
-        filtered.clear();  // clear from previous iteration
-        for (const Expr& expr : query.exprs) {
-            // TODO: Determine if this is really inefficient
-            filtered[expr.path.ptr] = jsonLine[expr.path.ptr];
+        ScanOptions local = scan;
+        local.begin       = scan.begin > base ? scan.begin - base : 0;
+        local.end         = end - base;
+        local.plan        = &plan;
+        const auto first  = scan.matched ? scan.matched->size() : 0;
+        if (!collectMatches(
+                index.segment(s), query,
+                [&](std::size_t i) -> const json& {
+                    return index.line(base + i);
+                },
+                out, local
+            )) {
+            return false;
+        }
+        if (scan.matched != nullptr) {
+            for (auto i = first; i < scan.matched->size(); ++i) {
+                (*scan.matched)[i] += base;
+            }
         }
-        formattedLines.push_back(std::move(formatResult(filtered)));
+    }
+    return true;
+}
+
+// Run `query` one segment at a time, newest first, so older segments are
+// never looked at once there are query.maxMatches results. Segments wholly
+// before line `begin` are skipped. With `workers`, segments are scanned
+// concurrently by them and the calling thread.
+std::optional<QueryResult> runQueryOnIndex(
+    const SegmentedIndex& index,
+    Query&&               query,
+    const CancelToken&    cancel  = {},
+    std::size_t           begin   = 0,
+    WorkerPool*           workers = nullptr
+) {
+    std::vector<std::string> formattedLines;  // return type
+    if (!collectMatches(
+            index, query, formattedLines,
+            {.cancel = cancel, .begin = begin, .workers = workers}
+        )) {
+        return std::nullopt;
     }
 
-    // if query resulted in no matches, do not update query result
     if (formattedLines.size() == 0) {
         return std::nullopt;
     }
@@ -129,10 +479,105 @@ std::optional<QueryResult> runQueryOnIndex(Index& index, Query&& query) {
     return QueryResult(std::move(query), std::move(formattedLines));
 }
 
+// What a scan for `query` established: every candidate line in [from, to) was
+// checked, and `matches` are the ones that matched, newest first. Kept by the
+// query service so a narrower query typed next can skip those lines.
+struct ScanRecord {
+    Query                    query;
+    std::size_t              from{};
+    std::size_t              to{};
+    std::vector<std::size_t> matches;
+};
+
+// runQueryOnIndex, also recording what the scan established in `record`. If
+// `query` narrows the query of `previous`, only its matches are checked again
+// in the range it covered; the scan resumes on either side of it. Scans share
+// their segments with `workers`, see collectMatchesInParallel.
+std::optional<QueryResult> runRecordedQuery(
+    const SegmentedIndex& index,
+    Query&&               query,
+    const CancelToken&    cancel,
+    const ScanRecord*     previous,
+    ScanRecord&           record,
+    WorkerPool*           workers = nullptr
+) {
+    const std::size_t        end = index.size();
+    const std::size_t        max = query.maxMatches;
+    std::vector<std::string> formattedLines;  // return type
+    std::vector<std::size_t> matched;
+    const QueryPlan          plan(query.exprs);
+    const auto scan = [&](std::size_t begin, std::size_t to) {
+        return collectMatches(
+            index, query, formattedLines,
+            {.cancel  = cancel,
+             .begin   = begin,
+             .end     = to,
+             .matched = &matched,
+             .plan    = &plan,
+             .workers = workers}
+        );
+    };
+
+    if (previous != nullptr && query.narrows(previous->query)) {
+        json                     filtered;
+        std::vector<const json*> values;
+        if (!scan(previous->to, end)) {
+            return std::nullopt;
+        }
+        for (const auto i : previous->matches) {
+            if (formattedLines.size() == max) {
+                break;
+            }
+            const json& line = index.line(i);
+            if (plan.matches(line, values)) {
+                appendMatch(query, values, formattedLines, filtered);
+                matched.push_back(i);
+            }
+        }
+        if (!scan(0, previous->from)) {
+            return std::nullopt;
+        }
+    } else if (!scan(0, end)) {
+        return std::nullopt;
+    }
+
+    // a full result stops at the oldest match; otherwise everything was seen
+    const std::size_t from = matched.size() == max ? matched.back() : 0;
+    record = {query.clone(), from, end, std::move(matched)};
+    if (formattedLines.empty()) {
+        return std::nullopt;
+    }
+    return QueryResult(std::move(query), std::move(formattedLines));
+}
+
+// Batches taken off the queue at once before acting on them, so a steady
+// stream of them can't hold off the refresh for long
+constexpr std::size_t kMaxCoalescedMsgs = 64;
+
+// Serve queries over `index` as ingested lines arrive on `rx`. Each segment
+// sealed along the way is appended to `sidecar`, if there is one.
+//
+// The query lane comes first: a query waiting in the slot runs before any
+// more batches are merged, and queued batches are merged together, up to
+// kMaxCoalescedMsgs at a time, stopping early once a query is waiting. Only
+// the newest query sent is ever in the slot, and a running scan gives up as
+// soon as a newer one is sent. A query that narrows the one before it, as
+// when another expr is typed, reuses that query's ScanRecord instead of
+// scanning its range again. Scans spanning several segments run on
+// `threads` threads: this one and a pool started with the service.
+//
+// The last query run is kept up to date incrementally: after a merge only
+// the lines added since it last ran are evaluated. Their matches go in front
+// of the ones on display and the oldest are dropped, or, if the query had
+// none yet, go on display. Each batch then costs in proportion to its own
+// size.
 void startQueryService(
-    folly::MPMCQueue<Msg>&            rx,
+    ServiceChannel&                   rx,
     folly::Synchronized<QueryResult>& queryResult,
-    std::function<void()>             onResult
+    std::function<void()>             onResult,
+    SegmentedIndex                    index   = {},
+    Sidecar*                          sidecar = nullptr,
+    unsigned                          threads = 1
 ) {
     auto info = [tag = json{{"tag", "QS"}
                  }](std::string&& s, std::optional<json> obj = std::nullopt) {
@@ -143,11 +588,29 @@ void startQueryService(
     };
 
     info("Starting query service");
-    Index index;
-    Msg   msg;
-    auto  handleQuery = [&](Query&& query) {
-        auto result = runQueryOnIndex(index, std::move(query));
-        info("runQueryOnIndex returned");
+    WorkerPool  workers(std::max(threads, 1U) - 1);
+    Msg         msg;
+    long        taken     = 0;  // seq of the query taken last
+    std::size_t evaluated = 0;  // index size when lastScan's query ran
+    bool        shown     = false;  // queryResult holds its matches
+    // what the last query to run found, for a narrower one typed after it,
+    // and the query refreshed after merges
+    std::optional<ScanRecord> lastScan;
+    auto                      handleQuery = [&](Query&& query) {
+        const CancelToken cancel{&rx.latest(), taken};
+        ScanRecord        record;
+        auto              result = runRecordedQuery(
+            index, std::move(query), cancel, lastScan ? &*lastScan : nullptr,
+            record, &workers
+        );
+        info("runRecordedQuery returned");
+        if (cancel.cancelled()) {
+            info("cancelled by a newer query");
+            return;
+        }
+        lastScan  = std::move(record);
+        evaluated = index.size();
+        shown     = result.has_value();
         if (result) {
             info("result is Some");
             *queryResult.wlock() = std::move(*result);
@@ -155,40 +618,117 @@ void startQueryService(
         info("Calling onResult");
         onResult();
     };
+    // evaluate the last query over the lines merged since it ran
+    auto refreshQuery = [&]() {
+        if (!lastScan) {
+            return;
+        }
+        Query             query      = lastScan->query.clone();
+        const std::size_t maxMatches = query.maxMatches;
+        const CancelToken cancel{&rx.latest(), taken};
+        auto              fresh = runQueryOnIndex(
+            index, std::move(query), cancel, evaluated, &workers
+        );
+        if (cancel.cancelled()) {
+            info("cancelled by a newer query");
+            return;
+        }
+        evaluated = index.size();
+        if (!fresh) {
+            return;  // nothing new matched; the window stays as it is
+        }
+        {
+            auto  qr    = queryResult.wlock();
+            auto& lines = fresh->lines;
+            for (auto& line : qr->lines) {
+                if (!shown || lines.size() == maxMatches) {
+                    break;
+                }
+                lines.push_back(std::move(line));
+            }
+            *qr   = std::move(*fresh);
+            shown = true;
+        }
+        onResult();
+    };
+
+    // the log was truncated under the index: forget every line, including
+    // the ones on display, and keep the last query to run on what follows
+    auto dropLines = [&]() {
+        index     = SegmentedIndex();
+        evaluated = 0;
+        shown     = false;
+        if (lastScan) {
+            lastScan->from = lastScan->to = 0;
+            lastScan->matches.clear();
+        }
+        if (sidecar != nullptr) {
+            sidecar->stop("log file was truncated");
+        }
+        queryResult.wlock()->lines.clear();
+        onResult();
+    };
 
     for (bool shouldContinue = true; shouldContinue;) {
-        rx.blockingRead(msg);
-        std::visit(
-            overloaded{
-                [&](StopSignal&) { shouldContinue = false; },
-                [&](Query& query) {
-                    info("Msg::Query: Start");
-                    handleQuery(std::move(query));
-                    info("Msg::Query: End\n");
-                },
-                [&](Index& update) {
-                    info("Msg::Index: Start");
-                    mergeIndex(index, update);
-                    // re-run last query on updated index
-                    Query query;
-                    { query = queryResult.rlock()->query.clone(); }
-                    if (query.seq == 0) {
-                        info("Msg::Index: End\n");
-                        return;
-                    }
-                    handleQuery(std::move(query));
-                    info("Msg::Index: End\n");
+        if (auto query = rx.takeQuery()) {
+            info("Query: Start");
+            taken = query->seq;
+            handleQuery(std::move(*query));
+            info("Query: End\n");
+            continue;
+        }
+
+        rx.batches.blockingRead(msg);
+        bool merged = false;
+        for (std::size_t drained = 1; shouldContinue; ++drained) {
+            std::visit(
+                overloaded{
+                    [&](StopSignal&) { shouldContinue = false; },
+                    [&](QueryWaiting&) {},
+                    [&](LogTruncated&) {
+                        info("Msg::LogTruncated");
+                        dropLines();
+                        merged = true;
+                    },
+                    [&](Index& update) {
+                        info("Msg::Index");
+                        mergeIndex(index, update);
+                        if (sidecar != nullptr) {
+                            sidecar->persist(index);
+                        }
+                        merged = true;
+                    },
                 },
-            },
-            msg
-        );
+                msg
+            );
+            if (drained == kMaxCoalescedMsgs || rx.queryWaiting() ||
+                !rx.batches.read(msg)) {
+                break;
+            }
+        }
+
+        // a waiting query runs over everything merged anyway
+        if (shouldContinue && merged && !rx.queryWaiting()) {
+            info("Refresh: Start");
+            refreshQuery();
+            info("Refresh: End\n");
+        }
     }
 }
 
 std::thread spawnQueryService(
-    folly::MPMCQueue<Msg>&            rx,
+    ServiceChannel&                   rx,
     folly::Synchronized<QueryResult>& queryResult,
-    std::function<void()>&            onUpdate
+    std::function<void()>&            onUpdate,
+    SegmentedIndex                    index   = {},
+    Sidecar*                          sidecar = nullptr,
+    unsigned                          threads = 1
 ) {
-    return std::thread([&]() { startQueryService(rx, queryResult, onUpdate); });
+    return std::thread(
+        [&, index = std::move(index), sidecar, threads]() mutable {
+            startQueryService(
+                rx, queryResult, onUpdate, std::move(index), sidecar, threads
+            );
+        }
+    );
 }
@@ -0,0 +1,541 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ingestor.h"
+#include "types.h"
+#include "utils/binary_io.h"
+#include "utils/key_dictionary.h"
+#include "utils/line_source.h"
+#include "utils/logging.h"
+#include "utils/mapped_file.h"
+
+// The `.llq-idx` file kept next to a log so reopening it doesn't re-index it
+// from byte 0. It holds the log's identity, the key dictionary, and a record
+// for each sealed segment of the query service's SegmentedIndex: the byte
+// offset of each of its lines, its bitsets, value bitmaps and numeric
+// columns. Lines after the last sealed segment are indexed again on reopen.
+//
+// Layout: a fixed Header, then records back to back, each a u64 length and
+// its payload. Records are only ever appended, and the header is rewritten
+// after each one, so a record cut short by a crash is past `dataEnd` and
+// ignored.
+class Sidecar {
+   public:
+    static constexpr std::string_view kSuffix = ".llq-idx";
+
+    // `logPath` must exist
+    Sidecar(std::string logPath, IndexConfig config)
+        : logPath_(std::move(logPath))
+        , path_(logPath_ + std::string(kSuffix))
+        , config_(config)
+        , log_(logPath_) {}
+
+    Sidecar(const Sidecar&)            = delete;
+    Sidecar& operator=(const Sidecar&) = delete;
+
+    ~Sidecar() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    [[nodiscard]] const std::string& path() const {
+        return path_;
+    }
+
+    // Load the segments recorded in the sidecar into `index`, which must be
+    // empty, and return where ingestion picks up. A sidecar that is missing,
+    // unreadable or no longer matches the log is deleted, and ingestion
+    // starts from the top.
+    ResumePoint restore(SegmentedIndex& index) {
+        if (!std::filesystem::exists(path_)) {
+            return {};
+        }
+        try {
+            return load(index);
+        } catch (const std::exception& e) {
+            Log::info(
+                "Discarding index sidecar",
+                {{"tag", "Sidecar"}, {"path", path_}, {"reason", e.what()}}
+            );
+        }
+        index = SegmentedIndex();
+        std::filesystem::remove(path_);
+        return {};
+    }
+
+    // Stop persisting for good, e.g. once the index no longer follows the log
+    // the sidecar was written for
+    void stop(const std::string& reason) {
+        if (enabled_) {
+            Log::info(
+                "Stopped writing index sidecar",
+                {{"tag", "Sidecar"}, {"path", path_}, {"reason", reason}}
+            );
+            enabled_ = false;
+        }
+    }
+
+    // Append the segments of `index` sealed since the last call or `restore`.
+    // Stops persisting for good on any error, e.g. an unwritable directory or
+    // a rotated log, since the sidecar could no longer line up with the log.
+    void persist(const SegmentedIndex& index) {
+        try {
+            while (enabled_ && persisted_ < index.sealed.size()) {
+                append(*index.sealed[persisted_]);
+                ++persisted_;
+            }
+        } catch (const std::exception& e) {
+            stop(e.what());
+        }
+    }
+
+   private:
+    static constexpr std::array<char, 8> kMagic   = {'L', 'L', 'Q', 'I',
+                                                     'D', 'X', '\0', '\0'};
+    static constexpr std::uint64_t       kVersion = 1;
+    // bytes hashed at the head of the log and before the last indexed byte
+    static constexpr std::size_t kHashBytes = 4096;
+
+    struct Header {
+        std::array<char, 8> magic = kMagic;
+        std::uint64_t       version{kVersion};
+        // what the bitsets depend on
+        std::uint64_t segmentLines{SegmentedIndex::kSegmentLines};
+        std::uint64_t pathDepth{};
+        std::uint64_t valueCap{};
+        std::uint64_t numericColumns{};
+        // identity of the log when the last record was written
+        std::uint64_t dev{};
+        std::uint64_t inode{};
+        std::uint64_t logSize{};
+        std::int64_t  mtimeNs{};
+        std::uint64_t headBytes{};
+        std::uint64_t headHash{};
+        // what the records cover
+        std::uint64_t segments{};
+        std::uint64_t lines{};
+        std::uint64_t indexedBytes{};
+        std::uint64_t tailHash{};  // of the kHashBytes before indexedBytes
+        std::uint64_t dataEnd{sizeof(Header)};  // end of the last record
+    };
+
+    static std::uint64_t fnv1a(std::string_view bytes) {
+        std::uint64_t h = 0xcbf29ce484222325ULL;
+        for (const unsigned char c : bytes) {
+            h = (h ^ c) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    [[nodiscard]] std::string_view logBytes() const {
+        return {log_.data(), log_.size()};
+    }
+
+    [[nodiscard]] std::uint64_t tailHash(std::uint64_t end) const {
+        const auto begin = end - std::min<std::uint64_t>(end, kHashBytes);
+        return fnv1a(logBytes().substr(begin, end - begin));
+    }
+
+    [[nodiscard]] struct stat statLog() const {
+        struct stat st {};
+        if (::stat(logPath_.c_str(), &st) != 0) {
+            throw std::runtime_error(
+                "Failed to stat " + logPath_ + ": " + std::strerror(errno)
+            );
+        }
+        return st;
+    }
+
+    static std::int64_t mtimeNs(const struct stat& st) {
+        return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1'000'000'000 +
+               st.st_mtim.tv_nsec;
+    }
+
+    [[nodiscard]] Header expectedHeader() const {
+        Header header;
+        header.pathDepth      = config_.pathDepth;
+        header.valueCap       = config_.valueCap;
+        header.numericColumns = config_.numericColumns ? 1 : 0;
+        return header;
+    }
+
+    // The header fields that must match for the sidecar to describe this log
+    // under this config
+    void check(const Header& header) {
+        const Header expected = expectedHeader();
+        if (header.magic != kMagic || header.version != kVersion) {
+            throw std::runtime_error("not an index sidecar of this version");
+        }
+        if (header.segmentLines != expected.segmentLines ||
+            header.pathDepth != expected.pathDepth ||
+            header.valueCap != expected.valueCap ||
+            header.numericColumns != expected.numericColumns) {
+            throw std::runtime_error("written with a different index config");
+        }
+
+        const auto st   = statLog();
+        const auto size = static_cast<std::uint64_t>(st.st_size);
+        log_.remap();
+        if (header.dev != st.st_dev || header.inode != st.st_ino) {
+            throw std::runtime_error("log file was replaced");
+        }
+        // a log only grows; one that shrank or changed without growing was
+        // rewritten
+        if (size < header.logSize ||
+            (size == header.logSize && mtimeNs(st) != header.mtimeNs) ||
+            log_.size() < header.indexedBytes ||
+            log_.size() < header.headBytes) {
+            throw std::runtime_error("log file was rewritten");
+        }
+        if (fnv1a(logBytes().substr(0, header.headBytes)) != header.headHash ||
+            tailHash(header.indexedBytes) != header.tailHash) {
+            throw std::runtime_error("log file contents changed");
+        }
+    }
+
+    // A record's line offsets, bitsets, values and columns, made into an
+    // Index of segment `segment` with key ids mapped through `remap`. Offsets
+    // storage points its lines at `source` without reading them.
+    [[nodiscard]] Index readSegment(
+        std::string_view                         record,
+        std::size_t                              segment,
+        const std::vector<KeyId>&                remap,
+        const std::shared_ptr<const LineSource>& source
+    ) const {
+        using namespace binary_io;
+        Index index;
+        index.start_idx = segment * SegmentedIndex::kSegmentLines;
+        index.config    = config_;
+
+        const auto keyId = [&](std::string_view& in) {
+            const auto id = get<KeyId>(in);
+            if (id >= remap.size()) {
+                throw std::runtime_error("record uses an unknown key");
+            }
+            return remap[id];
+        };
+
+        const auto offsets = getVector<std::uint64_t>(record);
+        if (offsets.size() != SegmentedIndex::kSegmentLines + 1) {
+            throw std::runtime_error("record has the wrong number of lines");
+        }
+        const auto bytes = logBytes();
+        const bool inLog = config_.storage != LineStorage::Offsets;
+        for (std::size_t i = 0; i + 1 < offsets.size(); ++i) {
+            const auto begin = offsets[i];
+            const auto end   = offsets[i + 1];
+            // Offsets only checks the segment's last newline, so restoring
+            // doesn't page in the whole log
+            const bool last = i + 2 == offsets.size();
+            if (begin >= end || end > bytes.size() ||
+                ((inLog || last) && bytes[end - 1] != '\n')) {
+                throw std::runtime_error("record's lines aren't in the log");
+            }
+            const auto line = bytes.substr(begin, end - 1 - begin);
+            switch (config_.storage) {
+                case LineStorage::Dom:
+                    index.lines.push_back(json::parse(line, nullptr, false));
+                    break;
+                case LineStorage::Raw:
+                    index.raw.append(line);
+                    break;
+                case LineStorage::Offsets:
+                    index.offsets.append(source, begin, line.size());
+                    break;
+            }
+        }
+
+        getString(record);  // dictionary entries, read by `load`
+        for (auto n = get<std::uint64_t>(record); n > 0; --n) {
+            const KeyId id    = keyId(record);
+            index.bitsets[id] = BitSet::read(record);
+        }
+        for (auto n = get<std::uint64_t>(record); n > 0; --n) {
+            ValueBitsets& values = index.values[keyId(record)];
+            values.demoted       = get<std::uint8_t>(record) != 0;
+            for (auto m = get<std::uint64_t>(record); m > 0; --m) {
+                std::string value(getString(record));
+                values.lines.emplace(std::move(value), BitSet::read(record));
+            }
+        }
+        for (auto n = get<std::uint64_t>(record); n > 0; --n) {
+            NumericColumn& column = index.columns[keyId(record)];
+            column.mixed          = get<std::uint8_t>(record) != 0;
+            column.present        = BitSet::read(record);
+            column.values         = getVector<double>(record);
+            column.zones          = getVector<NumericColumn::Zone>(record);
+        }
+        return index;
+    }
+
+    ResumePoint load(SegmentedIndex& index) {
+        using namespace binary_io;
+        MappedFile file(path_);
+        const auto data = std::string_view(file.data(), file.size());
+        if (data.size() < sizeof(Header)) {
+            throw std::runtime_error("truncated header");
+        }
+        Header header;
+        std::memcpy(&header, data.data(), sizeof(Header));
+        check(header);
+        if (header.dataEnd > data.size()) {
+            throw std::runtime_error("truncated records");
+        }
+
+        // walk the records in order, interning their keys, then build the
+        // segments on all workers
+        auto&                         dict = KeyDictionary::global();
+        std::vector<KeyId>            remap;  // sidecar id -> our id
+        std::vector<std::string_view> records;
+        auto in = data.substr(sizeof(Header), header.dataEnd - sizeof(Header));
+        while (!in.empty()) {
+            auto record = take(in, get<std::uint64_t>(in));
+            records.push_back(record);
+            getVector<std::uint64_t>(record);  // line offsets
+            auto keys = getString(record);
+            while (!keys.empty()) {
+                const auto parent = get<KeyId>(keys);
+                if (parent != KeyDictionary::kRoot && parent >= remap.size()) {
+                    throw std::runtime_error("key's parent is unknown");
+                }
+                remap.push_back(dict.intern(
+                    parent == KeyDictionary::kRoot ? parent : remap[parent],
+                    getString(keys)
+                ));
+            }
+        }
+        if (records.size() != header.segments ||
+            records.size() * SegmentedIndex::kSegmentLines != header.lines) {
+            throw std::runtime_error("header doesn't match its records");
+        }
+
+        const auto source = config_.storage == LineStorage::Offsets
+                                ? std::make_shared<const LineSource>(logPath_)
+                                : nullptr;
+        std::vector<Index>              segments(records.size());
+        const std::size_t               workers = std::clamp<std::size_t>(
+            config_.initialThreads, 1, std::max<std::size_t>(records.size(), 1)
+        );
+        std::vector<std::exception_ptr> errors(workers);
+        {
+            std::vector<std::thread> threads;
+            for (std::size_t w = 0; w < workers; ++w) {
+                threads.emplace_back([&, w]() {
+                    try {
+                        for (auto s = w; s < records.size(); s += workers) {
+                            segments[s] =
+                                readSegment(records[s], s, remap, source);
+                        }
+                    } catch (...) {
+                        errors[w] = std::current_exception();
+                    }
+                });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+        for (const auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        index = SegmentedIndex();
+        for (auto& segment : segments) {
+            index.sealed.push_back(
+                std::make_unique<const Index>(std::move(segment))
+            );
+        }
+        index.tail.start_idx = index.size();
+        index.tail.config    = config_;
+
+        // pick up writing where the sidecar left off
+        header_    = header;
+        persisted_ = records.size();
+        fileIds_.clear();
+        for (KeyId id = 0; id < remap.size(); ++id) {
+            fileId(remap[id]) = id;
+        }
+        keysWritten_ = remap.size();
+        return {header.indexedBytes, header.lines};
+    }
+
+    // Slot for the sidecar's id of our key `id`, kRoot if it has none yet
+    KeyId& fileId(KeyId id) {
+        if (id >= fileIds_.size()) {
+            fileIds_.resize(id + 1, KeyDictionary::kRoot);
+        }
+        return fileIds_[id];
+    }
+
+    // The sidecar's id for our key `id`, adding it and any parents missing
+    // from the sidecar's dictionary to `entries`
+    KeyId toFileId(KeyId id, std::string& entries) {
+        if (const KeyId known = fileId(id); known != KeyDictionary::kRoot) {
+            return known;
+        }
+        const auto& dict   = KeyDictionary::global();
+        const KeyId parent = dict.parent(id);
+        const KeyId fileParent =
+            parent == KeyDictionary::kRoot ? parent : toFileId(parent, entries);
+        binary_io::put(entries, fileParent);
+        binary_io::putString(entries, dict.key(id));
+        return fileId(id) = static_cast<KeyId>(keysWritten_++);
+    }
+
+    // Open the sidecar for appending, starting it over unless `load` read it
+    void open() {
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error(
+                "Failed to open " + path_ + ": " + std::strerror(errno)
+            );
+        }
+        if (persisted_ == 0) {
+            log_.remap();
+            const auto st = statLog();
+            header_       = expectedHeader();
+            header_.dev   = st.st_dev;
+            header_.inode = st.st_ino;
+            header_.headBytes =
+                std::min<std::uint64_t>(log_.size(), kHashBytes);
+            header_.headHash = fnv1a(logBytes().substr(0, header_.headBytes));
+        }
+        // drop anything past the last complete record
+        if (::ftruncate(fd_, static_cast<off_t>(header_.dataEnd)) != 0) {
+            throw std::runtime_error(
+                "Failed to truncate " + path_ + ": " + std::strerror(errno)
+            );
+        }
+    }
+
+    void writeAt(std::string_view bytes, std::uint64_t offset) {
+        while (!bytes.empty()) {
+            const auto n = ::pwrite(
+                fd_, bytes.data(), bytes.size(), static_cast<off_t>(offset)
+            );
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(
+                    "Failed to write " + path_ + ": " + std::strerror(errno)
+                );
+            }
+            bytes.remove_prefix(n);
+            offset += n;
+        }
+    }
+
+    // Write `segment`, which must follow the last segment written, as a
+    // record and update the header to cover it
+    void append(const Index& segment) {
+        using namespace binary_io;
+        if (fd_ < 0) {
+            open();
+        }
+        const auto st = statLog();
+        if (st.st_dev != header_.dev || st.st_ino != header_.inode) {
+            throw std::runtime_error("log file was replaced");
+        }
+        // truncated in place (copytruncate): the indexed lines are gone, and
+        // the mapping mustn't be read past the new end of the file
+        const auto size = static_cast<std::uint64_t>(st.st_size);
+        if (size < header_.indexedBytes || size < log_.size() ||
+            log_.remap() == MappedFile::Change::Shrank) {
+            throw std::runtime_error("log file was truncated");
+        }
+        if (header_.segments != 0 &&
+            tailHash(header_.indexedBytes) != header_.tailHash) {
+            throw std::runtime_error("log file was rewritten");
+        }
+
+        // the lines' byte offsets, found again in the log
+        const auto                 bytes = logBytes();
+        std::vector<std::uint64_t> offsets{header_.indexedBytes};
+        while (offsets.size() <= segment.size()) {
+            const auto nl = bytes.find('\n', offsets.back());
+            if (nl == std::string_view::npos) {
+                throw std::runtime_error("log doesn't hold the indexed lines");
+            }
+            offsets.push_back(nl + 1);
+        }
+
+        std::string entries;  // dictionary entries new to the sidecar
+        std::string body;
+        put<std::uint64_t>(body, segment.bitsets.size());
+        for (const auto& [id, bitset] : segment.bitsets) {
+            put(body, toFileId(id, entries));
+            bitset.write(body);
+        }
+        put<std::uint64_t>(body, segment.values.size());
+        for (const auto& [id, values] : segment.values) {
+            put(body, toFileId(id, entries));
+            put<std::uint8_t>(body, values.demoted ? 1 : 0);
+            put<std::uint64_t>(body, values.lines.size());
+            for (const auto& [value, bitset] : values.lines) {
+                putString(body, value);
+                bitset.write(body);
+            }
+        }
+        put<std::uint64_t>(body, segment.columns.size());
+        for (const auto& [id, column] : segment.columns) {
+            put(body, toFileId(id, entries));
+            put<std::uint8_t>(body, column.mixed ? 1 : 0);
+            column.present.write(body);
+            putSpan<double>(body, column.values);
+            putSpan<NumericColumn::Zone>(body, column.zones);
+        }
+
+        std::string record;
+        putSpan<std::uint64_t>(record, offsets);
+        putString(record, entries);
+        record += body;
+        std::string framed;
+        put<std::uint64_t>(framed, record.size());
+        framed += record;
+        writeAt(framed, header_.dataEnd);
+
+        header_.segments += 1;
+        header_.lines += segment.size();
+        header_.indexedBytes = offsets.back();
+        header_.tailHash     = tailHash(header_.indexedBytes);
+        header_.dataEnd += framed.size();
+        header_.logSize = static_cast<std::uint64_t>(st.st_size);
+        header_.mtimeNs = mtimeNs(st);
+        writeAt(
+            {reinterpret_cast<const char*>(&header_), sizeof(Header)}, 0
+        );
+    }
+
+    std::string logPath_;
+    std::string path_;
+    IndexConfig config_;
+    MappedFile  log_;
+
+    int                fd_      = -1;
+    bool               enabled_ = true;
+    Header             header_;
+    std::size_t        persisted_{};    // segments in the sidecar
+    std::vector<KeyId> fileIds_;        // our key id -> sidecar's, or kRoot
+    std::size_t        keysWritten_{};  // keys in the sidecar's dictionary
+};
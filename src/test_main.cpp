@@ -14,10 +14,18 @@
 #include <thread>
 
 #include "ingestor.h"
+#include "options.h"
 #include "utils/logging.h"
+#include "query_plan.h"
 #include "query_service.h"
 #include "types.h"
 
+// Id of the key path `path` in the global KeyDictionary; throws if no line
+// ever held it
+KeyId keyId(const std::string& path) {
+    return KeyDictionary::global().find(Path(path).keys).value();
+}
+
 TEST_CASE("split") {
     std::string              s        = "msg,level";
     std::vector<std::string> expected = {"msg", "level"};
@@ -210,6 +218,194 @@ TEST_CASE("Parse line into exprs") {
     }
 }
 
+TEST_CASE("Query narrows the one before it") {
+    auto narrows = [](const std::string& next, const std::string& prev) {
+        return Query::parse(next)->narrows(*Query::parse(prev));
+    };
+    CHECK(narrows("level == 'err'", "level == 'err'"));
+    CHECK(narrows("level == 'err', msg", "level == 'err'"));
+    CHECK(narrows("msg, level == 'err'", "level"));
+    CHECK(narrows("count > 100", "count > 10"));
+    CHECK(narrows("count < 5", "count < 10"));
+    CHECK(narrows("count == 50", "count > 10"));
+    CHECK(narrows("count == 50, msg", "count < 60, msg"));
+
+    // a longer literal matches other lines, not a subset of them
+    CHECK(!narrows("level == 'erro'", "level == 'err'"));
+    CHECK(!narrows("count > 10", "count > 100"));
+    CHECK(!narrows("count == 5", "count > 10"));
+    CHECK(!narrows("msg", "msg, level"));
+    CHECK(!narrows("a.b", "a"));
+}
+
+TEST_CASE("Value orders json values in place like Values") {
+    const std::vector<Value> values = {
+        Value(-1.5), Value(0), Value(3), Value(std::string("")),
+        Value(std::string("a")), Value(std::string("ab")),
+    };
+    const auto sign = [](const Value& a, const Value& b) {
+        return a < b ? -1 : a > b ? 1 : 0;
+    };
+    for (const auto& rhs : values) {
+        for (const auto& lhs : values) {
+            const json val = lhs.is_num() ? json(lhs.get_num())
+                                          : json(lhs.to_string());
+            CHECK(rhs.orderOf(val) == sign(lhs, rhs));
+        }
+        CHECK(rhs.orderOf(json(3)) == sign(Value(3), rhs));
+        CHECK(rhs.orderOf(json(nullptr)) == std::nullopt);
+        CHECK(rhs.orderOf(json(true)) == std::nullopt);
+        CHECK(rhs.orderOf(json::object()) == std::nullopt);
+    }
+}
+
+TEST_CASE("Compiled query plan agrees with Expr::matches") {
+    const std::vector<json> lines = {
+        json::parse(R"({"n":5,"s":"b","a":{"b":2},"arr":[1,"x",{"k":3}]})"),
+        json::parse(R"({"n":"5","s":7,"a":{"b":"2"},"arr":[]})"),
+        json::parse(R"({"n":2.5,"s":"","a":[{"b":1}],"arr":{"1":"x"}})"),
+        json::parse(R"({"n":null,"s":true,"a":{},"arr":[0,"y"]})"),
+        json::parse(R"({"m":-1})"),
+    };
+    for (const auto* q :
+         {"n", "n > 3", "n < 3", "n == 5", "n == '5'", "n > 'a'", "n < 'a'",
+          "s == 'b'", "s < 'c'", "s > ''", "s > 3", "a.b == 2", "a.b < '3'",
+          "*", "n, s", "n > 1, s < 'z', a.b", "s in 'b'", "m < 0"}) {
+        CAPTURE(q);
+        const auto query = Query::parse(q);
+        REQUIRE(query);
+        const QueryPlan plan(query->exprs);
+        REQUIRE(plan.size() == query->exprs.size());
+        for (const json& line : lines) {
+            CAPTURE(line.dump());
+            for (std::size_t i = 0; i < query->exprs.size(); ++i) {
+                CHECK(plan.matches(i, line) == query->exprs[i].matches(line));
+            }
+        }
+    }
+
+    // paths through arrays, which the query syntax doesn't spell
+    const std::vector<Expr> exprs = {
+        Expr(std::string("a/0/b")),
+        Expr(Path("arr/1"), Expr::Op::eq, Value(std::string("x"))),
+        Expr(Path("arr/2/k"), Expr::Op::gt, Value(2)),
+        Expr(std::string("arr/01")),
+        Expr(std::string("arr/-")),
+    };
+    const QueryPlan plan(exprs);
+    for (const json& line : lines) {
+        CAPTURE(line.dump());
+        for (std::size_t i = 0; i < exprs.size(); ++i) {
+            CAPTURE(i);
+            CHECK(plan.matches(i, line) == exprs[i].matches(line));
+            const json* value = exprs[i].path.find(line);
+            REQUIRE((value != nullptr) == line.contains(exprs[i].path.ptr));
+            if (value != nullptr) {
+                CHECK(value == &line.at(exprs[i].path.ptr));
+            }
+        }
+    }
+}
+
+TEST_CASE("Parse backends build the same Index") {
+    std::vector<std::string> raw = {
+        R"({"level":"info","msg":"Hello from Live Log Query (llq)!"})",
+        R"({"level":"info","msg":"char event","char":"m","tag":"CatchEvent"})",
+        R"({"msg":"nested","expr":{"path":"/m"},"line":{"count":3}})",
+        R"({"msg":"quote \" and brace { in a string","arr":[{"x":1}]})",
+        R"({"esc\u0061ped":true})",
+    };
+
+    Index dom;
+    Index scan;
+    scan.config.parser = ParseBackend::Scan;
+    for (const auto& line : raw) {
+        updateIndexRaw(dom, line);
+        updateIndexRaw(scan, line);
+    }
+
+    CHECK(dom.lines == scan.lines);
+    CHECK(dom.bitsets.size() == scan.bitsets.size());
+    for (const auto& [hash, bitset] : dom.bitsets) {
+        REQUIRE(scan.bitsets.contains(hash));
+        CHECK(scan.bitsets.at(hash) == bitset);
+    }
+    CHECK(scan.bitsets.contains(keyId("escaped")));
+
+    CHECK(dom.values.size() == scan.values.size());
+    for (const auto& [hash, values] : dom.values) {
+        REQUIRE(scan.values.contains(hash));
+        CHECK(scan.values.at(hash).lines == values.lines);
+    }
+}
+
+TEST_CASE("Scan parser leaves numbers out of double range unindexed") {
+    Index index;
+    index.config.parser = ParseBackend::Scan;
+    updateIndexRaw(index, R"({"big":1e400,"tiny":1e-400,"n":0})");
+
+    CHECK(index.bitsets.at(keyId("big")).size() == 1);
+    CHECK_FALSE(index.columns.contains(keyId("big")));
+    CHECK_FALSE(index.values.contains(keyId("big")));
+    // underflow reads as 0, like the DOM parser
+    CHECK(index.values.at(keyId("tiny")).lines ==
+          index.values.at(keyId("n")).lines);
+}
+
+TEST_CASE("Parallel initial ingest matches sequential") {
+    std::string data;
+    for (int i = 0; i < 100; ++i) {
+        json line = {{"count", i}};
+        if (i % 3 == 0) {
+            line["tag"] = "three";
+        }
+        if (i % 7 == 0) {
+            line["msg"] = fmt::format("multiple of 7: {}", i);
+        }
+        data += line.dump() + '\n';
+    }
+    data += R"({"partial":)";  // trailing partial line is left for the tailer
+
+    Index sequential;
+    sequential.start_idx = 10;
+    indexLines(sequential, data);
+
+    IndexConfig config{.initialThreads = 4};
+    auto [index, consumed] = indexInParallel(data, 10, config, 64);
+
+    CHECK(consumed == data.rfind('\n') + 1);
+    CHECK(index.start_idx == 10);
+    CHECK(index.lines == sequential.lines);
+    CHECK(index.bitsets.size() == sequential.bitsets.size());
+    for (const auto& [hash, bitset] : sequential.bitsets) {
+        REQUIRE(index.bitsets.contains(hash));
+        CHECK(index.bitsets.at(hash) == bitset);
+    }
+
+    // a window at a time on one pool of workers, as the mapped ingestor does
+    WorkerPool  pool(3);
+    Index       windowed;
+    std::size_t at = 0;
+    windowed.start_idx = 10;
+    while (true) {
+        auto [window, used] = indexInParallel(
+            std::string_view(data).substr(at, 700), windowed.size() + 10,
+            config, 64, {}, 0, &pool
+        );
+        if (used == 0) {
+            break;
+        }
+        at += used;
+        mergeIndex(windowed, window);
+    }
+    CHECK(at == consumed);
+    CHECK(windowed.lines == sequential.lines);
+    for (const auto& [hash, bitset] : sequential.bitsets) {
+        REQUIRE(windowed.bitsets.contains(hash));
+        CHECK(windowed.bitsets.at(hash) == bitset);
+    }
+}
+
 TEST_CASE("Merge Index with other Index") {
     auto make = [](std::vector<json> lines) {
         Index ind;
@@ -231,7 +427,7 @@ TEST_CASE("Merge Index with other Index") {
         b.start_idx = 2;
         {
             // fmt::println("all bitsets: {}", a.bitsets);
-            BitSet keyBitSet = a.bitsets[Path("msg").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("msg")];
             BitSet expected;
             expected.push_back(true);
             expected.push_back(false);
@@ -239,7 +435,7 @@ TEST_CASE("Merge Index with other Index") {
             CHECK(keyBitSet == expected);
         }
         {
-            BitSet keyBitSet = a.bitsets[Path("count").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("count")];
             BitSet expected;
             expected.push_back(false);
             expected.push_back(true);
@@ -262,7 +458,7 @@ TEST_CASE("Merge Index with other Index") {
         CHECK(a.lines == lines);
 
         {
-            BitSet keyBitSet = a.bitsets[Path("msg").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("msg")];
             BitSet expected;
             expected.push_back(true);
             expected.push_back(false);
@@ -272,7 +468,7 @@ TEST_CASE("Merge Index with other Index") {
             CHECK(keyBitSet == expected);
         }
         {
-            BitSet keyBitSet = a.bitsets[Path("count").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("count")];
             BitSet expected;
             expected.push_back(false);
             expected.push_back(true);
@@ -296,14 +492,14 @@ TEST_CASE("Merge Index with other Index") {
         b.start_idx = 3;
         {
             // fmt::println("all bitsets: {}", a.bitsets);
-            BitSet keyBitSet = a.bitsets[Path("msg").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("msg")];
             BitSet expected;
             expected.push_back(true);
             expected.push_back(false);
             CHECK(keyBitSet == expected);
         }
         {
-            BitSet keyBitSet = a.bitsets[Path("count").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("count")];
             BitSet expected;
             expected.push_back(false);
             expected.push_back(true);
@@ -333,7 +529,7 @@ TEST_CASE("Merge Index with other Index") {
         b.start_idx = 1;
         {
             // fmt::println("all bitsets: {}", a.bitsets);
-            BitSet keyBitSet = a.bitsets[Path("msg").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("msg")];
             BitSet expected;
             expected.push_back(true);
             expected.push_back(false);
@@ -341,7 +537,7 @@ TEST_CASE("Merge Index with other Index") {
             CHECK(keyBitSet == expected);
         }
         {
-            BitSet keyBitSet = a.bitsets[Path("count").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("count")];
             BitSet expected;
             expected.push_back(false);
             expected.push_back(true);
@@ -363,7 +559,7 @@ TEST_CASE("Merge Index with other Index") {
         CHECK(a.lines == lines);
 
         {
-            BitSet keyBitSet = a.bitsets[Path("msg").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("msg")];
             BitSet expected;
             expected.push_back(true);
             expected.push_back(false);
@@ -372,7 +568,7 @@ TEST_CASE("Merge Index with other Index") {
             CHECK(keyBitSet == expected);
         }
         {
-            BitSet keyBitSet = a.bitsets[Path("count").frontHash];
+            BitSet keyBitSet = a.bitsets[keyId("count")];
             BitSet expected;
             expected.push_back(false);
             expected.push_back(true);
@@ -480,6 +676,290 @@ TEST_CASE("Run Query") {
     }
 }
 
+TEST_CASE("Nested key paths narrow the candidate lines") {
+    Index index;
+    index.config.pathDepth = 2;
+    for (const auto* line : {
+             R"({"http":{"method":"GET"}})",
+             R"({"http":{"response":{"status":200}}})",
+             R"({"http":{"response":{"bytes":12}}})",
+             R"({"http":[{"response":{"status":500}}]})",
+         }) {
+        updateIndexRaw(index, line);
+    }
+    auto candidates = [&](const std::string& q) {
+        std::vector<std::size_t> out;
+        BitSet filter = linesWithPathRoot(index, *Query::parse(q));
+        for (auto i : filter) {
+            out.push_back(i);
+        }
+        return out;
+    };
+    using V = std::vector<std::size_t>;
+
+    CHECK(index.bitsets.contains(keyId("http/response")));
+    CHECK(
+        index.bitsets.find(KeyDictionary::global().find(
+            Path("http/response/status").keys
+        )) == nullptr
+    );
+
+    CHECK(candidates("http") == V{0, 1, 2, 3});
+    CHECK(candidates("http.method") == V{0});
+    // deeper than pathDepth falls back to the indexed prefix
+    CHECK(candidates("http.response.status") == V{1, 2});
+    CHECK(candidates("http.missing") == V{});
+
+    index.config.pathDepth = 3;
+    index.clear();
+    updateIndexRaw(index, R"({"http":{"response":{"status":200}}})");
+    updateIndexRaw(index, R"({"http":{"response":{"bytes":12}}})");
+    CHECK(candidates("http.response.status") == V{0});
+
+    auto qr = runQueryOnIndex(index, *Query::parse("http.response.status"));
+    REQUIRE(qr != std::nullopt);
+    CHECK(qr->lines == std::vector<std::string>{
+                           R"(http: {"response":{"status":200}})"
+                       });
+}
+
+TEST_CASE("Equality on low-cardinality paths uses value bitmaps") {
+    Index index;
+    index.config.valueCap = 3;
+    for (int i = 0; i < 12; ++i) {
+        json line = {
+            {"level", i % 3 == 0 ? "error" : "info"},
+            {"count", i},
+            {"http", {{"status", 200 + (i % 2) * 300}}},
+        };
+        if (i == 5) {
+            line["level"] = 5;  // a number never equals a string
+        }
+        updateIndexRaw(index, line.dump());
+    }
+    auto values = [&](const std::string& path) -> const ValueBitsets& {
+        return index.values.at(keyId(path));
+    };
+    const auto& level  = values("level");
+    const auto& count  = values("count");
+    const auto& status = values("http/status");
+    CHECK(!level.demoted);
+    CHECK(level.lines.size() == 3);
+    CHECK(count.demoted);
+    CHECK(count.lines.empty());
+    CHECK(status.lines.size() == 2);
+
+    auto lines = [&](const std::string& q) {
+        auto                     query = *Query::parse(q);
+        std::vector<std::size_t> out;
+        for (auto i : linesWithPathRoot(index, query)) {
+            out.push_back(i);
+        }
+        return out;
+    };
+    using V = std::vector<std::size_t>;
+    CHECK(lines("level == 'error'") == V{0, 3, 6, 9});
+    CHECK(lines("http.status == 500") == V{1, 3, 5, 7, 9, 11});
+    CHECK(lines("level == 'error', http.status == 500") == V{3, 9});
+    CHECK(lines("level == 'warn'") == V{});
+    CHECK(lines("level == 5") == V{5});
+    // demoted paths fall back to the numeric column
+    CHECK(lines("count == 4") == V{4});
+
+    auto qr = runQueryOnIndex(index, *Query::parse("level == 'error', count"));
+    REQUIRE(qr != std::nullopt);
+    CHECK(qr->lines.size() == 4);
+    qr = runQueryOnIndex(index, *Query::parse("count == 4, level"));
+    REQUIRE(qr != std::nullopt);
+    CHECK(qr->lines == std::vector<std::string>{R"(count: 4,  level: "info")"});
+
+    SUBCASE("merging past the cap demotes") {
+        Index       other;
+        other.start_idx       = index.size();
+        other.config.valueCap = 3;
+        updateIndexRaw(other, R"({"level":"warn","http":{"status":200}})");
+        mergeIndex(index, other);
+        CHECK(index.values.at(keyId("level")).demoted);
+        CHECK(lines("level == 'error'").size() == 13);
+        CHECK(lines("http.status == 200") == V{0, 2, 4, 6, 8, 10, 12});
+    }
+}
+
+TEST_CASE("Range predicates scan numeric columns") {
+    constexpr std::size_t n = 3 * NumericColumn::kBlockLines + 17;
+
+    Index index;
+    index.config.parser = ParseBackend::Scan;
+    for (std::size_t i = 0; i < n; ++i) {
+        json line = {{"seq", i}, {"mod", static_cast<double>(i % 7) - 3.5}};
+        if (i % 5 == 0) {
+            line.erase("mod");
+        }
+        if (i % 11 == 0) {
+            line["mod"] = nullptr;
+        }
+        line["mixed"] = i % 13 == 0 ? json("str") : json(i);
+        updateIndexRaw(index, line.dump());
+    }
+
+    const auto& seq = index.columns.at(keyId("seq"));
+    CHECK(seq.zones.size() == 4);
+    CHECK(seq.zones[1].min == NumericColumn::kBlockLines);
+    CHECK(seq.zones[1].max == 2 * NumericColumn::kBlockLines - 1);
+    CHECK(index.columns.at(keyId("mixed")).mixed);
+
+    // every predicate gives the same lines as checking each line
+    for (const auto* q :
+         {"seq > 1500", "seq < 5", "seq > 99999", "seq < 2048, seq > 1023",
+          "mod > 0", "mod < -1", "mod == 2.5", "mixed > 40", "mixed < 40",
+          "mixed == 26", "mixed == 27"}) {
+        CAPTURE(q);
+        auto            query = *Query::parse(q);
+        const QueryPlan plan(query.exprs);
+
+        std::vector<std::size_t> expected;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (std::ranges::all_of(query.exprs, [&](const Expr& e) {
+                    return e.matches(index.line(i));
+                })) {
+                expected.push_back(i);
+            }
+        }
+        std::vector<std::size_t> actual;
+        BitSet                   filter = linesWithPathRoot(index, query);
+        for (auto i : filter) {
+            if (queryMatches(index, query, plan, index.line(i))) {
+                actual.push_back(i);
+            }
+        }
+        CHECK(actual == expected);
+    }
+
+    // a merged index rebuilds the zone maps at the shifted line numbers
+    Index merged;
+    Index tail;
+    tail.start_idx = 0;
+    updateIndexRaw(tail, R"({"seq":-1})");
+    mergeIndex(merged, tail);
+    index.start_idx = 1;
+    mergeIndex(merged, index);
+    const auto& column = merged.columns.at(keyId("seq"));
+    CHECK(column.values[0] == -1);
+    CHECK(column.values[n] == n - 1);
+    CHECK(column.zones[0].min == -1);
+    CHECK(linesWithPathRoot(merged, *Query::parse("seq < 0")).count() == 1);
+}
+
+TEST_CASE("Raw line storage answers queries like DOM storage") {
+    std::vector<std::string> raw;
+    for (int i = 0; i < 50; ++i) {
+        json line = {{"count", i}};
+        if (i % 3 == 0) {
+            line["tag"] = i % 2 == 0 ? "even" : "odd";
+        }
+        if (i % 5 == 0) {
+            line["msg"] = fmt::format("multiple of 5: {}", i);
+        }
+        raw.push_back(line.dump());
+    }
+
+    // build each index from two batches to exercise merging raw lines
+    auto make = [&](IndexConfig config) {
+        Index master;
+        Index batch;
+        batch.config = config;
+        for (std::size_t i = 0; i < raw.size(); ++i) {
+            if (i == 20) {
+                mergeIndex(master, batch);
+                batch.start_idx = 20;
+                batch.clear();
+            }
+            updateIndexRaw(batch, raw[i]);
+        }
+        mergeIndex(master, batch);
+        return master;
+    };
+    Index dom = make({});
+    Index arena =
+        make({.parser = ParseBackend::Scan, .storage = LineStorage::Raw});
+
+    CHECK(arena.lines.empty());
+    CHECK(arena.size() == raw.size());
+    CHECK(arena.raw[42] == raw[42]);
+    CHECK(arena.line(42) == dom.line(42));
+
+    for (std::string q : {"msg", "tag == 'even', count", "count > 40", "*"}) {
+        auto a = runQueryOnIndex(dom, std::move(*Query::parse(q)));
+        auto b = runQueryOnIndex(arena, std::move(*Query::parse(q)));
+        REQUIRE(a);
+        REQUIRE(b);
+        CHECK(a->lines == b->lines);
+    }
+}
+
+TEST_CASE("Offsets line storage reads lines back from the log file") {
+    const std::string path = "tmpoffsets.json";
+    std::string       data;
+    for (int i = 0; i < 200; ++i) {
+        json line = {{"count", i}};
+        if (i % 3 == 0) {
+            line["tag"] = i % 2 == 0 ? "even" : "odd";
+        }
+        data += line.dump() + '\n';
+    }
+    std::ofstream(path) << data;
+
+    Index raw;
+    raw.config = {.parser = ParseBackend::Scan, .storage = LineStorage::Raw};
+    indexLines(raw, data);
+
+    const IndexConfig config{
+        .parser         = ParseBackend::Scan,
+        .storage        = LineStorage::Offsets,
+        .initialThreads = 4,
+    };
+    const auto source     = std::make_shared<const LineSource>(path);
+    auto [flat, consumed] = indexInParallel(data, 0, config, 64, source);
+    CHECK(consumed == data.size());
+    CHECK(flat.raw.size() == 0);
+    CHECK(flat.size() == raw.size());
+    CHECK(flat.line(123) == raw.line(123));
+
+    // merged a batch at a time, as the query service receives them
+    SegmentedIndex segmented;
+    for (std::size_t from = 0; from < data.size();) {
+        const auto end =
+            data.find('\n', std::min(from + 1000, data.size() - 1));
+        Index batch;
+        batch.config    = config;
+        batch.source    = source;
+        batch.start_idx = segmented.size();
+        indexLines(batch, data.substr(from, end + 1 - from), from);
+        mergeIndex(segmented, batch);
+        from = end + 1;
+    }
+    REQUIRE(segmented.size() == raw.size());
+
+    for (std::string q : {"tag", "tag == 'even', count", "count > 150", "*"}) {
+        CAPTURE(q);
+        auto a = runQueryOnIndex(raw, std::move(*Query::parse(q)));
+        auto b = runQueryOnIndex(flat, std::move(*Query::parse(q)));
+        auto c = runQueryOnIndex(segmented, std::move(*Query::parse(q)));
+        REQUIRE(a);
+        REQUIRE(b);
+        REQUIRE(c);
+        CHECK(a->lines == b->lines);
+        CHECK(a->lines == c->lines);
+    }
+
+    // lines can't be stored as offsets without a file to read them from
+    Index orphan;
+    orphan.config.storage = LineStorage::Offsets;
+    CHECK_THROWS_AS(updateIndexRaw(orphan, "{}"), std::runtime_error);
+
+    std::filesystem::remove(path);
+}
+
 template <typename T, typename Func>
 void print(const std::vector<T>& v, Func f) {
     fmt::println("[");
@@ -498,6 +978,332 @@ void printJson(const std::vector<json>& v) {
     print(v, [](const json& j) { return j.dump(); });
 }
 
+TEST_CASE("Segmented index seals full segments and queries newest first") {
+    constexpr std::size_t kSegment = SegmentedIndex::kSegmentLines;
+    constexpr std::size_t n        = 3 * kSegment + 1000;
+    const IndexConfig     config{
+            .parser = ParseBackend::Scan, .storage = LineStorage::Raw
+    };
+
+    // batches straddle segment boundaries, and each repeats the last 10 lines
+    // of the one before it
+    SegmentedIndex segmented;
+    Index          flat;
+
+    auto makeBatch = [&](std::size_t start) {
+        Index batch;
+        batch.config    = config;
+        batch.start_idx = start == 0 ? 0 : start - 10;
+        for (auto i = batch.start_idx; i < std::min(n, start + 40000); ++i) {
+            json line = {{"seq", i}};
+            if (i % 1000 == 0) {
+                line["rare"] = i / 1000;
+            }
+            updateIndexRaw(batch, line.dump());
+        }
+        return batch;
+    };
+    for (std::size_t start = 0; start < n; start += 40000) {
+        Index batch = makeBatch(start);
+        mergeIndex(segmented, batch);
+        batch = makeBatch(start);
+        mergeIndex(flat, batch);
+    }
+
+    REQUIRE(segmented.size() == n);
+    CHECK(segmented.sealed.size() == 3);
+    CHECK(segmented.tail.size() == 1000);
+    CHECK(segmented.tail.start_idx == 3 * kSegment);
+    for (std::size_t s = 0; s < segmented.segmentCount(); ++s) {
+        const Index& segment = segmented.segment(s);
+        CHECK(segment.start_idx == s * kSegment);
+        CHECK(segment.line(0)["seq"] == s * kSegment);
+        std::size_t rare = 0;
+        for (std::size_t i = 0; i < segment.size(); ++i) {
+            rare += (s * kSegment + i) % 1000 == 0;
+        }
+        CHECK(segment.bitsets.at(keyId("rare")).count() == rare);
+    }
+    CHECK(segmented.line(kSegment + 5) == flat.line(kSegment + 5));
+
+    WorkerPool workers(3);  // scans segments on 4 threads
+    for (std::string q : {"rare", "seq > 190000", "rare == 7", "seq == 3"}) {
+        for (int maxMatches : {5, 1000}) {
+            CAPTURE(q);
+            CAPTURE(maxMatches);
+            auto query = *Query::parse(q, 0, maxMatches);
+            auto a     = runQueryOnIndex(flat, query.clone());
+            auto b     = runQueryOnIndex(segmented, query.clone());
+            auto c =
+                runQueryOnIndex(segmented, std::move(query), {}, 0, &workers);
+            REQUIRE(a);
+            REQUIRE(b);
+            REQUIRE(c);
+            CHECK(a->lines == b->lines);
+            CHECK(a->lines == c->lines);
+        }
+    }
+
+    // only the lines from `begin` on, as when refreshing after a merge
+    for (std::size_t begin : {kSegment + 5, 2 * kSegment, n - 3000}) {
+        CAPTURE(begin);
+        auto query = *Query::parse("rare", 0, 1000);
+        auto a     = runQueryOnIndex(flat, query.clone(), {}, begin);
+        auto b     = runQueryOnIndex(segmented, query.clone(), {}, begin);
+        auto c =
+            runQueryOnIndex(segmented, std::move(query), {}, begin, &workers);
+        REQUIRE(a);
+        REQUIRE(b);
+        REQUIRE(c);
+        CHECK(a->lines == b->lines);
+        CHECK(a->lines == c->lines);
+        CHECK(a->lines.size() == (n - 1) / 1000 - (begin - 1) / 1000);
+    }
+}
+
+TEST_CASE("Index sidecar restores sealed segments and resumes after them") {
+    constexpr std::size_t kSegment    = SegmentedIndex::kSegmentLines;
+    const std::string     logPath     = "tmpsidecar.json";
+    const std::string     sidecarPath = logPath + std::string(Sidecar::kSuffix);
+    const IndexConfig     config{
+            .parser         = ParseBackend::Scan,
+            .storage        = LineStorage::Raw,
+            .initialThreads = 2,
+    };
+
+    auto lineAt = [](std::size_t i) {
+        json line = {{"seq", i}, {"http", {{"method", i % 3 ? "GET" : "PUT"}}}};
+        if (i % 100 == 0) {
+            line["rare"] = i;
+        }
+        return line.dump() + '\n';
+    };
+    auto writeLines = [&](std::size_t from, std::size_t to) {
+        std::string data;
+        for (auto i = from; i < to; ++i) {
+            data += lineAt(i);
+        }
+        std::ofstream(logPath, std::ios::app) << data;
+    };
+    // ingest lines from `from` on, as the query service receives them
+    auto ingest = [&](SegmentedIndex& index, ResumePoint from) {
+        MappedFile file(logPath);
+        Index      batch;
+        batch.config    = config;
+        batch.start_idx = from.line;
+        indexLines(batch, file.view().substr(from.byte));
+        mergeIndex(index, batch);
+    };
+    auto query = [](auto& index, const std::string& q) {
+        auto result = runQueryOnIndex(index, *Query::parse(q, 0, 10));
+        return result ? result->lines : std::vector<std::string>();
+    };
+
+    std::filesystem::remove(logPath);
+    std::filesystem::remove(sidecarPath);
+    writeLines(0, 2 * kSegment + 100);
+
+    SegmentedIndex original;
+    {
+        Sidecar sidecar(logPath, config);
+        CHECK(sidecar.restore(original).line == 0);  // nothing to restore yet
+        ingest(original, {});
+        sidecar.persist(original);
+    }
+    REQUIRE(original.sealed.size() == 2);
+    REQUIRE(std::filesystem::exists(sidecarPath));
+
+    // lines appended since don't invalidate the sidecar
+    writeLines(2 * kSegment + 100, 2 * kSegment + 200);
+
+    std::size_t indexedBytes = 0;
+    for (std::size_t i = 0; i < 2 * kSegment; ++i) {
+        indexedBytes += lineAt(i).size();
+    }
+    SegmentedIndex restored;
+    Sidecar        sidecar(logPath, config);
+    const auto     from = sidecar.restore(restored);
+    CHECK(from.line == 2 * kSegment);
+    CHECK(from.byte == indexedBytes);
+    REQUIRE(restored.sealed.size() == 2);
+    CHECK(restored.tail.size() == 0);
+    CHECK(restored.tail.start_idx == 2 * kSegment);
+    for (std::size_t s = 0; s < 2; ++s) {
+        const Index& a = original.segment(s);
+        const Index& b = restored.segment(s);
+        CHECK(b.start_idx == a.start_idx);
+        CHECK(b.size() == a.size());
+        CHECK(b.raw[kSegment - 1] == a.raw[kSegment - 1]);
+        CHECK(b.bitsets.size() == a.bitsets.size());
+        for (const auto& [id, bitset] : a.bitsets) {
+            REQUIRE(b.bitsets.contains(id));
+            CHECK(b.bitsets.at(id) == bitset);
+        }
+        CHECK(b.values.size() == a.values.size());
+        for (const auto& [id, values] : a.values) {
+            REQUIRE(b.values.contains(id));
+            CHECK(b.values.at(id).demoted == values.demoted);
+            CHECK(b.values.at(id).lines == values.lines);
+        }
+        CHECK(b.columns.size() == a.columns.size());
+        for (const auto& [id, column] : a.columns) {
+            REQUIRE(b.columns.contains(id));
+            CHECK(b.columns.at(id).present == column.present);
+            CHECK(b.columns.at(id).values == column.values);
+            CHECK(b.columns.at(id).mixed == column.mixed);
+        }
+    }
+
+    // resuming ingestion from there answers queries like indexing it all
+    ingest(restored, from);
+    Index flat;
+    flat.config = config;
+    indexLines(flat, MappedFile(logPath).view());
+    REQUIRE(restored.size() == flat.size());
+    for (std::string q : {"rare", "http.method == 'PUT', seq", "seq < 500"}) {
+        CAPTURE(q);
+        CHECK(query(restored, q) == query(flat, q));
+    }
+
+    // segments sealed after a restore are appended to the same sidecar
+    writeLines(2 * kSegment + 200, 3 * kSegment + 10);
+    ingest(restored, {indexedBytes, 2 * kSegment});
+    sidecar.persist(restored);
+    {
+        SegmentedIndex again;
+        Sidecar        reopened(logPath, config);
+        CHECK(reopened.restore(again).line == 3 * kSegment);
+        CHECK(again.sealed.size() == 3);
+        CHECK(query(again, "rare") == query(restored, "rare"));
+    }
+    // the same records restore Offsets storage, pointing into the log
+    {
+        IndexConfig    offsets = config;
+        SegmentedIndex again;
+        offsets.storage = LineStorage::Offsets;
+        CHECK(Sidecar(logPath, offsets).restore(again).line == 3 * kSegment);
+        CHECK(again.segment(2).offsets.size() == kSegment);
+        CHECK(query(again, "rare") == query(restored, "rare"));
+    }
+
+    // a different config, or a log rewritten in place, discards the sidecar
+    const std::string backup = sidecarPath + ".bak";
+    std::filesystem::copy_file(
+        sidecarPath, backup, std::filesystem::copy_options::overwrite_existing
+    );
+    {
+        IndexConfig    deeper = config;
+        SegmentedIndex index;
+        deeper.pathDepth = 2;
+        CHECK(Sidecar(logPath, deeper).restore(index).line == 0);
+        CHECK(index.sealed.empty());
+        CHECK(!std::filesystem::exists(sidecarPath));
+    }
+    std::filesystem::rename(backup, sidecarPath);
+    {
+        std::fstream log(logPath, std::ios::in | std::ios::out);
+        log.seekp(2);
+        log << 'X';
+    }
+    {
+        SegmentedIndex index;
+        CHECK(Sidecar(logPath, config).restore(index).line == 0);
+        CHECK(index.sealed.empty());
+        CHECK(!std::filesystem::exists(sidecarPath));
+    }
+
+    std::filesystem::remove(logPath);
+}
+
+TEST_CASE("Options take whole numbers and reject anything else") {
+    auto parse = [](std::vector<std::string> args) {
+        args.insert(args.begin(), "llq");
+        args.emplace_back("log.json");
+        std::vector<char*> argv;
+        for (auto& arg : args) {
+            argv.push_back(arg.data());
+        }
+        return Options::parse(static_cast<int>(argv.size()), argv.data());
+    };
+
+    auto opts = parse({"--threads=3", "--depth=2", "--value-cap=0"});
+    REQUIRE(opts);
+    CHECK(opts->index.initialThreads == 3);
+    CHECK(opts->index.pathDepth == 2);
+    CHECK(opts->index.valueCap == 0);
+    CHECK(opts->fname == "log.json");
+
+    for (std::string bad :
+         {"--threads=", "--threads=4x", "--threads=0", "--query-threads=-1",
+          "--depth=two", "--depth=0", "--value-cap=1.5",
+          "--value-cap=99999999999999999999999"}) {
+        CAPTURE(bad);
+        CHECK_FALSE(parse({bad}));
+    }
+}
+
+TEST_CASE("Index sidecar stops persisting when the log is truncated") {
+    constexpr std::size_t kSegment    = SegmentedIndex::kSegmentLines;
+    const std::string     logPath     = "tmpsidecar_truncate.json";
+    const std::string     sidecarPath = logPath + std::string(Sidecar::kSuffix);
+    const IndexConfig     config{
+            .parser  = ParseBackend::Scan,
+            .storage = LineStorage::Raw,
+    };
+
+    // lines written after the truncation differ from the ones before it
+    auto writeLines = [&](std::size_t from, std::size_t to, bool after) {
+        std::string data;
+        for (auto i = from; i < to; ++i) {
+            data += json{{"seq", i}, {"after", after}}.dump() + '\n';
+        }
+        std::ofstream(logPath, std::ios::app) << data;
+    };
+    auto ingest = [&](SegmentedIndex& index, std::size_t from, std::size_t to) {
+        Index batch;
+        batch.config    = config;
+        batch.start_idx = index.size();
+        for (auto i = from; i < to; ++i) {
+            updateIndexRaw(batch, json{{"seq", i}, {"after", false}}.dump());
+        }
+        mergeIndex(index, batch);
+    };
+
+    std::filesystem::remove(logPath);
+    std::filesystem::remove(sidecarPath);
+    writeLines(0, kSegment + 10, false);
+
+    SegmentedIndex index;
+    Sidecar        sidecar(logPath, config);
+    sidecar.restore(index);
+    ingest(index, 0, kSegment + 10);
+    sidecar.persist(index);
+    REQUIRE(index.sealed.size() == 1);
+    const auto written = std::filesystem::file_size(sidecarPath);
+
+    // copytruncate between the first and second sealed segment
+    writeLines(kSegment + 10, 2 * kSegment, false);
+    ingest(index, kSegment + 10, 2 * kSegment);
+    REQUIRE(index.sealed.size() == 2);
+    std::filesystem::resize_file(logPath, 0);
+    writeLines(0, 10, true);
+
+    sidecar.persist(index);  // must not read past the end of the log
+    CHECK(std::filesystem::file_size(sidecarPath) == written);
+
+    // and stays off once the log has grown past the indexed bytes again
+    writeLines(10, 3 * kSegment, true);
+    ingest(index, 2 * kSegment, 3 * kSegment);
+    sidecar.persist(index);
+    CHECK(std::filesystem::file_size(sidecarPath) == written);
+
+    SegmentedIndex restored;
+    CHECK(Sidecar(logPath, config).restore(restored).line == 0);
+
+    std::filesystem::remove(logPath);
+    std::filesystem::remove(sidecarPath);
+}
+
 TEST_CASE("Ingestor") {
     // set up tmp file with data
     std::vector<json> sampleData = {
@@ -511,11 +1317,14 @@ TEST_CASE("Ingestor") {
     std::string   tmpFilename = "tmpfile";
     std::ofstream writeFile(tmpFilename);
 
+    // write each batch with a single flush so an event-driven ingestor can't
+    // observe (and send) half of it
     auto writeData = [&](const std::vector<json>& objs) {
+        std::string batch;
         for (const auto& obj : objs) {
-            writeFile << obj.dump() << std::endl;
+            batch += obj.dump() + '\n';
         }
-        writeFile.flush();
+        writeFile << batch << std::flush;
     };
     writeData(sampleData);
 
@@ -529,8 +1338,12 @@ TEST_CASE("Ingestor") {
             overloaded{
                 [](StopSignal&) {},
                 [&](Index& index) { f(index); },
-                [&](Query& query) {
-                    fmt::println("Received `Query` branch in Ingestor test");
+                [&](QueryWaiting&) {
+                    fmt::println("Received `QueryWaiting` in Ingestor test");
+                    CHECK(false);
+                },
+                [&](LogTruncated&) {
+                    fmt::println("Received `LogTruncated` in Ingestor test");
                     CHECK(false);
                 },
             },
@@ -539,8 +1352,23 @@ TEST_CASE("Ingestor") {
     };
 
     fmt::println("Spawning Ingestor...");
-    std::fstream readHandle(tmpFilename, std::ios::in);
-    std::thread  ingestor = spawnIngestor(queue, readHandle, shutdownFlag);
+    std::fstream               readHandle;
+    std::optional<FileWatcher> watcher;
+    std::thread                ingestor;
+    SUBCASE("stream") {
+        readHandle.open(tmpFilename, std::ios::in);
+        ingestor = spawnIngestor(queue, readHandle, shutdownFlag);
+    }
+    SUBCASE("mmap") {
+        ingestor = spawnIngestor(queue, tmpFilename, shutdownFlag);
+    }
+    if (kInotifySupported) {
+        SUBCASE("mmap + inotify") {
+            watcher.emplace(tmpFilename, FollowMode::Inotify);
+            ingestor =
+                spawnIngestor(queue, tmpFilename, *watcher, shutdownFlag);
+        }
+    }
     fmt::println("Ingestor Spawned");
 
     {
@@ -604,12 +1432,140 @@ TEST_CASE("Ingestor") {
         });
     }
 
+    {
+        // a partially written line is held back until its newline arrives
+        writeFile << R"({"count":)";
+        writeFile.flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        writeFile << "129}" << std::endl;
+
+        waitForResponse([&](Index& index) {
+            fmt::println("5th index sent");
+            CHECK(index.start_idx == 12);
+            CHECK(index.lines.size() == 1);
+            CHECK(index.lines == std::vector<json>{{{"count", 129}}});
+        });
+    }
+
     shutdownFlag.store(true);
+    if (watcher) {
+        watcher->wake();
+    }
     ingestor.join();
     std::filesystem::remove(tmpFilename);
     fmt::println("Ingestor successfully shutdown");
 }
 
+TEST_CASE("Ingestor follows rotated file") {
+    FollowMode mode = FollowMode::Poll;
+    SUBCASE("poll") {}
+    if (kInotifySupported) {
+        SUBCASE("inotify") {
+            mode = FollowMode::Inotify;
+        }
+    }
+    std::string tmpFilename = "tmpfile_rotate";
+    std::string rotatedName = tmpFilename + ".1";
+    {
+        std::ofstream writeFile(tmpFilename);
+        writeFile << json{{"msg", "before rotation"}}.dump() << std::endl;
+    }
+
+    folly::MPMCQueue<Msg> queue(10);
+    std::atomic<bool>     shutdownFlag(false);
+    FileWatcher           watcher(tmpFilename, mode);
+    std::thread           ingestor =
+        spawnIngestor(queue, tmpFilename, watcher, shutdownFlag);
+
+    auto nextIndex = [&]() {
+        Msg msg;
+        queue.blockingRead(msg);
+        REQUIRE(std::holds_alternative<Index>(msg));
+        return std::move(std::get<Index>(msg));
+    };
+
+    Index first = nextIndex();
+    CHECK(first.start_idx == 0);
+    CHECK(first.lines == std::vector<json>{{{"msg", "before rotation"}}});
+
+    std::filesystem::rename(tmpFilename, rotatedName);
+    {
+        std::ofstream writeFile(tmpFilename);
+        writeFile << json{{"msg", "after rotation"}}.dump() << std::endl;
+    }
+
+    Index second = nextIndex();
+    CHECK(second.start_idx == 1);
+    CHECK(second.lines == std::vector<json>{{{"msg", "after rotation"}}});
+
+    shutdownFlag.store(true);
+    watcher.wake();
+    ingestor.join();
+    std::filesystem::remove(tmpFilename);
+    std::filesystem::remove(rotatedName);
+}
+
+TEST_CASE("Ingestor starts over when the file is truncated in place") {
+    if (!kInotifySupported) {
+        return;
+    }
+    IndexConfig config;
+    SUBCASE("lines kept") {}
+    SUBCASE("lines read back from the file") {
+        config.storage = LineStorage::Offsets;
+    }
+    std::string tmpFilename = "tmpfile_truncate";
+    {
+        std::ofstream writeFile(tmpFilename);
+        writeFile << json{{"msg", "a long line before truncation"}}.dump()
+                  << std::endl;
+    }
+
+    folly::MPMCQueue<Msg> queue(10);
+    std::atomic<bool>     shutdownFlag(false);
+    FileWatcher           watcher(tmpFilename, FollowMode::Inotify);
+    std::thread           ingestor =
+        spawnIngestor(queue, tmpFilename, watcher, shutdownFlag, config);
+
+    auto nextIndex = [&]() {
+        Msg msg;
+        queue.blockingRead(msg);
+        REQUIRE(std::holds_alternative<Index>(msg));
+        return std::move(std::get<Index>(msg));
+    };
+
+    Index first = nextIndex();
+    CHECK(first.start_idx == 0);
+    CHECK(first.line(0)["msg"] == "a long line before truncation");
+
+    // copytruncate: same inode, shorter contents
+    std::filesystem::resize_file(tmpFilename, 0);
+    {
+        std::ofstream writeFile(tmpFilename, std::ios::app);
+        writeFile << json{{"msg", "after"}}.dump() << std::endl;
+    }
+
+    if (config.storage == LineStorage::Offsets) {
+        // the first line can't be read back any more, so it's dropped and
+        // numbering starts over
+        Msg msg;
+        queue.blockingRead(msg);
+        CHECK(std::holds_alternative<LogTruncated>(msg));
+        LineReader reader;
+        CHECK(first.bytes(0, reader).empty());
+    }
+    Index second = nextIndex();
+    CHECK(second.start_idx ==
+          (config.storage == LineStorage::Offsets ? 0 : 1));
+    CHECK(second.size() == 1);
+    CHECK(second.line(0) == json{{"msg", "after"}});
+
+    shutdownFlag.store(true);
+    watcher.wake();
+    ingestor.join();
+    std::filesystem::remove(tmpFilename);
+}
+
 TEST_CASE("QueryService") {
     auto make = [](std::vector<json>& lines) {
         Index ind;
@@ -619,7 +1575,7 @@ TEST_CASE("QueryService") {
         return std::move(ind);
     };
 
-    folly::MPMCQueue<Msg> channel(10);  // TODO: 1 should work, right?
+    ServiceChannel        channel(10);
     int                   onUpdateCounter = 0;
     std::function<void()> onUpdate        = [&]() { ++onUpdateCounter; };
     folly::Synchronized<QueryResult> queryResult;
@@ -641,21 +1597,218 @@ TEST_CASE("QueryService") {
     };
 
     check(0, {});  // nothing yet
-    channel.blockingWrite(std::move(make(sampleData)));
+    channel.batches.blockingWrite(std::move(make(sampleData)));
     check(0, {});  // nothing yet
-    channel.blockingWrite(std::move(*Query::parse("tag", 1)));
+    channel.sendQuery(std::move(*Query::parse("tag", 1)));
 
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
     check(1, {"tag: 5", "tag: 3", "tag: 5"});  // results of `tag` query
 
-    channel.blockingWrite(std::move(*Query::parse("tag == 5", 2)));
+    channel.sendQuery(std::move(*Query::parse("tag == 5", 2)));
 
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
     check(2, {"tag: 5", "tag: 5"});  // results of `tag` query
 
     fmt::println("Sending stop signal...");
-    channel.blockingWrite(StopSignal{});
+    channel.batches.blockingWrite(StopSignal{});
     fmt::println("Stop signal sent");
     join.join();
     fmt::println("QS joined");
 }
+
+TEST_CASE("Query service takes the newest query ahead of queued batches") {
+    ServiceChannel        channel(2);
+    std::atomic<int>      onUpdateCounter = 0;
+    std::function<void()> onUpdate        = [&]() { ++onUpdateCounter; };
+    folly::Synchronized<QueryResult> queryResult;
+
+    // queued before the service starts, as when typing outpaces it: the
+    // batch lane is full, yet sending queries doesn't wait on it
+    for (int from : {0, 10}) {
+        Index index;
+        index.start_idx = from;
+        for (int i = from; i < from + 10; ++i) {
+            updateIndex(index, {{"count", i}, {"tag", i % 2}});
+        }
+        channel.batches.blockingWrite(std::move(index));
+    }
+    for (long seq = 1; seq <= 3; ++seq) {
+        channel.sendQuery(
+            std::move(*Query::parse(seq == 3 ? "tag == 1" : "count", seq))
+        );
+    }
+    CHECK(channel.latest() == 3);
+    CHECK(channel.queryWaiting());
+
+    // only the newest query runs, before the batches are merged, and the
+    // refresh after merging them puts its matches on display
+    std::thread join = spawnQueryService(channel, queryResult, onUpdate);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    {
+        auto qr = queryResult.rlock();
+        CHECK(qr->query.seq == 3);
+        CHECK(qr->lines.size() == 10);
+    }
+    CHECK(onUpdateCounter == 2);
+    CHECK(!channel.queryWaiting());
+
+    channel.batches.blockingWrite(StopSignal{});
+    join.join();
+}
+
+TEST_CASE("Query service refreshes the query on display with new lines") {
+    ServiceChannel        channel(10);
+    std::atomic<int>      onUpdateCounter = 0;
+    std::function<void()> onUpdate        = [&]() { ++onUpdateCounter; };
+    folly::Synchronized<QueryResult> queryResult;
+
+    auto batch = [](int from, int to, auto tag) {
+        Index index;
+        index.start_idx = from;
+        for (int i = from; i < to; ++i) {
+            updateIndex(index, {{"count", i}, {"tag", tag(i)}});
+        }
+        return index;
+    };
+    auto lines  = [&]() { return queryResult.rlock()->lines; };
+    auto match  = [](int i) { return fmt::format("tag: 1,  count: {}", i); };
+    auto settle = [] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    };
+
+    std::thread join = spawnQueryService(channel, queryResult, onUpdate);
+    channel.batches.blockingWrite(batch(0, 10, [](int i) { return i % 2; }));
+    settle();
+    channel.sendQuery(std::move(*Query::parse("tag == 1, count", 1, 3)));
+    settle();
+    CHECK(lines() == std::vector{match(9), match(7), match(5)});
+    CHECK(onUpdateCounter == 1);
+
+    // new matches go in front, pushing the oldest out of the window
+    channel.batches.blockingWrite(batch(10, 14, [](int i) { return i % 2; }));
+    settle();
+    CHECK(lines() == std::vector{match(13), match(11), match(9)});
+    CHECK(onUpdateCounter == 2);
+
+    // a batch with nothing new leaves it be
+    channel.batches.blockingWrite(batch(14, 20, [](int) { return 0; }));
+    settle();
+    CHECK(lines() == std::vector{match(13), match(11), match(9)});
+    CHECK(onUpdateCounter == 2);
+
+    // after a truncation only lines indexed since are shown, from line 0
+    channel.batches.blockingWrite(LogTruncated{});
+    channel.batches.blockingWrite(batch(0, 2, [](int i) { return i % 2; }));
+    settle();
+    CHECK(lines() == std::vector{match(1)});
+    channel.sendQuery(std::move(*Query::parse("count", 2)));
+    settle();
+    CHECK(queryResult.rlock()->lines.size() == 2);
+
+    channel.batches.blockingWrite(StopSignal{});
+    join.join();
+}
+
+TEST_CASE("A narrower query reuses the scan of the one before it") {
+    constexpr std::size_t kSegment = SegmentedIndex::kSegmentLines;
+    constexpr std::size_t n        = 2 * kSegment + 5000;
+
+    SegmentedIndex index;
+    Index          batch;
+    batch.config = {.parser = ParseBackend::Scan, .storage = LineStorage::Raw};
+    auto lineAt  = [](std::size_t i) {
+        json line = {{"count", i}, {"msg", fmt::format("line {}", i)}};
+        if (i % 1000 == 7) {
+            line["level"] = i % 3000 == 7 ? "error" : "warn";
+        }
+        return line.dump();
+    };
+    for (std::size_t i = 0; i < n - 3000; ++i) {
+        updateIndexRaw(batch, lineAt(i));
+    }
+    mergeIndex(index, batch);
+
+    auto run = [&](const std::string& q, const ScanRecord* previous,
+                   ScanRecord& record) {
+        auto result = runRecordedQuery(
+            index, *Query::parse(q, 0, 200), {}, previous, record
+        );
+        return result ? result->lines : std::vector<std::string>();
+    };
+    auto full = [&](const std::string& q) {
+        auto result = runQueryOnIndex(index, *Query::parse(q, 0, 200));
+        return result ? result->lines : std::vector<std::string>();
+    };
+
+    // a query with few matches checks every line, and records that
+    ScanRecord first;
+    CHECK(run("level, msg", nullptr, first) == full("level, msg"));
+    CHECK(first.from == 0);
+    CHECK(first.to == index.size());
+    std::size_t levels = 0;
+    for (std::size_t i = 0; i < n - 3000; ++i) {
+        levels += i % 1000 == 7;
+    }
+    CHECK(first.matches.size() == levels);
+
+    // the same scan split among workers records the same matches
+    ScanRecord parallel;
+    WorkerPool workers(3);
+    auto       split = runRecordedQuery(
+        index, *Query::parse("level, msg", 0, 200), {}, nullptr, parallel,
+        &workers
+    );
+    REQUIRE(split);
+    CHECK(split->lines == full("level, msg"));
+    CHECK(parallel.matches == first.matches);
+    CHECK(parallel.from == first.from);
+
+    // lines merged since are scanned as usual
+    batch.clear();
+    batch.start_idx = index.size();
+    for (std::size_t i = n - 3000; i < n; ++i) {
+        updateIndexRaw(batch, lineAt(i));
+    }
+    mergeIndex(index, batch);
+
+    for (std::string q : {"level == 'error', msg", "level, msg, count > 60000",
+                          "level, msg, count < 1000"}) {
+        CAPTURE(q);
+        ScanRecord next;
+        CHECK(run(q, &first, next) == full(q));
+        CHECK(next.to == index.size());
+    }
+
+    // a record of no matches is trusted for the range it covers
+    ScanRecord none{*Query::parse("level"), 0, n - 3000, {}};
+    ScanRecord next;
+    CHECK(run("level, msg", &none, next).size() == 3);
+    CHECK(run("msg", &none, next).size() == 200);  // doesn't narrow `level`
+}
+
+TEST_CASE("A newer query cancels a running scan") {
+    // distinct messages demote `msg`, so equality on it checks every line
+    Index          flat;
+    Index          batch;
+    SegmentedIndex segmented;
+    for (int i = 0; i < 100000; ++i) {
+        updateIndex(flat, {{"msg", fmt::format("line {}", i)}});
+        updateIndex(batch, {{"msg", fmt::format("line {}", i)}});
+    }
+    mergeIndex(segmented, batch);
+
+    // only the oldest line matches, so the scan visits every line first
+    auto query = [] { return *Query::parse("msg == 'line 0'", 3); };
+
+    std::atomic<long> latestQuery{3};
+    const CancelToken token{&latestQuery, 3};
+    REQUIRE(runQueryOnIndex(flat, query(), token));
+    CHECK(runQueryOnIndex(flat, query(), token)->lines.size() == 1);
+    CHECK(runQueryOnIndex(segmented, query(), token));
+
+    latestQuery.store(4);  // the UI sent seq 4
+    CHECK(token.cancelled());
+    CHECK(!runQueryOnIndex(flat, query(), token));
+    CHECK(!runQueryOnIndex(segmented, query(), token));
+    CHECK(runQueryOnIndex(flat, query()));  // no token, never cancelled
+}
@@ -1,44 +1,451 @@
 #pragma once
 
+#include <fmt/core.h>
+#include <folly/MPMCQueue.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
 #include "utils/bitset.h"
+#include "utils/key_dictionary.h"
+#include "utils/line_arena.h"
+#include "utils/line_source.h"
+#include "utils/lru_cache.h"
 #include "expr.h"
 #include "parser.h"
 
+// Which parser turns raw lines into index entries
+enum class ParseBackend {
+    Dom,   // json::parse the line, then walk the DOM's keys
+    Scan,  // SIMD structural scan of the raw bytes, see utils/json_scan.h
+};
+
+// Where an Index keeps its lines
+enum class LineStorage {
+    Dom,  // parsed `json` per line
+    Raw,  // original bytes in a LineArena, parsed on demand
+    // only each line's place in the log file, read back with pread and parsed
+    // on demand, so memory doesn't grow with the size of the lines
+    Offsets,
+};
+
+// How an Index builds its entries, chosen at startup
+struct IndexConfig {
+    ParseBackend parser  = ParseBackend::Dom;
+    LineStorage  storage = LineStorage::Dom;
+    // Deepest object nesting whose key paths get presence bitsets, e.g. 3
+    // covers `http.response.status`
+    std::size_t pathDepth = 4;
+    // Distinct scalar values a key path may take before its per-value
+    // bitmaps are dropped; 0 turns value bitmaps off
+    std::size_t valueCap = 64;
+    // Keep the numbers at each key path in a NumericColumn
+    bool numericColumns = true;
+    // Worker threads that index what's already in the file when ingestion
+    // starts; tailing after that is single threaded
+    unsigned initialThreads = 1;
+};
+
+// Lines holding each distinct string or number at one key path, keyed by
+// `Value::indexKey()`. Once a path goes past IndexConfig::valueCap distinct
+// values it's demoted: the bitmaps are dropped for good and equality on that
+// path falls back to checking each line.
+struct ValueBitsets {
+    bool                                    demoted = false;
+    std::unordered_map<std::string, BitSet> lines;
+
+    void demote() {
+        demoted = true;
+        lines.clear();
+    }
+};
+
+// The numbers at one key path, one slot per line, so range predicates run over
+// a flat array instead of each line's json. `present` marks the lines holding
+// a number there (other slots are 0), and each block of kBlockLines lines has
+// a zone map of its smallest and largest number so whole blocks can be ruled
+// in or out.
+struct NumericColumn {
+    static constexpr std::size_t kBlockLines = 1024;
+
+    struct Zone {
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+    };
+
+    std::vector<double> values;
+    BitSet              present;
+    std::vector<Zone>   zones;
+    // some line holds a string here, which compares less than any number
+    bool mixed = false;
+
+    void set(std::size_t line, double val) {
+        if (values.size() <= line) {
+            values.resize(line + 1);
+            zones.resize(line / kBlockLines + 1);
+        }
+        values[line] = val;
+        present.set(line, true);
+        Zone& zone = zones[line / kBlockLines];
+        zone.min   = std::min(zone.min, val);
+        zone.max   = std::max(zone.max, val);
+    }
+
+    // Lines (out of `size`) whose number is `op` `rhs`, for `op` one of lt, eq
+    // or gt. Lines holding anything but a number never match.
+    [[nodiscard]] BitSet select(Expr::Op op, double rhs, std::size_t size)
+        const {
+        switch (op) {
+            case Expr::Op::lt:
+                return selectWith(
+                    size, [=](double v) { return v < rhs; },
+                    [=](Zone z) { return z.min >= rhs; },
+                    [=](Zone z) { return z.max < rhs; }
+                );
+            case Expr::Op::gt:
+                return selectWith(
+                    size, [=](double v) { return v > rhs; },
+                    [=](Zone z) { return z.max <= rhs; },
+                    [=](Zone z) { return z.min > rhs; }
+                );
+            case Expr::Op::eq:
+                return selectWith(
+                    size, [=](double v) { return v == rhs; },
+                    [=](Zone z) { return rhs < z.min || rhs > z.max; },
+                    [=](Zone z) { return z.min == rhs && z.max == rhs; }
+                );
+            default:
+                throw std::invalid_argument("Unsupported column predicate");
+        }
+    }
+
+   private:
+    // `skip(zone)` rules a block out, `all(zone)` rules every number in it in;
+    // otherwise each slot is checked with `matches`
+    template <typename Matches, typename Skip, typename All>
+    [[nodiscard]] BitSet selectWith(
+        std::size_t size,
+        Matches     matches,
+        Skip        skip,
+        All         all
+    ) const {
+        BitSet out = BitSet::falseMask(size);
+        for (std::size_t b = 0; b < zones.size(); ++b) {
+            if (skip(zones[b])) {
+                continue;
+            }
+            const std::size_t begin    = b * kBlockLines;
+            const std::size_t end      = std::min(begin + kBlockLines, size);
+            const bool        allMatch = all(zones[b]);
+            for (std::size_t i = begin; i < end && i < values.size(); ++i) {
+                if (present[i] && (allMatch || matches(values[i]))) {
+                    out.set(i, true);
+                }
+            }
+        }
+        return out;
+    }
+};
+
+// Bitsets and columns are keyed by the KeyDictionary::global() id of their
+// key path.
 struct Index {
-    using PathHash = std::size_t;
+    // parsed raw lines kept around for repeated queries over recent lines
+    static constexpr std::size_t kParsedCacheLines = 4096;
 
-    std::size_t                          start_idx{};
-    std::vector<json>                    lines;
-    std::unordered_map<PathHash, BitSet> bitsets;
+    std::size_t       start_idx{};
+    std::vector<json> lines;    // LineStorage::Dom
+    LineArena         raw;      // LineStorage::Raw
+    LineOffsets       offsets;  // LineStorage::Offsets
+    // file the ingestor is reading Offsets lines from; kept by clear() and by
+    // a moved-from Index, like config
+    std::shared_ptr<const LineSource> source;
+    KeyMap<BitSet>                    bitsets;
+    // only paths that held a scalar on some line; see ValueBitsets
+    KeyMap<ValueBitsets> values;
+    // paths that held a number or string on some line; see NumericColumn
+    KeyMap<NumericColumn> columns;
+    IndexConfig           config;
 
     Index() = default;
 
-    Index(
-        std::size_t                          s,
-        std::vector<json>                    l,
-        std::unordered_map<PathHash, BitSet> b
-    )
+    Index(std::size_t s, std::vector<json> l, KeyMap<BitSet> b)
         : start_idx(s), lines(std::move(l)), bitsets(std::move(b)) {}
 
     // Move constructor (noexcept)
     Index(Index&& other) noexcept
         : start_idx(other.start_idx)
         , lines(std::move(other.lines))
-        , bitsets(std::move(other.bitsets)) {}  // FIXME:
+        , raw(std::move(other.raw))
+        , offsets(std::move(other.offsets))
+        , source(other.source)
+        , bitsets(std::move(other.bitsets))  // FIXME:
+        , values(std::move(other.values))
+        , columns(std::move(other.columns))
+        , config(other.config) {}
 
     // Move assignment operator (noexcept)
     Index& operator=(Index&& other) noexcept {
         if (this != &other) {
             start_idx = other.start_idx;
             lines     = std::move(other.lines);
+            raw       = std::move(other.raw);
+            offsets   = std::move(other.offsets);
+            source    = other.source;
             bitsets   = std::move(other.bitsets);  // FIXME:
+            values    = std::move(other.values);
+            columns   = std::move(other.columns);
+            config    = other.config;
+            parsed.clear();
         }
         return *this;
     }
+
+    [[nodiscard]] std::size_t size() const {
+        switch (config.storage) {
+            case LineStorage::Dom:
+                return lines.size();
+            case LineStorage::Raw:
+                return raw.size();
+            case LineStorage::Offsets:
+                return offsets.size();
+        }
+        return 0;
+    }
+
+    // Original bytes of line `i` of a Raw or Offsets index, read through
+    // `reader` for Offsets; good until the next call
+    [[nodiscard]] std::string_view bytes(std::size_t i, LineReader& reader)
+        const {
+        return config.storage == LineStorage::Offsets ? reader.read(offsets[i])
+                                                      : raw[i];
+    }
+
+    // Line `i` (relative to start_idx) as json. Raw and Offsets lines are
+    // parsed on first use and cached, so the reference is only good until the
+    // next call.
+    [[nodiscard]] const json& line(std::size_t i) const {
+        if (config.storage == LineStorage::Dom) {
+            return lines[i];
+        }
+        if (const json* hit = parsed.get(i)) {
+            return *hit;
+        }
+        return parsed.put(i, json::parse(bytes(i, reader), nullptr, false));
+    }
+
+    // Drop all lines and bitsets, keeping start_idx and config
+    void clear() {
+        lines.clear();
+        raw.clear();
+        offsets.clear();
+        bitsets.clear();
+        values.clear();
+        columns.clear();
+        parsed.clear();
+    }
+
+   private:
+    mutable LruCache<std::size_t, json> parsed{kParsedCacheLines};
+    mutable LineReader                  reader;
 };
 
+// Append lines [from, to) of `other` (relative to its start_idx) to the end of
+// `index`, with their bitsets, value bitmaps and column entries. Lines are
+// moved out of `other`. Keys and values with nothing in the range are left
+// out.
+void appendLines(Index& index, Index& other, std::size_t from, std::size_t to) {
+    // an empty index takes on the line storage of what's merged into it
+    if (index.size() == 0) {
+        index.config = other.config;
+    }
+    to = std::min(to, other.size());
+    if (from >= to) {
+        return;
+    }
+    const std::size_t at = index.size();
+
+    for (auto b_idx = from; b_idx < to && b_idx < other.lines.size(); ++b_idx) {
+        index.lines.push_back(std::move(other.lines[b_idx]));
+    }
+    index.raw.append(other.raw, from, to);
+    index.offsets.append(other.offsets, from, to);
+
+    // first set bit of `bitset` in [i, to), or `to` if there is none
+    const auto nextInRange = [&](const BitSet& bitset, std::size_t i) {
+        const auto next = bitset.nextSetBit(i);
+        return next < bitset.size() ? std::min(next, to) : to;
+    };
+    const auto inRange = [&](const BitSet& bitset) {
+        return nextInRange(bitset, from) < to;
+    };
+    const auto mergeBitSet = [&](BitSet& bitset, const BitSet& other_bitset) {
+        bitset.appendRange(other_bitset, from, at, to);
+    };
+    for (const auto& [k, other_bitset] : other.bitsets) {
+        if (inRange(other_bitset)) {
+            mergeBitSet(index.bitsets[k], other_bitset);
+        }
+    }
+    for (const auto& [k, other_values] : other.values) {
+        if (!other_values.demoted &&
+            std::ranges::none_of(other_values.lines, [&](const auto& kv) {
+                return inRange(kv.second);
+            })) {
+            continue;
+        }
+        ValueBitsets& values = index.values[k];
+        if (values.demoted) {
+            continue;
+        }
+        if (other_values.demoted) {
+            values.demote();
+            continue;
+        }
+        for (const auto& [value, other_bitset] : other_values.lines) {
+            if (inRange(other_bitset)) {
+                mergeBitSet(values.lines[value], other_bitset);
+            }
+        }
+        if (values.lines.size() > index.config.valueCap) {
+            values.demote();
+        }
+    }
+    for (const auto& [k, other_column] : other.columns) {
+        if (!other_column.mixed && !inRange(other_column.present)) {
+            continue;
+        }
+        NumericColumn& column = index.columns[k];
+        column.mixed |= other_column.mixed;
+        const auto& present = other_column.present;
+        for (auto b_idx = nextInRange(present, from); b_idx < to;
+             b_idx      = nextInRange(present, b_idx + 1)) {
+            column.set(at + b_idx - from, other_column.values[b_idx]);
+        }
+    }
+}
+
+bool mergeIndex(Index& index, Index& other, bool throw_on_gap = true) {
+    // assumption:
+    assert(index.start_idx <= other.start_idx);
+
+    const auto a_s     = index.start_idx;
+    const auto a_e     = a_s + index.size() - 1;
+    const auto b_s     = other.start_idx;
+    const bool a_gap_b = b_s > a_e + 1;
+    if (a_gap_b) {
+        // can't merge if combining ranges results in a gap (i.e. result must be
+        // contiguous)
+        if (throw_on_gap) {
+            throw std::runtime_error(fmt::format(
+                "Merging incoming index results in a gap. a_e: {}, b_s: {}",
+                a_e, b_s
+            ));
+        }
+        return false;
+    }
+
+    // skip lines of `other` that `index` already has
+    appendLines(index, other, a_e + 1 - b_s, other.size());
+    return true;
+}
+
+// The query service's index of everything ingested so far, as Index segments
+// of kSegmentLines lines each, oldest first. Full segments are sealed: they
+// are never modified again, and only the open tail segment takes new lines,
+// so merging a batch never moves or grows what came before it. Queries walk
+// the segments newest first and stop once they have enough matches.
+struct SegmentedIndex {
+    static constexpr std::size_t kSegmentLines = std::size_t{1} << 16;
+
+    std::size_t                               start_idx{};
+    std::vector<std::unique_ptr<const Index>> sealed;  // oldest first
+    Index                                     tail;    // < kSegmentLines lines
+
+    [[nodiscard]] std::size_t size() const {
+        return sealed.size() * kSegmentLines + tail.size();
+    }
+
+    // Sealed segments plus the tail, which may be empty
+    [[nodiscard]] std::size_t segmentCount() const {
+        return sealed.size() + 1;
+    }
+
+    // Segment `i`, oldest first; line j of segment i is line
+    // i * kSegmentLines + j of the index
+    [[nodiscard]] const Index& segment(std::size_t i) const {
+        return i < sealed.size() ? *sealed[i] : tail;
+    }
+
+    // Line `i` (relative to start_idx) as json, like Index::line. Raw and
+    // Offsets lines share one parse cache and read-ahead block across
+    // segments, so memory for them stays fixed however many segments there
+    // are.
+    [[nodiscard]] const json& line(std::size_t i) const {
+        const Index&      seg   = segment(i / kSegmentLines);
+        const std::size_t local = i % kSegmentLines;
+        if (seg.config.storage == LineStorage::Dom) {
+            return seg.lines[local];
+        }
+        if (const json* hit = parsed.get(i)) {
+            return *hit;
+        }
+        return parsed.put(
+            i, json::parse(seg.bytes(local, reader), nullptr, false)
+        );
+    }
+
+    // Move the full tail into `sealed` and open an empty one after it
+    void seal() {
+        const IndexConfig config = tail.config;
+        sealed.push_back(std::make_unique<const Index>(std::move(tail)));
+        tail           = Index();
+        tail.start_idx = start_idx + size();
+        tail.config    = config;
+    }
+
+   private:
+    mutable LruCache<std::size_t, json> parsed{Index::kParsedCacheLines};
+    mutable LineReader                  reader;
+};
+
+// Append the lines of `other` that `index` doesn't have yet to its tail
+// segment, sealing it and opening the next whenever it fills. Same contract as
+// mergeIndex on a single Index.
+bool mergeIndex(SegmentedIndex& index, Index& other, bool throw_on_gap = true) {
+    assert(index.start_idx <= other.start_idx);
+
+    const auto end = index.start_idx + index.size();  // one past the last line
+    if (other.start_idx > end) {
+        if (throw_on_gap) {
+            throw std::runtime_error(fmt::format(
+                "Merging incoming index results in a gap. a_e: {}, b_s: {}",
+                end - 1, other.start_idx
+            ));
+        }
+        return false;
+    }
+
+    for (auto from = end - other.start_idx; from < other.size();) {
+        const auto room = SegmentedIndex::kSegmentLines - index.tail.size();
+        const auto to   = std::min(other.size(), from + room);
+        appendLines(index.tail, other, from, to);
+        if (index.tail.size() == SegmentedIndex::kSegmentLines) {
+            index.seal();
+        }
+        from = to;
+    }
+    return true;
+}
+
 struct Query {
     long              seq = 0;
     std::string       str;
@@ -89,11 +496,95 @@ struct Query {
     [[nodiscard]] Query clone() const {
         return Query{seq, str, exprs, maxMatches};
     }
+
+    // Whether every line matching this query also matches `other`: each of
+    // its exprs is implied by one of ours, as after adding an expr or raising
+    // a `>` bound
+    [[nodiscard]] bool narrows(const Query& other) const {
+        return std::ranges::all_of(other.exprs, [&](const Expr& theirs) {
+            return std::ranges::any_of(exprs, [&](const Expr& ours) {
+                return ours.implies(theirs);
+            });
+        });
+    }
+};
+
+// Lets a running query notice that a newer one was sent. Each query's seq is
+// stored in `latest` as it's sent (see ServiceChannel::latest), and a scan on
+// behalf of the query the service has taken, `seq`, gives up once `latest`
+// passes it.
+struct CancelToken {
+    const std::atomic<long>* latest{};  // nullptr: never cancelled
+    long                     seq{};
+
+    [[nodiscard]] bool cancelled() const {
+        return latest != nullptr &&
+               latest->load(std::memory_order_relaxed) > seq;
+    }
 };
 
 struct StopSignal {};
 
-using Msg = std::variant<Index, Query, StopSignal>;
+// Tells the query service a query is waiting in its ServiceChannel's slot
+struct QueryWaiting {};
+
+// Tells the query service the log was truncated in place and the lines it
+// holds are gone from it; the batches that follow number lines from 0 again
+struct LogTruncated {};
+
+using Msg = std::variant<Index, QueryWaiting, LogTruncated, StopSignal>;
+
+// The query service's inbox, in two lanes. Index batches from the ingestor
+// and the StopSignal queue up in `batches`, bounded so a fast ingestor waits
+// for the service. Queries go in a single slot instead, where each replaces
+// any the service hasn't taken yet: sending one never blocks, and the
+// service takes it before whatever batches are queued.
+class ServiceChannel {
+   public:
+    static constexpr std::size_t kBatchCapacity = 100;
+
+    explicit ServiceChannel(std::size_t batchCapacity = kBatchCapacity)
+        : batches(batchCapacity) {}
+
+    folly::MPMCQueue<Msg> batches;
+
+    // Leave `query` for the service in place of any it hasn't taken. Wakes
+    // the service through `batches` if it isn't already being woken; when
+    // they're full it's busy with them, and looks in the slot between them.
+    void sendQuery(Query&& query) {
+        latest_.store(query.seq);
+        {
+            std::lock_guard lock(mutex_);
+            query_ = std::move(query);
+        }
+        if (!woken_.exchange(true) && !batches.write(QueryWaiting{})) {
+            woken_.store(false);
+        }
+    }
+
+    // The query waiting in the slot, if any, leaving it empty
+    std::optional<Query> takeQuery() {
+        woken_.store(false);  // before taking, so a later send wakes again
+        std::lock_guard lock(mutex_);
+        return std::exchange(query_, std::nullopt);
+    }
+
+    [[nodiscard]] bool queryWaiting() const {
+        std::lock_guard lock(mutex_);
+        return query_.has_value();
+    }
+
+    // seq of the newest query sent, for CancelToken
+    [[nodiscard]] const std::atomic<long>& latest() const {
+        return latest_;
+    }
+
+   private:
+    mutable std::mutex   mutex_;  // guards query_
+    std::optional<Query> query_;
+    std::atomic<long>    latest_{0};
+    std::atomic<bool>    woken_{false};  // a QueryWaiting is on its way
+};
 
 struct QueryResult {
     Query query;
@@ -21,9 +21,11 @@
 
 #include "types.h"
 
+// Queries go to the query service's latest-wins slot, so typing never waits
+// on the service and it can drop a scan a newer keystroke has made stale
 void ui(
     ftxui::ScreenInteractive&         screen,
-    folly::MPMCQueue<Msg>&            queryService,
+    ServiceChannel&                   queryService,
     folly::Synchronized<QueryResult>& queryResult
 ) {
     using namespace ftxui;
@@ -34,7 +36,7 @@ void ui(
     auto tryParseAndEvaluate = [&](std::string&& qs) {
         int maxMatches = screen.dimy() - 3;
         if (auto query = Query::parse(qs, seq++, maxMatches)) {
-            queryService.blockingWrite(std::move(*query));
+            queryService.sendQuery(std::move(*query));
         }
     };
 
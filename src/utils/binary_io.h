@@ -0,0 +1,104 @@
+#pragma once
+
+#define DOCTEST_CONFIG_NO_SHORT_MACRO_NAMES
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "doctest.h"
+
+// Native-endian binary encoding of trivially copyable values into a byte
+// string, and decoding from the front of a string_view. Used for files that
+// are only read back on the machine that wrote them.
+namespace binary_io {
+
+template <typename T>
+concept Pod = std::is_trivially_copyable_v<T>;
+
+template <Pod T>
+void put(std::string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Element count (as u64), then the elements
+template <Pod T>
+void putSpan(std::string& out, std::span<const T> values) {
+    put<std::uint64_t>(out, values.size());
+    if (!values.empty()) {  // an empty span's data() may be null
+        out.append(
+            reinterpret_cast<const char*>(values.data()), values.size_bytes()
+        );
+    }
+}
+
+inline void putString(std::string& out, std::string_view str) {
+    putSpan(out, std::span<const char>(str.data(), str.size()));
+}
+
+// Take `n` bytes off the front of `in`, throwing if it's shorter than that
+inline std::string_view take(std::string_view& in, std::size_t n) {
+    if (in.size() < n) {
+        throw std::runtime_error("binary_io: unexpected end of input");
+    }
+    const auto bytes = in.substr(0, n);
+    in.remove_prefix(n);
+    return bytes;
+}
+
+template <Pod T>
+T get(std::string_view& in) {
+    T value;
+    std::memcpy(&value, take(in, sizeof(T)).data(), sizeof(T));
+    return value;
+}
+
+template <Pod T>
+std::vector<T> getVector(std::string_view& in) {
+    const auto n = get<std::uint64_t>(in);
+    if (n > in.size() / sizeof(T)) {
+        throw std::runtime_error("binary_io: unexpected end of input");
+    }
+    std::vector<T> values(n);
+    if (n != 0) {  // memcpy from or to null is undefined even for 0 bytes
+        std::memcpy(
+            values.data(), take(in, n * sizeof(T)).data(), n * sizeof(T)
+        );
+    }
+    return values;
+}
+
+// The string's bytes, viewed in place
+inline std::string_view getString(std::string_view& in) {
+    return take(in, get<std::uint64_t>(in));
+}
+
+}  // namespace binary_io
+
+TEST_CASE("binary_io round-trips values") {
+    std::string out;
+    binary_io::put<std::uint32_t>(out, 7);
+    binary_io::putSpan(out, std::span<const double>(std::vector{1.5, -2.0}));
+    binary_io::putString(out, "key");
+    binary_io::putSpan(out, std::span<const double>());
+    binary_io::put<std::uint8_t>(out, 1);
+
+    std::string_view in = out;
+    CHECK(binary_io::get<std::uint32_t>(in) == 7);
+    CHECK(binary_io::getVector<double>(in) == std::vector{1.5, -2.0});
+    CHECK(binary_io::getString(in) == "key");
+    CHECK(binary_io::getVector<double>(in).empty());
+    CHECK(binary_io::get<std::uint8_t>(in) == 1);
+    CHECK(in.empty());
+    CHECK_THROWS_AS(binary_io::get<std::uint8_t>(in), std::runtime_error);
+
+    // a length running past the end throws rather than over-reading
+    std::string      bad;
+    binary_io::put<std::uint64_t>(bad, 1000);
+    std::string_view badIn = bad;
+    CHECK_THROWS_AS(binary_io::getVector<double>(badIn), std::runtime_error);
+}
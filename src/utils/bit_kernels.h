@@ -0,0 +1,479 @@
+#pragma once
+
+#define DOCTEST_CONFIG_NO_SHORT_MACRO_NAMES
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BIT_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+#include "doctest.h"
+
+// Bulk operations over arrays of 64-bit words, the inner loops of BitSet's
+// bitmap containers. Each has a portable scalar version plus AVX2 and AVX-512
+// versions compiled with function-level target attributes, so the binary
+// still runs anywhere; the widest level the CPU supports is picked once at
+// startup.
+namespace bit_kernels {
+
+enum class Level : std::uint8_t {
+    Scalar,
+    Avx2,
+    Avx512
+};
+
+// out[i] = a[i] op b[i] for i < n; `out` may alias `a` or `b`
+using WordOp = void (*)(
+    std::uint64_t* out, const std::uint64_t* a, const std::uint64_t* b,
+    std::size_t n
+);
+
+struct Kernels {
+    Level       level;
+    WordOp      andWords;
+    WordOp      orWords;
+    WordOp      xorWords;
+    WordOp      andNotWords;  // a & ~b
+    // set bits in words[0, n)
+    std::size_t (*popcount)(const std::uint64_t* words, std::size_t n);
+    // runs of consecutive set bits in words[0, n), bit 0 of words[0] first
+    std::size_t (*countRuns)(const std::uint64_t* words, std::size_t n);
+    // out = srcs[0] & ... & srcs[count - 1] over n words in a single pass,
+    // returning the set bits in out; count >= 1
+    std::size_t (*andMany)(
+        std::uint64_t* out, const std::uint64_t* const* srcs,
+        std::size_t count, std::size_t n
+    );
+};
+
+enum class Op : std::uint8_t {
+    And,
+    Or,
+    Xor,
+    AndNot
+};
+
+template <Op op>
+constexpr std::uint64_t apply(std::uint64_t x, std::uint64_t y) {
+    if constexpr (op == Op::And) {
+        return x & y;
+    } else if constexpr (op == Op::Or) {
+        return x | y;
+    } else if constexpr (op == Op::Xor) {
+        return x ^ y;
+    } else {
+        return x & ~y;
+    }
+}
+
+// Run starts in `word`, given the last bit of the word before it
+constexpr std::uint64_t runStarts(std::uint64_t word, std::uint64_t prev) {
+    return word & ~(word << 1 | prev >> 63);
+}
+
+template <Op op>
+void wordsScalar(
+    std::uint64_t* out, const std::uint64_t* a, const std::uint64_t* b,
+    std::size_t n
+) {
+    for (std::size_t i = 0; i < n; ++i) {
+        out[i] = apply<op>(a[i], b[i]);
+    }
+}
+
+std::size_t popcountScalar(const std::uint64_t* words, std::size_t n) {
+    std::size_t bits = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        bits += std::popcount(words[i]);
+    }
+    return bits;
+}
+
+std::size_t countRunsScalar(const std::uint64_t* words, std::size_t n) {
+    std::size_t   runs = 0;
+    std::uint64_t prev = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        runs += std::popcount(runStarts(words[i], prev));
+        prev = words[i];
+    }
+    return runs;
+}
+
+std::size_t andManyScalar(
+    std::uint64_t* out, const std::uint64_t* const* srcs, std::size_t count,
+    std::size_t n
+) {
+    std::size_t bits = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        std::uint64_t word = srcs[0][i];
+        for (std::size_t k = 1; k < count; ++k) {
+            word &= srcs[k][i];
+        }
+        out[i] = word;
+        bits += std::popcount(word);
+    }
+    return bits;
+}
+
+#if defined(BIT_KERNELS_X86)
+
+#define BIT_KERNELS_AVX2   __attribute__((target("avx2")))
+#define BIT_KERNELS_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+template <Op op>
+BIT_KERNELS_AVX2 __m256i apply256(__m256i x, __m256i y) {
+    if constexpr (op == Op::And) {
+        return _mm256_and_si256(x, y);
+    } else if constexpr (op == Op::Or) {
+        return _mm256_or_si256(x, y);
+    } else if constexpr (op == Op::Xor) {
+        return _mm256_xor_si256(x, y);
+    } else {
+        return _mm256_andnot_si256(y, x);
+    }
+}
+
+// Per-64-bit-lane popcount, by looking up each nibble with a byte shuffle
+BIT_KERNELS_AVX2 __m256i popcount256(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3,
+        1, 2, 2, 3, 2, 3, 3, 4
+    );
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i lo     = _mm256_and_si256(v, nibble);
+    const __m256i hi     = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    const __m256i bytes  = _mm256_add_epi8(
+        _mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi)
+    );
+    return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
+
+BIT_KERNELS_AVX2 std::size_t sum256(__m256i v) {
+    const __m128i pair = _mm_add_epi64(
+        _mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)
+    );
+    return static_cast<std::size_t>(
+        _mm_cvtsi128_si64(pair) + _mm_extract_epi64(pair, 1)
+    );
+}
+
+BIT_KERNELS_AVX2 __m256i load256(const std::uint64_t* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+template <Op op>
+BIT_KERNELS_AVX2 void wordsAvx2(
+    std::uint64_t* out, const std::uint64_t* a, const std::uint64_t* b,
+    std::size_t n
+) {
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i*>(out + i),
+            apply256<op>(load256(a + i), load256(b + i))
+        );
+    }
+    wordsScalar<op>(out + i, a + i, b + i, n - i);
+}
+
+BIT_KERNELS_AVX2 std::size_t
+popcountAvx2(const std::uint64_t* words, std::size_t n) {
+    __m256i     total = _mm256_setzero_si256();
+    std::size_t i     = 0;
+    for (; i + 4 <= n; i += 4) {
+        total = _mm256_add_epi64(total, popcount256(load256(words + i)));
+    }
+    return sum256(total) + popcountScalar(words + i, n - i);
+}
+
+BIT_KERNELS_AVX2 std::size_t
+countRunsAvx2(const std::uint64_t* words, std::size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    // the word before each lane comes from a load one word back
+    std::size_t runs  = std::popcount(runStarts(words[0], 0));
+    __m256i     total = _mm256_setzero_si256();
+    std::size_t i     = 1;
+    for (; i + 4 <= n; i += 4) {
+        const __m256i cur    = load256(words + i);
+        const __m256i prev   = load256(words + i - 1);
+        const __m256i starts = _mm256_andnot_si256(
+            _mm256_or_si256(
+                _mm256_slli_epi64(cur, 1), _mm256_srli_epi64(prev, 63)
+            ),
+            cur
+        );
+        total = _mm256_add_epi64(total, popcount256(starts));
+    }
+    runs += sum256(total);
+    for (; i < n; ++i) {
+        runs += std::popcount(runStarts(words[i], words[i - 1]));
+    }
+    return runs;
+}
+
+BIT_KERNELS_AVX2 std::size_t andManyAvx2(
+    std::uint64_t* out, const std::uint64_t* const* srcs, std::size_t count,
+    std::size_t n
+) {
+    __m256i     total = _mm256_setzero_si256();
+    std::size_t i     = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = load256(srcs[0] + i);
+        for (std::size_t k = 1; k < count; ++k) {
+            v = _mm256_and_si256(v, load256(srcs[k] + i));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), v);
+        total = _mm256_add_epi64(total, popcount256(v));
+    }
+    std::size_t bits = sum256(total);
+    for (; i < n; ++i) {
+        std::uint64_t word = srcs[0][i];
+        for (std::size_t k = 1; k < count; ++k) {
+            word &= srcs[k][i];
+        }
+        out[i] = word;
+        bits += std::popcount(word);
+    }
+    return bits;
+}
+
+template <Op op>
+BIT_KERNELS_AVX512 __m512i apply512(__m512i x, __m512i y) {
+    if constexpr (op == Op::And) {
+        return _mm512_and_si512(x, y);
+    } else if constexpr (op == Op::Or) {
+        return _mm512_or_si512(x, y);
+    } else if constexpr (op == Op::Xor) {
+        return _mm512_xor_si512(x, y);
+    } else {
+        return _mm512_andnot_si512(y, x);
+    }
+}
+
+// Per-64-bit-lane popcount, as popcount256; the byte shuffle needs AVX512BW
+BIT_KERNELS_AVX512 __m512i popcount512(__m512i v) {
+    const __m512i lookup = _mm512_set4_epi32(
+        0x04030302, 0x03020201, 0x03020201, 0x02010100
+    );
+    const __m512i nibble = _mm512_set1_epi8(0x0f);
+    const __m512i lo     = _mm512_and_si512(v, nibble);
+    const __m512i hi     = _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble);
+    const __m512i bytes  = _mm512_add_epi8(
+        _mm512_shuffle_epi8(lookup, lo), _mm512_shuffle_epi8(lookup, hi)
+    );
+    return _mm512_sad_epu8(bytes, _mm512_setzero_si512());
+}
+
+BIT_KERNELS_AVX512 __m512i load512(const std::uint64_t* p) {
+    return _mm512_loadu_si512(p);
+}
+
+template <Op op>
+BIT_KERNELS_AVX512 void wordsAvx512(
+    std::uint64_t* out, const std::uint64_t* a, const std::uint64_t* b,
+    std::size_t n
+) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_si512(
+            out + i, apply512<op>(load512(a + i), load512(b + i))
+        );
+    }
+    wordsScalar<op>(out + i, a + i, b + i, n - i);
+}
+
+BIT_KERNELS_AVX512 std::size_t
+popcountAvx512(const std::uint64_t* words, std::size_t n) {
+    __m512i     total = _mm512_setzero_si512();
+    std::size_t i     = 0;
+    for (; i + 8 <= n; i += 8) {
+        total = _mm512_add_epi64(total, popcount512(load512(words + i)));
+    }
+    return _mm512_reduce_add_epi64(total) + popcountScalar(words + i, n - i);
+}
+
+BIT_KERNELS_AVX512 std::size_t
+countRunsAvx512(const std::uint64_t* words, std::size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    std::size_t runs  = std::popcount(runStarts(words[0], 0));
+    __m512i     total = _mm512_setzero_si512();
+    std::size_t i     = 1;
+    for (; i + 8 <= n; i += 8) {
+        const __m512i cur    = load512(words + i);
+        const __m512i prev   = load512(words + i - 1);
+        const __m512i starts = _mm512_andnot_si512(
+            _mm512_or_si512(
+                _mm512_slli_epi64(cur, 1), _mm512_srli_epi64(prev, 63)
+            ),
+            cur
+        );
+        total = _mm512_add_epi64(total, popcount512(starts));
+    }
+    runs += _mm512_reduce_add_epi64(total);
+    for (; i < n; ++i) {
+        runs += std::popcount(runStarts(words[i], words[i - 1]));
+    }
+    return runs;
+}
+
+BIT_KERNELS_AVX512 std::size_t andManyAvx512(
+    std::uint64_t* out, const std::uint64_t* const* srcs, std::size_t count,
+    std::size_t n
+) {
+    __m512i     total = _mm512_setzero_si512();
+    std::size_t i     = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i v = load512(srcs[0] + i);
+        for (std::size_t k = 1; k < count; ++k) {
+            v = _mm512_and_si512(v, load512(srcs[k] + i));
+        }
+        _mm512_storeu_si512(out + i, v);
+        total = _mm512_add_epi64(total, popcount512(v));
+    }
+    std::size_t bits = _mm512_reduce_add_epi64(total);
+    for (; i < n; ++i) {
+        std::uint64_t word = srcs[0][i];
+        for (std::size_t k = 1; k < count; ++k) {
+            word &= srcs[k][i];
+        }
+        out[i] = word;
+        bits += std::popcount(word);
+    }
+    return bits;
+}
+
+#undef BIT_KERNELS_AVX2
+#undef BIT_KERNELS_AVX512
+
+#endif  // BIT_KERNELS_X86
+
+// Widest level this CPU (and OS) can run
+Level supported() {
+#if defined(BIT_KERNELS_X86)
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw")) {
+        return Level::Avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return Level::Avx2;
+    }
+#endif
+    return Level::Scalar;
+}
+
+// Kernels for `level`, or the widest supported level below it
+const Kernels& forLevel(Level level) {
+    static const Kernels scalar{
+        Level::Scalar,         wordsScalar<Op::And>,
+        wordsScalar<Op::Or>,   wordsScalar<Op::Xor>,
+        wordsScalar<Op::AndNot>, popcountScalar,
+        countRunsScalar,       andManyScalar
+    };
+#if defined(BIT_KERNELS_X86)
+    static const Kernels avx2{
+        Level::Avx2,         wordsAvx2<Op::And>,
+        wordsAvx2<Op::Or>,   wordsAvx2<Op::Xor>,
+        wordsAvx2<Op::AndNot>, popcountAvx2,
+        countRunsAvx2,       andManyAvx2
+    };
+    static const Kernels avx512{
+        Level::Avx512,         wordsAvx512<Op::And>,
+        wordsAvx512<Op::Or>,   wordsAvx512<Op::Xor>,
+        wordsAvx512<Op::AndNot>, popcountAvx512,
+        countRunsAvx512,       andManyAvx512
+    };
+    level = std::min(level, supported());
+    if (level == Level::Avx512) {
+        return avx512;
+    }
+    if (level == Level::Avx2) {
+        return avx2;
+    }
+#endif
+    return scalar;
+}
+
+const Kernels*& activeSlot() {
+    static const Kernels* kernels = &forLevel(supported());
+    return kernels;
+}
+
+// Kernels BitSet uses, the widest supported level unless overridden
+const Kernels& active() {
+    return *activeSlot();
+}
+
+// Use `level` (capped at what the CPU supports) from now on; for tests and
+// benchmarks comparing levels. Not thread safe.
+void setLevel(Level level) {
+    activeSlot() = &forLevel(level);
+}
+
+}  // namespace bit_kernels
+
+TEST_CASE("bit_kernels levels agree with the scalar kernels") {
+    using namespace bit_kernels;
+    std::uint64_t state = 5;
+    auto          rand  = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    const Kernels& scalar = forLevel(Level::Scalar);
+    for (auto level : {Level::Avx2, Level::Avx512}) {
+        const Kernels& k = forLevel(level);
+        CAPTURE(static_cast<int>(k.level));
+        // lengths around the vector widths, and a 64K-bit container
+        for (std::size_t n : {0, 1, 3, 4, 7, 8, 9, 17, 1024}) {
+            CAPTURE(n);
+            std::vector<std::uint64_t> a(n);
+            std::vector<std::uint64_t> b(n);
+            std::vector<std::uint64_t> c(n);
+            for (std::size_t i = 0; i < n; ++i) {
+                // dense, sparse, all-ones and empty words
+                a[i] = i % 5 == 0 ? ~std::uint64_t{0} : rand();
+                b[i] = i % 7 == 0 ? 0 : rand() & rand();
+                c[i] = rand() | rand();
+            }
+            for (auto op : {&Kernels::andWords, &Kernels::orWords,
+                            &Kernels::xorWords, &Kernels::andNotWords}) {
+                std::vector<std::uint64_t> want(n);
+                std::vector<std::uint64_t> got(n);
+                (scalar.*op)(want.data(), a.data(), b.data(), n);
+                (k.*op)(got.data(), a.data(), b.data(), n);
+                CHECK(got == want);
+                // in place, as the containers use them
+                got = a;
+                (k.*op)(got.data(), got.data(), b.data(), n);
+                CHECK(got == want);
+            }
+            CHECK(k.popcount(a.data(), n) == scalar.popcount(a.data(), n));
+            CHECK(k.countRuns(a.data(), n) == scalar.countRuns(a.data(), n));
+            CHECK(k.countRuns(b.data(), n) == scalar.countRuns(b.data(), n));
+
+            const std::uint64_t* srcs[] = {a.data(), b.data(), c.data()};
+            for (std::size_t count = 1; count <= 3; ++count) {
+                std::vector<std::uint64_t> want(n);
+                std::vector<std::uint64_t> got(n);
+                const auto                 wantBits =
+                    scalar.andMany(want.data(), srcs, count, n);
+                CHECK(k.andMany(got.data(), srcs, count, n) == wantBits);
+                CHECK(got == want);
+            }
+        }
+    }
+    // a run crossing word boundaries counts once
+    const std::uint64_t words[] = {0, ~std::uint64_t{0} << 60, 0xff, 0, 0, 1};
+    CHECK(scalar.countRuns(words, 6) == 2);
+    CHECK(forLevel(Level::Avx512).countRuns(words, 6) == 2);
+}
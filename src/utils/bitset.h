@@ -4,110 +4,1323 @@
 #include <fmt/core.h>
 #include <fmt/format.h>
 
-#include <boost/dynamic_bitset.hpp>
-#include <boost/dynamic_bitset/dynamic_bitset.hpp>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <concepts>
+#include <cstdint>
+#include <iterator>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include "doctest.h"
+#include "utils/binary_io.h"
+#include "utils/bit_kernels.h"
+
+// A lazy bitset expression, built by `&`, `|`, `^` and `~` on BitSets (see
+// BitAnd and friends after BitSet). Chunk keys are 64K-bit chunk numbers;
+// `evalChunk` returns the chunk's words, which may be written to `scratch`,
+// or nullptr when it has no set bits.
+template <typename E>
+concept BitExpression =
+    requires(const E& e, std::size_t key, std::uint64_t* scratch) {
+        { e.size() } -> std::convertible_to<std::size_t>;
+        { e.nextChunk(key) } -> std::convertible_to<std::size_t>;
+        { e.prevChunk(key) } -> std::convertible_to<std::size_t>;
+        {
+            e.evalChunk(key, scratch)
+        } -> std::convertible_to<const std::uint64_t*>;
+    };
 
+// Compressed bitmap in the style of Roaring. Bit indices are split into a high
+// 16-bit chunk key and a low 16-bit offset; each non-empty 64K-bit chunk is
+// held in whichever container is smallest for its contents:
+//   - Array:  sorted offsets, for up to 4096 set bits
+//   - Bitmap: 1024 64-bit words
+//   - Run:    sorted [start, last] intervals, for long stretches of ones
+// Empty chunks take no space, so a key seen on a handful of lines costs a few
+// bytes rather than a bit per line.
+//
+// `size()` is the logical length (one past the highest bit written) and
+// `capacity()` a logical growth hint kept for API compatibility; neither is
+// backed by memory. Indices must be below `kMaxBits` (2^32, since chunk keys
+// are 16 bits); growing past it throws std::length_error.
 class BitSet {
+   public:
+    static constexpr std::size_t kChunkBits = std::size_t{1} << 16;
+    static constexpr std::size_t kMaxBits   = kChunkBits << 16;
+    static constexpr std::size_t npos       = static_cast<std::size_t>(-1);
+
    private:
-    boost::dynamic_bitset<> bitset_;
-    std::size_t             m_size{};
+    struct Run {
+        std::uint16_t start;
+        std::uint16_t last;  // inclusive
+
+        bool operator==(const Run&) const = default;
+    };
+
+    struct Container {
+        enum class Kind : std::uint8_t {
+            Array,
+            Bitmap,
+            Run
+        };
+        static constexpr std::size_t kMaxArray = 4096;
+        static constexpr std::size_t kWords    = kChunkBits / 64;
+
+        Kind                       kind = Kind::Array;
+        std::uint32_t              card = 0;
+        std::vector<std::uint16_t> array;  // Kind::Array
+        std::vector<std::uint64_t> words;  // Kind::Bitmap
+        std::vector<Run>           runs;   // Kind::Run
+
+        static Container fullRange(std::uint32_t length) {
+            Container c;
+            c.kind = Kind::Run;
+            c.card = length;
+            c.runs.push_back({0, static_cast<std::uint16_t>(length - 1)});
+            return c;
+        }
+
+        static Container fromWords(std::vector<std::uint64_t> w) {
+            Container c;
+            c.kind  = Kind::Bitmap;
+            c.words = std::move(w);
+            c.settleWords();
+            return c;
+        }
+
+        // Recount a Bitmap after its words changed and settle it into its
+        // smallest form, counting bits and runs in one pass
+        void settleWords() {
+            const auto& k = bit_kernels::active();
+            card = static_cast<std::uint32_t>(k.popcount(words.data(), kWords));
+            settle(k.countRuns(words.data(), kWords));
+        }
+
+        [[nodiscard]] bool empty() const {
+            return card == 0;
+        }
+
+        // Call `f(std::uint16_t)` for each set offset, ascending
+        template <typename F>
+        void forEach(F&& f) const {
+            switch (kind) {
+                case Kind::Array:
+                    for (auto v : array) {
+                        f(v);
+                    }
+                    break;
+                case Kind::Bitmap:
+                    for (std::size_t w = 0; w < words.size(); ++w) {
+                        for (auto word = words[w]; word != 0;
+                             word &= word - 1) {
+                            f(static_cast<std::uint16_t>(
+                                w * 64 + std::countr_zero(word)
+                            ));
+                        }
+                    }
+                    break;
+                case Kind::Run:
+                    for (auto run : runs) {
+                        for (std::uint32_t v = run.start; v <= run.last; ++v) {
+                            f(static_cast<std::uint16_t>(v));
+                        }
+                    }
+                    break;
+            }
+        }
+
+        [[nodiscard]] std::vector<std::uint64_t> bitmapWords() const {
+            if (kind == Kind::Bitmap) {
+                return words;
+            }
+            std::vector<std::uint64_t> w(kWords);
+            writeWords(w.data());
+            return w;
+        }
+
+        // Write the chunk as kWords words to `out`
+        void writeWords(std::uint64_t* out) const {
+            if (kind == Kind::Bitmap) {
+                std::copy(words.begin(), words.end(), out);
+                return;
+            }
+            std::fill_n(out, kWords, 0);
+            if (kind == Kind::Run) {
+                for (auto run : runs) {
+                    setRange(out, run.start, run.last + 1U);
+                }
+            } else {
+                for (auto v : array) {
+                    out[v / 64] |= std::uint64_t{1} << (v % 64);
+                }
+            }
+        }
+
+        // Set bits [begin, end) of `w`
+        static void
+        setRange(std::uint64_t* w, std::uint32_t begin, std::uint32_t end) {
+            for (auto v = begin; v < end;) {
+                if (v % 64 == 0 && end - v >= 64) {
+                    w[v / 64] = ~std::uint64_t{0};
+                    v += 64;
+                } else {
+                    w[v / 64] |= std::uint64_t{1} << (v % 64);
+                    ++v;
+                }
+            }
+        }
+
+        [[nodiscard]] bool contains(std::uint16_t v) const {
+            switch (kind) {
+                case Kind::Array:
+                    return std::binary_search(array.begin(), array.end(), v);
+                case Kind::Bitmap:
+                    return ((words[v / 64] >> (v % 64)) & 1U) != 0;
+                case Kind::Run: {
+                    auto it = std::upper_bound(
+                        runs.begin(), runs.end(), v,
+                        [](std::uint16_t x, Run r) { return x < r.start; }
+                    );
+                    return it != runs.begin() && v <= std::prev(it)->last;
+                }
+            }
+            return false;
+        }
+
+        void add(std::uint16_t v) {
+            switch (kind) {
+                case Kind::Array: {
+                    if (array.empty() || v > array.back()) {
+                        array.push_back(v);
+                    } else {
+                        auto it =
+                            std::lower_bound(array.begin(), array.end(), v);
+                        if (*it == v) {
+                            return;
+                        }
+                        array.insert(it, v);
+                    }
+                    ++card;
+                    if (card > kMaxArray) {
+                        convert(Kind::Bitmap);
+                    }
+                    return;
+                }
+                case Kind::Bitmap: {
+                    auto& word = words[v / 64];
+                    auto  bit  = std::uint64_t{1} << (v % 64);
+                    card += (word & bit) == 0 ? 1 : 0;
+                    word |= bit;
+                    return;
+                }
+                case Kind::Run: {
+                    // appending just past the last run is the common case
+                    if (runs.empty() || v > runs.back().last + 1U) {
+                        runs.push_back({v, v});
+                    } else if (v == runs.back().last + 1U) {
+                        runs.back().last = v;
+                    } else if (contains(v)) {
+                        return;
+                    } else {
+                        convert(Kind::Bitmap);
+                        add(v);
+                        return;
+                    }
+                    ++card;
+                    return;
+                }
+            }
+        }
+
+        void remove(std::uint16_t v) {
+            if (!contains(v)) {
+                return;
+            }
+            if (kind == Kind::Array) {
+                array.erase(std::lower_bound(array.begin(), array.end(), v));
+                --card;
+                return;
+            }
+            convert(Kind::Bitmap);
+            words[v / 64] &= ~(std::uint64_t{1} << (v % 64));
+            --card;
+            normalize();
+        }
+
+        // Bits [0, bit] of a word
+        static constexpr std::uint64_t lowMask(std::uint32_t bit) {
+            return ~std::uint64_t{0} >> (63 - bit);
+        }
+
+        // Smallest set offset >= `from`, or -1. Bitmaps are scanned a word at
+        // a time, jumping to the next set bit with count-trailing-zeros.
+        [[nodiscard]] std::int32_t next(std::uint32_t from) const {
+            switch (kind) {
+                case Kind::Array: {
+                    auto it =
+                        std::lower_bound(array.begin(), array.end(), from);
+                    return it == array.end() ? -1 : *it;
+                }
+                case Kind::Bitmap: {
+                    if (from >= kChunkBits) {
+                        return -1;
+                    }
+                    auto w    = from / 64;
+                    auto word = words[w] & (~std::uint64_t{0} << (from % 64));
+                    while (word == 0) {
+                        if (++w == kWords) {
+                            return -1;
+                        }
+                        word = words[w];
+                    }
+                    return static_cast<std::int32_t>(
+                        w * 64 + std::countr_zero(word)
+                    );
+                }
+                case Kind::Run: {
+                    auto it = std::lower_bound(
+                        runs.begin(), runs.end(), from,
+                        [](Run r, std::uint32_t v) { return r.last < v; }
+                    );
+                    return it == runs.end()
+                               ? -1
+                               : std::max<std::int32_t>(it->start, from);
+                }
+            }
+            return -1;
+        }
+
+        // Largest set offset <= `from`, or -1. Bitmaps are scanned a word at
+        // a time with count-leading-zeros.
+        [[nodiscard]] std::int32_t prev(std::uint32_t from) const {
+            switch (kind) {
+                case Kind::Array: {
+                    auto it =
+                        std::upper_bound(array.begin(), array.end(), from);
+                    return it == array.begin() ? -1 : *std::prev(it);
+                }
+                case Kind::Bitmap: {
+                    from      = std::min<std::uint32_t>(from, kChunkBits - 1);
+                    auto w    = from / 64;
+                    auto word = words[w] & lowMask(from % 64);
+                    while (word == 0) {
+                        if (w-- == 0) {
+                            return -1;
+                        }
+                        word = words[w];
+                    }
+                    return static_cast<std::int32_t>(
+                        w * 64 + 63 - std::countl_zero(word)
+                    );
+                }
+                case Kind::Run: {
+                    auto it = std::upper_bound(
+                        runs.begin(), runs.end(), from,
+                        [](std::uint32_t v, Run r) { return v < r.start; }
+                    );
+                    return it == runs.begin()
+                               ? -1
+                               : std::min<std::int32_t>(
+                                     std::prev(it)->last, from
+                                 );
+                }
+            }
+            return -1;
+        }
+
+        // Write up to `n` set offsets >= `from`, ascending and shifted by
+        // `base`, to `out`; returns how many were written
+        std::size_t collectNext(
+            std::uint32_t from, std::size_t base, std::size_t* out,
+            std::size_t n
+        ) const {
+            std::size_t got = 0;
+            switch (kind) {
+                case Kind::Array: {
+                    auto it =
+                        std::lower_bound(array.begin(), array.end(), from);
+                    for (; it != array.end() && got < n; ++it) {
+                        out[got++] = base + *it;
+                    }
+                    break;
+                }
+                case Kind::Bitmap: {
+                    auto w    = from / 64;
+                    auto word = words[w] & (~std::uint64_t{0} << (from % 64));
+                    while (got < n) {
+                        if (word == 0) {
+                            if (++w == kWords) {
+                                break;
+                            }
+                            word = words[w];
+                            continue;
+                        }
+                        out[got++] = base + w * 64 + std::countr_zero(word);
+                        word &= word - 1;  // clear the lowest set bit
+                    }
+                    break;
+                }
+                case Kind::Run: {
+                    auto it = std::lower_bound(
+                        runs.begin(), runs.end(), from,
+                        [](Run r, std::uint32_t v) { return r.last < v; }
+                    );
+                    for (; it != runs.end() && got < n; ++it) {
+                        for (std::uint32_t v = std::max<std::uint32_t>(
+                                 it->start, from
+                             );
+                             v <= it->last && got < n; ++v) {
+                            out[got++] = base + v;
+                        }
+                    }
+                    break;
+                }
+            }
+            return got;
+        }
+
+        // Like collectNext, descending from offset `from`
+        std::size_t collectPrev(
+            std::uint32_t from, std::size_t base, std::size_t* out,
+            std::size_t n
+        ) const {
+            std::size_t got = 0;
+            switch (kind) {
+                case Kind::Array: {
+                    auto it =
+                        std::upper_bound(array.begin(), array.end(), from);
+                    while (it != array.begin() && got < n) {
+                        out[got++] = base + *--it;
+                    }
+                    break;
+                }
+                case Kind::Bitmap: {
+                    auto w    = from / 64;
+                    auto word = words[w] & lowMask(from % 64);
+                    while (got < n) {
+                        if (word == 0) {
+                            if (w-- == 0) {
+                                break;
+                            }
+                            word = words[w];
+                            continue;
+                        }
+                        const auto bit = 63 - std::countl_zero(word);
+                        out[got++]     = base + w * 64 + bit;
+                        word &= ~(std::uint64_t{1} << bit);
+                    }
+                    break;
+                }
+                case Kind::Run: {
+                    auto it = std::upper_bound(
+                        runs.begin(), runs.end(), from,
+                        [](std::uint32_t v, Run r) { return v < r.start; }
+                    );
+                    while (it != runs.begin() && got < n) {
+                        --it;
+                        for (std::int64_t v = std::min<std::uint32_t>(
+                                 it->last, from
+                             );
+                             v >= it->start && got < n; --v) {
+                            out[got++] = base + v;
+                        }
+                    }
+                    break;
+                }
+            }
+            return got;
+        }
+
+        [[nodiscard]] std::size_t runCount() const {
+            switch (kind) {
+                case Kind::Array: {
+                    std::size_t n = 0;
+                    for (std::size_t i = 0; i < array.size(); ++i) {
+                        n += i == 0 || array[i] != array[i - 1] + 1 ? 1 : 0;
+                    }
+                    return n;
+                }
+                case Kind::Bitmap:
+                    return bit_kernels::active().countRuns(
+                        words.data(), kWords
+                    );
+                case Kind::Run:
+                    return runs.size();
+            }
+            return 0;
+        }
+
+        // Switch to whichever container takes the fewest bytes
+        void normalize() {
+            settle(runCount());
+        }
+
+        void settle(std::size_t runCount) {
+            const std::size_t runBytes   = runCount * sizeof(Run);
+            const std::size_t arrayBytes = card <= kMaxArray
+                                             ? card * sizeof(std::uint16_t)
+                                             : kWords * sizeof(std::uint64_t);
+            if (runBytes < arrayBytes) {
+                convert(Kind::Run);
+            } else if (card <= kMaxArray) {
+                convert(Kind::Array);
+            } else {
+                convert(Kind::Bitmap);
+            }
+        }
+
+        void convert(Kind to) {
+            if (kind == to) {
+                return;
+            }
+            Container c;
+            c.kind = to;
+            c.card = card;
+            switch (to) {
+                case Kind::Array:
+                    c.array.reserve(card);
+                    forEach([&](std::uint16_t v) { c.array.push_back(v); });
+                    break;
+                case Kind::Bitmap:
+                    c.words = bitmapWords();
+                    break;
+                case Kind::Run:
+                    forEach([&](std::uint16_t v) {
+                        if (!c.runs.empty() && v == c.runs.back().last + 1U) {
+                            c.runs.back().last = v;
+                        } else {
+                            c.runs.push_back({v, v});
+                        }
+                    });
+                    break;
+            }
+            *this = std::move(c);
+        }
+
+        [[nodiscard]] std::size_t memoryUsage() const {
+            return array.capacity() * sizeof(std::uint16_t) +
+                   words.capacity() * sizeof(std::uint64_t) +
+                   runs.capacity() * sizeof(Run);
+        }
+
+        [[nodiscard]] bool isFull() const {
+            return card == kChunkBits;
+        }
+
+        bool operator==(const Container& other) const {
+            if (card != other.card) {
+                return false;
+            }
+            if (kind == other.kind) {
+                return array == other.array && words == other.words &&
+                       runs == other.runs;
+            }
+            return bitmapWords() == other.bitmapWords();
+        }
+
+        // *this |= b
+        void unionWith(const Container& b) {
+            if (empty()) {
+                *this = b;
+            } else if (!b.empty()) {
+                *this = combineWords(*this, b, bit_kernels::active().orWords);
+            }
+        }
+
+        // Set offsets [start, last]
+        void addRange(std::uint16_t start, std::uint16_t last) {
+            if (empty()) {
+                *this = fullRange(last - start + 1U);
+                runs.front() = {start, last};
+                return;
+            }
+            if (kind == Kind::Run && start >= runs.back().last + 1U) {
+                if (start == runs.back().last + 1U) {
+                    runs.back().last = last;
+                } else {
+                    runs.push_back({start, last});
+                }
+                card += last - start + 1U;
+                return;
+            }
+            convert(Kind::Bitmap);
+            setRange(words.data(), start, last + 1U);
+            settleWords();
+        }
+
+        // *this |= words[first, first + kWords), reading past either end of
+        // `w` as zeros
+        void unionWords(
+            const std::vector<std::uint64_t>& w,
+            std::ptrdiff_t                    first
+        ) {
+            convert(Kind::Bitmap);
+            // overlap of words[0, kWords) with w[-first, w.size() - first)
+            const auto size  = static_cast<std::ptrdiff_t>(w.size());
+            const auto begin = std::max<std::ptrdiff_t>(0, -first);
+            const auto end   = std::min<std::ptrdiff_t>(kWords, size - first);
+            if (begin < end) {
+                bit_kernels::active().orWords(
+                    words.data() + begin, words.data() + begin,
+                    w.data() + first + begin, end - begin
+                );
+            }
+            settleWords();
+        }
+
+        // *this &= b
+        void intersectWith(const Container& b) {
+            if (kind == Kind::Bitmap && b.kind == Kind::Bitmap) {
+                bit_kernels::active().andWords(
+                    words.data(), words.data(), b.words.data(), kWords
+                );
+                settleWords();
+            } else if (!b.isFull()) {
+                *this = intersect(*this, b);
+            }
+        }
+
+        static Container intersect(const Container& a, const Container& b) {
+            if (a.isFull() || b.isFull()) {
+                return a.isFull() ? b : a;
+            }
+            if (a.kind != Kind::Array && b.kind == Kind::Array) {
+                return intersect(b, a);
+            }
+            Container out;
+            if (a.kind == Kind::Array) {
+                for (auto v : a.array) {
+                    if (b.contains(v)) {
+                        out.array.push_back(v);
+                    }
+                }
+                out.card = out.array.size();
+                return out;
+            }
+            if (a.kind == Kind::Run && b.kind == Kind::Run) {
+                out.kind = Kind::Run;
+                auto i   = a.runs.begin();
+                auto j   = b.runs.begin();
+                while (i != a.runs.end() && j != b.runs.end()) {
+                    const auto start = std::max(i->start, j->start);
+                    const auto last  = std::min(i->last, j->last);
+                    if (start <= last) {
+                        out.runs.push_back({start, last});
+                        out.card += last - start + 1U;
+                    }
+                    (i->last < j->last ? i : j)++;
+                }
+                out.normalize();
+                return out;
+            }
+            if (a.kind == Kind::Bitmap && b.kind == Kind::Run) {
+                return intersect(b, a);
+            }
+            if (a.kind == Kind::Run && b.kind == Kind::Bitmap &&
+                a.card <= kMaxArray) {
+                // few enough bits under the runs to collect them directly
+                for (auto run : a.runs) {
+                    for (std::uint32_t w = run.start / 64; w <= run.last / 64;
+                         ++w) {
+                        std::uint64_t word = b.words[w];
+                        if (w == run.start / 64U) {
+                            word &= ~std::uint64_t{0} << (run.start % 64);
+                        }
+                        if (w == run.last / 64U && run.last % 64 != 63) {
+                            word &=
+                                (std::uint64_t{1} << (run.last % 64 + 1)) - 1;
+                        }
+                        for (; word != 0; word &= word - 1) {
+                            out.array.push_back(static_cast<std::uint16_t>(
+                                w * 64 + std::countr_zero(word)
+                            ));
+                        }
+                    }
+                }
+                out.card = out.array.size();
+                return out;
+            }
+            return combineWords(a, b, bit_kernels::active().andWords);
+        }
+
+        // Intersection of all of `parts` (non-empty). All-bitmap inputs are
+        // ANDed in one fused pass; otherwise the smallest container is
+        // narrowed by each of the others in turn.
+        static Container intersectAll(std::vector<const Container*>& parts) {
+            const Container* first = parts.front();
+            std::erase_if(parts, [](const Container* c) {
+                return c->isFull();
+            });
+            if (parts.size() <= 1) {
+                return parts.empty() ? *first : *parts.front();
+            }
+            if (std::ranges::all_of(parts, [](const Container* c) {
+                    return c->kind == Kind::Bitmap;
+                })) {
+                std::vector<const std::uint64_t*> srcs;
+                for (const auto* c : parts) {
+                    srcs.push_back(c->words.data());
+                }
+                const auto& k = bit_kernels::active();
+                Container   out;
+                out.kind = Kind::Bitmap;
+                out.words.resize(kWords);
+                out.card = static_cast<std::uint32_t>(k.andMany(
+                    out.words.data(), srcs.data(), srcs.size(), kWords
+                ));
+                out.settle(k.countRuns(out.words.data(), kWords));
+                return out;
+            }
+            std::ranges::sort(parts, {}, &Container::card);
+            Container out = *parts.front();
+            for (std::size_t i = 1; i < parts.size() && !out.empty(); ++i) {
+                out.intersectWith(*parts[i]);
+            }
+            return out;
+        }
+
+        static Container combineWords(
+            const Container&    a,
+            const Container&    b,
+            bit_kernels::WordOp op
+        ) {
+            std::vector<std::uint64_t> aWords;
+            std::vector<std::uint64_t> bWords;
+            const auto&                x =
+                a.kind == Kind::Bitmap ? a.words : (aWords = a.bitmapWords());
+            const auto& y =
+                b.kind == Kind::Bitmap ? b.words : (bWords = b.bitmapWords());
+
+            std::vector<std::uint64_t> w(kWords);
+            op(w.data(), x.data(), y.data(), kWords);
+            return fromWords(std::move(w));
+        }
+    };
+
+    std::vector<std::uint16_t> keys_;    // chunk keys, ascending
+    std::vector<Container>     chunks_;  // parallel to keys_
+    std::size_t                m_size{};
+    std::size_t                capacity_{};
+
+    // Position of chunk `key` in keys_, or where it would be inserted
+    [[nodiscard]] std::size_t chunkPos(std::uint16_t key) const {
+        if (!keys_.empty() && keys_.back() == key) {
+            return keys_.size() - 1;
+        }
+        return std::lower_bound(keys_.begin(), keys_.end(), key) -
+               keys_.begin();
+    }
+
+    // Chunk `key`, created empty if it doesn't exist yet
+    Container& chunkAt(std::uint16_t key) {
+        const auto pos = chunkPos(key);
+        if (pos == keys_.size() || keys_[pos] != key) {
+            keys_.insert(keys_.begin() + pos, key);
+            chunks_.insert(chunks_.begin() + pos, Container());
+        }
+        return chunks_[pos];
+    }
+
+    [[nodiscard]] const Container* findChunk(std::uint16_t key) const {
+        const auto pos = chunkPos(key);
+        return pos < keys_.size() && keys_[pos] == key ? &chunks_[pos]
+                                                       : nullptr;
+    }
+
+    static void checkSize(std::size_t size) {
+        if (size > kMaxBits) {
+            throw std::length_error("BitSet: index past 2^32");
+        }
+    }
+
+    void grow(std::size_t size) {
+        checkSize(size);
+        m_size = std::max(m_size, size);
+        while (capacity_ < m_size) {
+            capacity_ = capacity_ == 0 ? m_size : capacity_ * 2;
+        }
+    }
+
+    // Drop bits >= `size`
+    void truncate(std::size_t size) {
+        m_size = std::min(m_size, size);
+        while (!keys_.empty() &&
+               static_cast<std::size_t>(keys_.back()) * kChunkBits >= m_size) {
+            keys_.pop_back();
+            chunks_.pop_back();
+        }
+        if (keys_.empty()) {
+            return;
+        }
+        auto& last = chunks_.back();
+        for (auto i = nextSetBitUnbounded(m_size); i != npos;
+             i      = nextSetBitUnbounded(i + 1)) {
+            last.remove(static_cast<std::uint16_t>(i % kChunkBits));
+        }
+        if (last.empty()) {
+            keys_.pop_back();
+            chunks_.pop_back();
+        }
+    }
+
+    // Like nextSetBit, but not capped at size(); npos if there is none
+    [[nodiscard]] std::size_t nextSetBitUnbounded(std::size_t from) const {
+        if (from / kChunkBits >= kChunkBits) {
+            return npos;
+        }
+        const auto key = static_cast<std::uint16_t>(from / kChunkBits);
+        auto       pos = chunkPos(key);
+        const bool here = pos < keys_.size() && keys_[pos] == key;
+        return seekNext(pos, here ? from % kChunkBits : 0);
+    }
+
+    // First set bit at offset >= `low` of chunk `pos`, or in a later chunk;
+    // npos if there is none. Leaves `pos` on the chunk it was found in.
+    [[nodiscard]] std::size_t
+    seekNext(std::size_t& pos, std::uint32_t low) const {
+        for (; pos < keys_.size(); ++pos, low = 0) {
+            if (const auto v = chunks_[pos].next(low); v >= 0) {
+                return keys_[pos] * kChunkBits + v;
+            }
+        }
+        return npos;
+    }
+
+    // Last set bit at offset <= `high` of chunk `pos`, or in an earlier
+    // chunk; npos if there is none. Leaves `pos` on the chunk it was found in.
+    [[nodiscard]] std::size_t
+    seekPrev(std::size_t& pos, std::uint32_t high) const {
+        for (; pos < keys_.size(); --pos, high = kChunkBits - 1) {
+            if (const auto v = chunks_[pos].prev(high); v >= 0) {
+                return keys_[pos] * kChunkBits + v;
+            }
+        }
+        return npos;
+    }
+
+    // Chunk position to start a backwards scan from bit `from` (< size()),
+    // and the offset within it; the position is npos if nothing is at or
+    // before `from`
+    [[nodiscard]] std::pair<std::size_t, std::uint32_t>
+    prevStart(std::size_t from) const {
+        const auto key = static_cast<std::uint16_t>(from / kChunkBits);
+        const auto pos = chunkPos(key);
+        if (pos < keys_.size() && keys_[pos] == key) {
+            return {pos, from % kChunkBits};
+        }
+        return {pos - 1, kChunkBits - 1};  // wraps to npos when pos == 0
+    }
 
    public:
     static BitSet trueMask(std::size_t size) {
-        BitSet bs(size);
-        bs.m_size = size;
-        bs.bitset_.flip();
-        return std::move(bs);
+        BitSet bs = falseMask(size);
+        for (std::size_t start = 0; start < size; start += kChunkBits) {
+            bs.keys_.push_back(static_cast<std::uint16_t>(start / kChunkBits));
+            bs.chunks_.push_back(Container::fullRange(
+                static_cast<std::uint32_t>(std::min(kChunkBits, size - start))
+            ));
+        }
+        return bs;
     }
 
     static BitSet falseMask(std::size_t size) {
+        checkSize(size);
         BitSet bs(size);
         bs.m_size = size;
-        return std::move(bs);
+        return bs;
     }
 
-    explicit BitSet(std::size_t capacity = 1024) : bitset_(capacity) {}
-    explicit BitSet(boost::dynamic_bitset<> _bs) : bitset_(std::move(_bs)) {
-        m_size = _bs.size();
+    explicit BitSet(std::size_t capacity = 1024) : capacity_(capacity) {}
+
+    // Evaluate a lazy expression such as `a & ~b`, a chunk at a time
+    template <BitExpression E>
+    BitSet(const E& expr)
+        : m_size(expr.size())
+        , capacity_(expr.size()) {
+        const std::size_t chunks = (m_size + kChunkBits - 1) / kChunkBits;
+        std::vector<std::uint64_t> scratch(kChunkWords);
+        for (auto key = expr.nextChunk(0); key < chunks;
+             key      = expr.nextChunk(key + 1)) {
+            const auto* words = expr.evalChunk(key, scratch.data());
+            if (words == nullptr) {
+                continue;
+            }
+            Container c = Container::fromWords({words, words + kChunkWords});
+            if (!c.empty()) {
+                keys_.push_back(static_cast<std::uint16_t>(key));
+                chunks_.push_back(std::move(c));
+            }
+        }
     }
 
     void push_back(bool value) {
-        if (m_size == bitset_.size()) {
-            bitset_.resize(bitset_.size() * 2);
-        }
-        bitset_.set(m_size, value);
-        ++m_size;
+        set(m_size, value);
     }
 
     [[nodiscard]] std::size_t capacity() const {
-        return bitset_.size();
+        return capacity_;
     }
 
     [[nodiscard]] std::size_t size() const {
         return m_size;
     }
 
+    // Number of set bits
+    [[nodiscard]] std::size_t count() const {
+        std::size_t n = 0;
+        for (const auto& c : chunks_) {
+            n += c.card;
+        }
+        return n;
+    }
+
+    // Bytes held by the containers
+    [[nodiscard]] std::size_t memoryUsage() const {
+        std::size_t bytes = keys_.capacity() * sizeof(std::uint16_t) +
+                            chunks_.capacity() * sizeof(Container);
+        for (const auto& c : chunks_) {
+            bytes += c.memoryUsage();
+        }
+        return bytes;
+    }
+
+    // Append this bitset to `out` in the form `read` takes back
+    void write(std::string& out) const {
+        binary_io::put<std::uint64_t>(out, m_size);
+        binary_io::put<std::uint64_t>(out, capacity_);
+        binary_io::putSpan<std::uint16_t>(out, keys_);
+        for (const auto& c : chunks_) {
+            binary_io::put(out, c.kind);
+            binary_io::put(out, c.card);
+            switch (c.kind) {
+                case Container::Kind::Array:
+                    binary_io::putSpan<std::uint16_t>(out, c.array);
+                    break;
+                case Container::Kind::Bitmap:
+                    binary_io::putSpan<std::uint64_t>(out, c.words);
+                    break;
+                case Container::Kind::Run:
+                    binary_io::putSpan<Run>(out, c.runs);
+                    break;
+            }
+        }
+    }
+
+    // A bitset written by `write`, taken off the front of `in`. Throws
+    // std::runtime_error if `in` doesn't hold one.
+    static BitSet read(std::string_view& in) {
+        BitSet bitset(0);
+        bitset.m_size    = binary_io::get<std::uint64_t>(in);
+        bitset.capacity_ = binary_io::get<std::uint64_t>(in);
+        bitset.keys_     = binary_io::getVector<std::uint16_t>(in);
+        for (std::size_t i = 0; i < bitset.keys_.size(); ++i) {
+            Container& c = bitset.chunks_.emplace_back();
+            c.kind       = binary_io::get<Container::Kind>(in);
+            c.card       = binary_io::get<std::uint32_t>(in);
+            switch (c.kind) {
+                case Container::Kind::Array:
+                    c.array = binary_io::getVector<std::uint16_t>(in);
+                    break;
+                case Container::Kind::Bitmap:
+                    c.words = binary_io::getVector<std::uint64_t>(in);
+                    if (c.words.size() != Container::kWords) {
+                        throw std::runtime_error("BitSet::read: bad bitmap");
+                    }
+                    break;
+                case Container::Kind::Run:
+                    c.runs = binary_io::getVector<Run>(in);
+                    break;
+                default:
+                    throw std::runtime_error("BitSet::read: bad container");
+            }
+        }
+        return bitset;
+    }
+
     void set(std::size_t idx, bool value) {
-        while (size() <= idx) {
-            push_back(false);
+        grow(idx + 1);
+        const auto key = static_cast<std::uint16_t>(idx / kChunkBits);
+        const auto low = static_cast<std::uint16_t>(idx % kChunkBits);
+        const auto pos = chunkPos(key);
+        if (pos < keys_.size() && keys_[pos] == key) {
+            if (value) {
+                chunks_[pos].add(low);
+                return;
+            }
+            chunks_[pos].remove(low);
+            if (chunks_[pos].empty()) {
+                keys_.erase(keys_.begin() + pos);
+                chunks_.erase(chunks_.begin() + pos);
+            }
+            return;
+        }
+        if (!value) {
+            return;
+        }
+        // moving on to a new chunk while appending: the previous one is done,
+        // so settle it into its smallest form
+        if (pos == keys_.size() && !chunks_.empty()) {
+            chunks_.back().normalize();
+        }
+        keys_.insert(keys_.begin() + pos, key);
+        chunks_.insert(chunks_.begin() + pos, Container())->add(low);
+    }
+
+    // OR bits [from, to) of `other` (to defaults to other.size()) into this
+    // set, moved so that bit `from` lands on bit `at` (at >= from). Works a
+    // container at a time: arrays and runs are shifted value by value or
+    // interval by interval, bitmaps a whole 64-bit word at a time, including
+    // offsets that aren't a multiple of 64.
+    void appendRange(
+        const BitSet& other,
+        std::size_t   from,
+        std::size_t   at,
+        std::size_t   to = npos
+    ) {
+        to = std::min(to, other.size());
+        if (from >= to) {
+            return;
+        }
+        grow(at + to - from);
+
+        const std::size_t shift    = at - from;
+        const std::size_t chunkOff = shift / kChunkBits;
+        const std::size_t bitOff   = shift % kChunkBits;
+        std::size_t       touched  = npos;  // first destination chunk key
+
+        // set destination bit `bit`, or bits [lo, hi] split at chunk
+        // boundaries
+        auto addBit = [&](std::size_t bit) {
+            chunkAt(static_cast<std::uint16_t>(bit / kChunkBits))
+                .add(static_cast<std::uint16_t>(bit % kChunkBits));
+        };
+        auto addBits = [&](std::size_t lo, std::size_t hi) {
+            while (lo <= hi) {
+                const auto end = std::min(hi, lo | (kChunkBits - 1));
+                chunkAt(static_cast<std::uint16_t>(lo / kChunkBits))
+                    .addRange(
+                        static_cast<std::uint16_t>(lo % kChunkBits),
+                        static_cast<std::uint16_t>(end % kChunkBits)
+                    );
+                lo = end + 1;
+            }
+        };
+
+        const auto firstKey = static_cast<std::uint16_t>(from / kChunkBits);
+        for (auto i = other.chunkPos(firstKey);
+             i < other.keys_.size() && other.keys_[i] * kChunkBits < to; ++i) {
+            const std::size_t base  = other.keys_[i] * kChunkBits;
+            const Container&  src   = other.chunks_[i];
+            const std::size_t first = from > base ? from - base : 0;
+            const std::size_t end   = std::min(kChunkBits, to - base);
+            const auto        key =
+                static_cast<std::uint16_t>(other.keys_[i] + chunkOff);
+            touched = std::min<std::size_t>(touched, key);
+
+            if (first == 0 && end == kChunkBits && bitOff == 0) {
+                chunkAt(key).unionWith(src);
+                continue;
+            }
+            switch (src.kind) {
+                case Container::Kind::Array:
+                    for (auto v : src.array) {
+                        if (v >= first && v < end) {
+                            addBit(base + v + shift);
+                        }
+                    }
+                    break;
+                case Container::Kind::Run:
+                    for (auto run : src.runs) {
+                        const std::size_t lo = std::max<std::size_t>(
+                            run.start, first
+                        );
+                        const std::size_t hi = std::min<std::size_t>(
+                            run.last, end - 1
+                        );
+                        if (lo <= hi) {
+                            addBits(base + lo + shift, base + hi + shift);
+                        }
+                    }
+                    break;
+                case Container::Kind::Bitmap: {
+                    // shift the chunk's words left by bitOff into a two-chunk
+                    // window, then OR each half into its destination chunk
+                    constexpr auto kWords    = Container::kWords;
+                    const auto     wordShift = bitOff / 64;
+                    const auto     bitShift  = bitOff % 64;
+
+                    std::vector<std::uint64_t> window(2 * kWords);
+                    for (std::size_t w = first / 64; w <= (end - 1) / 64;
+                         ++w) {
+                        std::uint64_t word = src.words[w];
+                        if (w == first / 64) {
+                            word &= ~std::uint64_t{0} << (first % 64);
+                        }
+                        if (w == (end - 1) / 64) {
+                            word &= Container::lowMask((end - 1) % 64);
+                        }
+                        window[w + wordShift] |= word << bitShift;
+                        if (bitShift != 0) {
+                            window[w + wordShift + 1] |=
+                                word >> (64 - bitShift);
+                        }
+                    }
+                    chunkAt(key).unionWords(window, 0);
+                    if (std::any_of(
+                            window.begin() + kWords, window.end(),
+                            [](auto w) { return w != 0; }
+                        )) {
+                        chunkAt(key + 1).unionWords(window, kWords);
+                    }
+                    break;
+                }
+            }
+        }
+
+        // settle what was written, dropping chunks left empty
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < keys_.size(); ++i) {
+            if (keys_[i] >= touched) {
+                chunks_[i].normalize();
+            }
+            if (chunks_[i].empty()) {
+                continue;
+            }
+            if (kept != i) {
+                keys_[kept]   = keys_[i];
+                chunks_[kept] = std::move(chunks_[i]);
+            }
+            ++kept;
         }
-        bitset_.set(idx, value);
+        keys_.resize(kept);
+        chunks_.resize(kept);
     }
 
     bool operator[](std::size_t index) const {
-        return bitset_[index];
+        const auto* c = findChunk(static_cast<std::uint16_t>(index / kChunkBits)
+        );
+        return c != nullptr &&
+               c->contains(static_cast<std::uint16_t>(index % kChunkBits));
     }
 
+    // Index of the first set bit >= `from`, or size() if there is none
+    [[nodiscard]] std::size_t nextSetBit(std::size_t from) const {
+        if (from >= m_size) {
+            return m_size;
+        }
+        return std::min(nextSetBitUnbounded(from), m_size);
+    }
+
+    // Index of the last set bit <= `from`, or npos if there is none
+    [[nodiscard]] std::size_t prevSetBit(std::size_t from) const {
+        if (from == npos || m_size == 0) {
+            return npos;
+        }
+        auto [pos, high] = prevStart(std::min(from, m_size - 1));
+        return seekPrev(pos, high);
+    }
+
+    // Write up to `n` set bit indices >= `from` to `out` in ascending order;
+    // returns how many were written. Fewer than `n` means the scan reached
+    // the end, so callers can walk the set one buffer at a time without the
+    // per-bit chunk lookup of nextSetBit.
+    std::size_t
+    nextSetBits(std::size_t from, std::size_t* out, std::size_t n) const {
+        if (from >= m_size) {
+            return 0;
+        }
+        const auto  key = static_cast<std::uint16_t>(from / kChunkBits);
+        std::size_t got = 0;
+        for (auto pos = chunkPos(key); pos < keys_.size() && got < n; ++pos) {
+            const std::uint32_t low = keys_[pos] == key ? from % kChunkBits : 0;
+            got += chunks_[pos].collectNext(
+                low, keys_[pos] * kChunkBits, out + got, n - got
+            );
+        }
+        return got;
+    }
+
+    // Like nextSetBits, descending from `from`
+    std::size_t
+    prevSetBits(std::size_t from, std::size_t* out, std::size_t n) const {
+        if (from == npos || m_size == 0) {
+            return 0;
+        }
+        auto [pos, high] = prevStart(std::min(from, m_size - 1));
+        std::size_t got  = 0;
+        for (; pos < keys_.size() && got < n; --pos, high = kChunkBits - 1) {
+            got += chunks_[pos].collectPrev(
+                high, keys_[pos] * kChunkBits, out + got, n - got
+            );
+        }
+        return got;
+    }
+
+    // Equal when the same bits are set, whatever the sizes
     bool operator==(const BitSet& other) const {
-        return this->bitset_ == other.bitset_;
+        return keys_ == other.keys_ && chunks_ == other.chunks_;
     }
 
     BitSet& operator&=(const BitSet& other) {
-        this->m_size = std::min(this->m_size, other.m_size);
-        this->bitset_.resize(other.capacity());
-        this->bitset_ &= other.bitset_;
+        // intersect chunk by chunk, compacting survivors to the front
+        std::size_t kept = 0;
+        std::size_t j    = 0;
+        for (std::size_t i = 0; i < keys_.size(); ++i) {
+            while (j < other.keys_.size() && other.keys_[j] < keys_[i]) {
+                ++j;
+            }
+            if (j == other.keys_.size()) {
+                break;
+            }
+            if (other.keys_[j] != keys_[i]) {
+                continue;
+            }
+            chunks_[i].intersectWith(other.chunks_[j]);
+            if (chunks_[i].empty()) {
+                continue;
+            }
+            if (kept != i) {
+                keys_[kept]   = keys_[i];
+                chunks_[kept] = std::move(chunks_[i]);
+            }
+            ++kept;
+        }
+        keys_.resize(kept);
+        chunks_.resize(kept);
+        truncate(std::min(m_size, other.m_size));
         return *this;
     }
 
-    BitSet operator&(const BitSet& other) const {
-        BitSet result = *this;
-        result &= other;
+    // Bits set in every one of `sets`, within [0, size); all of [0, size)
+    // when `sets` is empty. One pass over the chunk keys the sets share,
+    // rather than a full-size mask narrowed by one `&=` per set.
+    static BitSet
+    intersectAll(std::span<const BitSet* const> sets, std::size_t size) {
+        if (sets.empty()) {
+            return trueMask(size);
+        }
+        for (const auto* set : sets) {
+            size = std::min(size, set->m_size);
+        }
+        BitSet result = falseMask(size);
+
+        // walk the keys of the set with the fewest chunks, keeping a cursor
+        // into each set's keys
+        const BitSet* driver = *std::ranges::min_element(
+            sets, {}, [](const BitSet* set) { return set->keys_.size(); }
+        );
+        std::vector<std::size_t>      cursor(sets.size());
+        std::vector<const Container*> parts;
+        for (std::size_t i = 0; i < driver->keys_.size(); ++i) {
+            const auto key = driver->keys_[i];
+            if (key * kChunkBits >= size) {
+                break;
+            }
+            parts.clear();
+            for (std::size_t s = 0; s < sets.size(); ++s) {
+                const auto& keys = sets[s]->keys_;
+                auto&       pos  = cursor[s];
+                while (pos < keys.size() && keys[pos] < key) {
+                    ++pos;
+                }
+                if (pos == keys.size() || keys[pos] != key) {
+                    break;
+                }
+                parts.push_back(&sets[s]->chunks_[pos]);
+            }
+            if (parts.size() != sets.size()) {
+                continue;  // some set has nothing in this chunk
+            }
+            Container chunk = Container::intersectAll(parts);
+            if (!chunk.empty()) {
+                result.keys_.push_back(key);
+                result.chunks_.push_back(std::move(chunk));
+            }
+        }
+        result.truncate(size);
         return result;
     }
 
-    BitSet operator|(const BitSet& other) const {
-        BitSet result;
-        result.bitset_ = this->bitset_ | other.bitset_;
-        result.m_size  = std::max(this->m_size, other.m_size);
-        return result;
+    // Chunk-level access, for evaluating the lazy expressions below BitSet
+    // one 64K-bit chunk at a time. Chunk keys are below kChunkBits.
+    static constexpr std::size_t kChunkWords = kChunkBits / 64;
+
+    // Key of the first non-empty chunk >= `key`, or npos
+    [[nodiscard]] std::size_t nextChunk(std::size_t key) const {
+        if (key >= kChunkBits) {
+            return npos;
+        }
+        const auto pos = chunkPos(static_cast<std::uint16_t>(key));
+        return pos == keys_.size() ? npos : keys_[pos];
     }
 
-    BitSet operator^(const BitSet& other) const {
-        BitSet result;
-        result.bitset_ = this->bitset_ ^ other.bitset_;
-        result.m_size  = std::max(this->m_size, other.m_size);
-        return result;
+    // Key of the last non-empty chunk <= `key`, or npos
+    [[nodiscard]] std::size_t prevChunk(std::size_t key) const {
+        if (key == npos) {
+            return npos;
+        }
+        const auto it = std::upper_bound(keys_.begin(), keys_.end(), key);
+        return it == keys_.begin() ? npos : *std::prev(it);
     }
 
-    BitSet operator~() const {
-        BitSet result(*this);
-        result.bitset_ = ~this->bitset_;
-        return result;
+    // The kChunkWords words of chunk `key`: a bitmap container's own, or
+    // written to `scratch`. nullptr if the chunk is empty.
+    const std::uint64_t*
+    chunkWords(std::size_t key, std::uint64_t* scratch) const {
+        const auto* c = findChunk(static_cast<std::uint16_t>(key));
+        if (c == nullptr) {
+            return nullptr;
+        }
+        if (c->kind == Container::Kind::Bitmap) {
+            return c->words.data();
+        }
+        c->writeWords(scratch);
+        return scratch;
+    }
+
+    // Chunk `key` of the intersection of `sets` (non-empty), written to `out`;
+    // nullptr if it is empty
+    static const std::uint64_t* intersectChunk(
+        std::span<const BitSet* const> sets, std::size_t key,
+        std::uint64_t* out
+    ) {
+        std::vector<const Container*> parts;
+        for (const auto* set : sets) {
+            const auto* c = set->findChunk(static_cast<std::uint16_t>(key));
+            if (c == nullptr) {
+                return nullptr;
+            }
+            parts.push_back(c);
+        }
+        const Container chunk = Container::intersectAll(parts);
+        if (chunk.empty()) {
+            return nullptr;
+        }
+        chunk.writeWords(out);
+        return out;
     }
 
     friend std::ostream& operator<<(std::ostream& os, const BitSet& bitset) {
         for (std::size_t i = 0; i < bitset.m_size; ++i) {
-            os << bitset.bitset_[i];
+            os << bitset[i];
         }
         return os;
     }
 
+    // Walks set bits in either direction, remembering which chunk it is in so
+    // each step is a word scan within that chunk rather than a chunk lookup
     class TrueIndexIterator {
        private:
         const BitSet& bitset_;
         std::size_t   current_;
+        std::size_t   pos_ = 0;  // chunk holding current_
         bool          reverse_;
 
        public:
@@ -120,19 +1333,15 @@ class BitSet {
         TrueIndexIterator(
             const BitSet& bitset, std::size_t start, bool reverse = false
         )
-            : bitset_(bitset), current_(start), reverse_(reverse) {
-            if (!reverse_) {
-                // Advance to the first true bit
-                while (current_ < bitset_.size() && !bitset_.bitset_[current_]
-                ) {
-                    ++current_;
-                }
-            } else {
-                // Retreat to the last true bit
-                while (current_ != static_cast<std::size_t>(-1) &&
-                       !bitset_.bitset_[current_]) {
-                    --current_;
-                }
+            : bitset_(bitset)
+            , current_(
+                  reverse ? bitset.prevSetBit(start) : bitset.nextSetBit(start)
+              )
+            , reverse_(reverse) {
+            if (current_ < bitset_.m_size) {
+                pos_ = bitset_.chunkPos(
+                    static_cast<std::uint16_t>(current_ / kChunkBits)
+                );
             }
         }
 
@@ -141,20 +1350,18 @@ class BitSet {
         }
 
         TrueIndexIterator& operator++() {
+            if (current_ >= bitset_.m_size) {
+                return *this;  // already at end()/rend()
+            }
+            const auto low = static_cast<std::uint32_t>(current_ % kChunkBits);
             if (!reverse_) {
-                do {
-                    ++current_;
-                } while (current_ < bitset_.size() && !bitset_.bitset_[current_]
-                );
+                auto next = low + 1 == kChunkBits
+                                ? bitset_.seekNext(++pos_, 0)
+                                : bitset_.seekNext(pos_, low + 1);
+                current_  = std::min(next, bitset_.m_size);
             } else {
-                do {
-                    if (current_ == 0) {
-                        current_ = static_cast<std::size_t>(-1);
-                        break;
-                    }
-                    --current_;
-                } while (current_ != static_cast<std::size_t>(-1) &&
-                         !bitset_.bitset_[current_]);
+                current_ = low == 0 ? bitset_.seekPrev(--pos_, kChunkBits - 1)
+                                    : bitset_.seekPrev(pos_, low - 1);
             }
             return *this;
         }
@@ -177,7 +1384,410 @@ class BitSet {
     }
 
     [[nodiscard]] TrueIndexIterator rend() const {
-        return TrueIndexIterator(*this, static_cast<std::size_t>(-1), true);
+        return TrueIndexIterator(*this, npos, true);
+    }
+};
+
+// Lazy boolean algebra over BitSets. `a & b`, `a | b`, `a ^ b` and `~a` on
+// BitSets, or on expressions built from them, return small expression nodes
+// whose shape is fixed at compile time. Nothing is computed until the
+// expression is assigned to a BitSet or walked with a BitCursor, and both
+// evaluate it a 64K-bit chunk at a time through 8 KB buffers, so a filter
+// tree of any shape never materializes a full-length intermediate.
+//
+// Nodes refer to the BitSets they were built from; those must outlive them.
+
+// Chunk `key` of [0, size) as words written to `out`
+inline const std::uint64_t*
+onesWithin(std::size_t key, std::size_t size, std::uint64_t* out) {
+    std::fill_n(out, BitSet::kChunkWords, ~std::uint64_t{0});
+    const std::size_t bits = size - key * BitSet::kChunkBits;
+    if (bits < BitSet::kChunkBits) {
+        std::fill(out + bits / 64, out + BitSet::kChunkWords, 0);
+        if (bits % 64 != 0) {
+            out[bits / 64] = ~std::uint64_t{0} >> (64 - bits % 64);
+        }
+    }
+    return out;
+}
+
+// Number of chunks covering [0, size)
+constexpr std::size_t chunksWithin(std::size_t size) {
+    return (size + BitSet::kChunkBits - 1) / BitSet::kChunkBits;
+}
+
+// Leaf: a BitSet, by reference
+class BitRef {
+    const BitSet* set_;
+
+   public:
+    explicit BitRef(const BitSet& set) : set_(&set) {}
+
+    [[nodiscard]] std::size_t size() const {
+        return set_->size();
+    }
+
+    [[nodiscard]] std::size_t nextChunk(std::size_t key) const {
+        return set_->nextChunk(key);
+    }
+
+    [[nodiscard]] std::size_t prevChunk(std::size_t key) const {
+        return set_->prevChunk(key);
+    }
+
+    const std::uint64_t*
+    evalChunk(std::size_t key, std::uint64_t* scratch) const {
+        return set_->chunkWords(key, scratch);
+    }
+};
+
+// a & b; as long as the shorter operand
+template <BitExpression L, BitExpression R>
+class BitAnd {
+    L a_;
+    R b_;
+
+   public:
+    BitAnd(L a, R b) : a_(std::move(a)), b_(std::move(b)) {}
+
+    [[nodiscard]] std::size_t size() const {
+        return std::min(a_.size(), b_.size());
+    }
+
+    // leapfrog between the operands until they agree on a key
+    [[nodiscard]] std::size_t nextChunk(std::size_t key) const {
+        while ((key = a_.nextChunk(key)) != BitSet::npos) {
+            const auto other = b_.nextChunk(key);
+            if (other == key || other == BitSet::npos) {
+                return other;
+            }
+            key = other;
+        }
+        return BitSet::npos;
+    }
+
+    [[nodiscard]] std::size_t prevChunk(std::size_t key) const {
+        while ((key = a_.prevChunk(key)) != BitSet::npos) {
+            const auto other = b_.prevChunk(key);
+            if (other == key || other == BitSet::npos) {
+                return other;
+            }
+            key = other;
+        }
+        return BitSet::npos;
+    }
+
+    const std::uint64_t*
+    evalChunk(std::size_t key, std::uint64_t* scratch) const {
+        const auto* x = a_.evalChunk(key, scratch);
+        if (x == nullptr) {
+            return nullptr;
+        }
+        std::array<std::uint64_t, BitSet::kChunkWords> other;
+        const auto* y = b_.evalChunk(key, other.data());
+        if (y == nullptr) {
+            return nullptr;
+        }
+        bit_kernels::active().andWords(scratch, x, y, BitSet::kChunkWords);
+        return scratch;
+    }
+};
+
+// a | b or a ^ b, by `op`; as long as the longer operand
+template <BitExpression L, BitExpression R, bit_kernels::Op op>
+class BitCombine {
+    L a_;
+    R b_;
+
+   public:
+    BitCombine(L a, R b) : a_(std::move(a)), b_(std::move(b)) {}
+
+    [[nodiscard]] std::size_t size() const {
+        return std::max(a_.size(), b_.size());
+    }
+
+    [[nodiscard]] std::size_t nextChunk(std::size_t key) const {
+        return std::min(a_.nextChunk(key), b_.nextChunk(key));
+    }
+
+    [[nodiscard]] std::size_t prevChunk(std::size_t key) const {
+        const auto x = a_.prevChunk(key);
+        const auto y = b_.prevChunk(key);
+        return x == BitSet::npos ? y : y == BitSet::npos ? x : std::max(x, y);
+    }
+
+    const std::uint64_t*
+    evalChunk(std::size_t key, std::uint64_t* scratch) const {
+        std::array<std::uint64_t, BitSet::kChunkWords> other;
+        const auto* x = a_.evalChunk(key, scratch);
+        const auto* y = b_.evalChunk(key, other.data());
+        if (x == nullptr || y == nullptr) {
+            // x | 0 == x ^ 0 == x; a result in `other` has to be copied out
+            const auto* only = x != nullptr ? x : y;
+            if (only == other.data()) {
+                std::copy(other.begin(), other.end(), scratch);
+                return scratch;
+            }
+            return only;
+        }
+        const auto& k = bit_kernels::active();
+        (op == bit_kernels::Op::Or ? k.orWords : k.xorWords)(
+            scratch, x, y, BitSet::kChunkWords
+        );
+        return scratch;
+    }
+};
+
+template <BitExpression L, BitExpression R>
+using BitOr = BitCombine<L, R, bit_kernels::Op::Or>;
+
+template <BitExpression L, BitExpression R>
+using BitXor = BitCombine<L, R, bit_kernels::Op::Xor>;
+
+// ~a, within [0, a.size())
+template <BitExpression E>
+class BitNot {
+    E a_;
+
+   public:
+    explicit BitNot(E a) : a_(std::move(a)) {}
+
+    [[nodiscard]] std::size_t size() const {
+        return a_.size();
+    }
+
+    [[nodiscard]] std::size_t nextChunk(std::size_t key) const {
+        return key < chunksWithin(size()) ? key : BitSet::npos;
+    }
+
+    [[nodiscard]] std::size_t prevChunk(std::size_t key) const {
+        const auto chunks = chunksWithin(size());
+        return key == BitSet::npos || chunks == 0 ? BitSet::npos
+                                                  : std::min(key, chunks - 1);
+    }
+
+    const std::uint64_t*
+    evalChunk(std::size_t key, std::uint64_t* scratch) const {
+        std::array<std::uint64_t, BitSet::kChunkWords> ones;
+        onesWithin(key, size(), ones.data());
+        const auto* x = a_.evalChunk(key, scratch);
+        if (x == nullptr) {
+            std::copy(ones.begin(), ones.end(), scratch);
+        } else {
+            bit_kernels::active().andNotWords(
+                scratch, ones.data(), x, BitSet::kChunkWords
+            );
+        }
+        return scratch;
+    }
+};
+
+// The intersection of a runtime list of BitSets, within [0, size); all of
+// [0, size) for an empty list. Each chunk is intersected container by
+// container, as BitSet::intersectAll does.
+class BitAllOf {
+    std::span<const BitSet* const> sets_;
+    std::size_t                    size_;
+
+   public:
+    BitAllOf(std::span<const BitSet* const> sets, std::size_t size)
+        : sets_(sets)
+        , size_(size) {
+        for (const auto* set : sets_) {
+            size_ = std::min(size_, set->size());
+        }
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return size_;
+    }
+
+    [[nodiscard]] std::size_t nextChunk(std::size_t key) const {
+        if (sets_.empty()) {
+            return key < chunksWithin(size_) ? key : BitSet::npos;
+        }
+        for (std::size_t agreed = 0; key != BitSet::npos;) {
+            for (const auto* set : sets_) {
+                const auto next = set->nextChunk(key);
+                agreed          = next == key ? agreed + 1 : 1;
+                key             = next;
+                if (key == BitSet::npos) {
+                    break;
+                }
+            }
+            if (agreed >= sets_.size()) {
+                return key;
+            }
+        }
+        return BitSet::npos;
+    }
+
+    [[nodiscard]] std::size_t prevChunk(std::size_t key) const {
+        if (sets_.empty()) {
+            const auto chunks = chunksWithin(size_);
+            return key == BitSet::npos || chunks == 0
+                       ? BitSet::npos
+                       : std::min(key, chunks - 1);
+        }
+        for (std::size_t agreed = 0; key != BitSet::npos;) {
+            for (const auto* set : sets_) {
+                const auto prev = set->prevChunk(key);
+                agreed          = prev == key ? agreed + 1 : 1;
+                key             = prev;
+                if (key == BitSet::npos) {
+                    break;
+                }
+            }
+            if (agreed >= sets_.size()) {
+                return key;
+            }
+        }
+        return BitSet::npos;
+    }
+
+    const std::uint64_t*
+    evalChunk(std::size_t key, std::uint64_t* scratch) const {
+        if (sets_.empty()) {
+            return onesWithin(key, size_, scratch);
+        }
+        return BitSet::intersectChunk(sets_, key, scratch);
+    }
+};
+
+// BitSets enter expressions by reference, expressions by value
+template <typename T>
+concept BitOperand = std::same_as<T, BitSet> || BitExpression<T>;
+
+template <BitOperand T>
+auto bitOperand(const T& x) {
+    if constexpr (std::same_as<T, BitSet>) {
+        return BitRef(x);
+    } else {
+        return x;
+    }
+}
+
+template <BitOperand L, BitOperand R>
+auto operator&(const L& a, const R& b) {
+    return BitAnd<decltype(bitOperand(a)), decltype(bitOperand(b))>(
+        bitOperand(a), bitOperand(b)
+    );
+}
+
+template <BitOperand L, BitOperand R>
+auto operator|(const L& a, const R& b) {
+    return BitOr<decltype(bitOperand(a)), decltype(bitOperand(b))>(
+        bitOperand(a), bitOperand(b)
+    );
+}
+
+template <BitOperand L, BitOperand R>
+auto operator^(const L& a, const R& b) {
+    return BitXor<decltype(bitOperand(a)), decltype(bitOperand(b))>(
+        bitOperand(a), bitOperand(b)
+    );
+}
+
+template <BitOperand T>
+auto operator~(const T& a) {
+    // spelled out: deduction from a BitNot would copy it, not wrap it
+    return BitNot<decltype(bitOperand(a))>(bitOperand(a));
+}
+
+// Walks the set bits of an expression in batches, evaluating one chunk at a
+// time into its own buffer. Only the chunks it reaches are computed, so a
+// caller that stops early (after the newest N matches, say) skips the rest.
+template <BitExpression E>
+class BitCursor {
+    E                          expr_;
+    std::vector<std::uint64_t> scratch_;
+    std::size_t                key_   = BitSet::npos;  // chunk in words_
+    const std::uint64_t*       words_ = nullptr;
+
+    const std::uint64_t* load(std::size_t key) {
+        if (key != key_) {
+            key_   = key;
+            words_ = expr_.evalChunk(key, scratch_.data());
+        }
+        return words_;
+    }
+
+   public:
+    explicit BitCursor(E expr)
+        : expr_(std::move(expr))
+        , scratch_(BitSet::kChunkWords) {}
+
+    [[nodiscard]] std::size_t size() const {
+        return expr_.size();
+    }
+
+    // Like BitSet::nextSetBits
+    std::size_t
+    nextSetBits(std::size_t from, std::size_t* out, std::size_t n) {
+        std::size_t got = 0;
+        if (from >= size()) {
+            return got;
+        }
+        for (auto key = expr_.nextChunk(from / BitSet::kChunkBits);
+             key < chunksWithin(size()) && got < n;
+             key = expr_.nextChunk(key + 1)) {
+            const auto* words = load(key);
+            if (words == nullptr) {
+                continue;
+            }
+            const std::size_t base = key * BitSet::kChunkBits;
+            const std::size_t low  = from > base ? from - base : 0;
+            auto              w    = low / 64;
+            auto word = words[w] & (~std::uint64_t{0} << (low % 64));
+            while (got < n) {
+                if (word == 0) {
+                    if (++w == BitSet::kChunkWords) {
+                        break;
+                    }
+                    word = words[w];
+                    continue;
+                }
+                out[got++] = base + w * 64 + std::countr_zero(word);
+                word &= word - 1;
+            }
+        }
+        return got;
+    }
+
+    // Like BitSet::prevSetBits
+    std::size_t
+    prevSetBits(std::size_t from, std::size_t* out, std::size_t n) {
+        std::size_t got = 0;
+        if (from == BitSet::npos || size() == 0) {
+            return got;
+        }
+        from = std::min(from, size() - 1);
+        for (auto key = expr_.prevChunk(from / BitSet::kChunkBits);
+             key != BitSet::npos && got < n;
+             key = key == 0 ? BitSet::npos : expr_.prevChunk(key - 1)) {
+            const auto* words = load(key);
+            if (words == nullptr) {
+                continue;
+            }
+            const std::size_t base = key * BitSet::kChunkBits;
+            const std::size_t high =
+                std::min(from - base, BitSet::kChunkBits - 1);
+            auto w    = high / 64;
+            auto word = words[w] & (~std::uint64_t{0} >> (63 - high % 64));
+            while (got < n) {
+                if (word == 0) {
+                    if (w-- == 0) {
+                        break;
+                    }
+                    word = words[w];
+                    continue;
+                }
+                const auto bit = 63 - std::countl_zero(word);
+                out[got++]     = base + w * 64 + bit;
+                word &= ~(std::uint64_t{1} << bit);
+            }
+        }
+        return got;
     }
 };
 
@@ -367,3 +1977,456 @@ TEST_CASE("BitSet set") {
     bitset.set(2, false);
     CHECK(bitset[2] == false);
 }
+
+TEST_CASE("BitSet containers match a dense reference") {
+    // densities that land in array, bitmap and run containers, over several
+    // 64K chunks with gaps between them
+    constexpr std::size_t n = 5 * BitSet::kChunkBits + 123;
+
+    std::uint64_t state = 42;
+    auto          rand  = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    auto make = [&](int kind) {
+        std::vector<bool> ref(n);
+        BitSet            bs;
+        for (std::size_t i = 0; i < n; ++i) {
+            const auto chunk = i / BitSet::kChunkBits;
+            bool       bit   = false;
+            switch ((chunk + kind) % 4) {
+                case 0:  // sparse
+                    bit = rand() % 1000 == 0;
+                    break;
+                case 1:  // dense
+                    bit = rand() % 2 == 0;
+                    break;
+                case 2:  // long runs
+                    bit = (i / 5000) % 3 != 0;
+                    break;
+                default:  // empty
+                    break;
+            }
+            ref[i] = bit;
+            if (bit) {
+                bs.set(i, true);
+            }
+        }
+        return std::pair{ref, bs};
+    };
+    auto same = [&](const BitSet& bs, const std::vector<bool>& ref) {
+        std::vector<std::size_t> expected;
+        for (std::size_t i = 0; i < ref.size(); ++i) {
+            if (ref[i]) {
+                expected.push_back(i);
+            }
+        }
+        std::vector<std::size_t> forward(bs.begin(), bs.end());
+        std::vector<std::size_t> reverse;
+        for (auto it = bs.rbegin(); it != bs.rend(); ++it) {
+            reverse.push_back(*it);
+        }
+        std::reverse(reverse.begin(), reverse.end());
+        return forward == expected && reverse == expected &&
+               bs.count() == expected.size();
+    };
+
+    auto [refA, a] = make(0);
+    auto [refB, b] = make(1);
+    CHECK(same(a, refA));
+    CHECK(same(b, refB));
+
+    std::vector<bool> refAnd(n);
+    std::vector<bool> refOr(n);
+    std::vector<bool> refXor(n);
+    std::vector<bool> refNot(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        refAnd[i] = refA[i] && refB[i];
+        refOr[i]  = refA[i] || refB[i];
+        refXor[i] = refA[i] != refB[i];
+        refNot[i] = !refA[i] && i < a.size();
+    }
+    CHECK(same(a & b, refAnd));
+    CHECK(same(a | b, refOr));
+    CHECK(same(a ^ b, refXor));
+    CHECK(same(~a, refNot));
+    CHECK(same(BitSet::trueMask(n) & a, refA));
+    CHECK((BitSet::trueMask(n) & a) == a);
+
+    // clearing bits, including ones inside runs
+    for (std::size_t i = 0; i < n; i += 7) {
+        a.set(i, false);
+        refA[i] = false;
+    }
+    CHECK(same(a, refA));
+    bool lookups = true;
+    for (std::size_t i = 0; i < n; ++i) {
+        lookups &= a[i] == refA[i];
+    }
+    CHECK(lookups);
+
+    // &= with a shorter set drops everything past its end
+    BitSet shorter = BitSet::trueMask(BitSet::kChunkBits + 10);
+    a &= shorter;
+    refA.resize(BitSet::kChunkBits + 10);
+    CHECK(a.size() == BitSet::kChunkBits + 10);
+    CHECK(same(a, refA));
+}
+
+TEST_CASE("BitSet memory follows set bits, not length") {
+    BitSet sparse;
+    BitSet dense;
+    for (std::size_t i = 0; i < 100 * BitSet::kChunkBits; ++i) {
+        if (i % 10000 == 0) {
+            sparse.set(i, true);
+        }
+        dense.set(i, true);
+    }
+    // a dense boost::dynamic_bitset would take 800 KB for either
+    CHECK(sparse.count() == 656);
+    CHECK(sparse.memoryUsage() < 16 * 1024);
+    CHECK(dense.count() == 100 * BitSet::kChunkBits);
+    CHECK(dense.memoryUsage() < 32 * 1024);
+}
+
+TEST_CASE("BitSet write and read round-trip every container kind") {
+    BitSet bitset;
+    for (std::size_t i = 0; i < 100; i += 7) {
+        bitset.set(i, true);  // array
+    }
+    for (std::size_t i = 0; i < BitSet::kChunkBits; i += 3) {
+        bitset.set(BitSet::kChunkBits + i, true);  // bitmap
+    }
+    for (std::size_t i = 0; i < 5000; ++i) {
+        bitset.set(3 * BitSet::kChunkBits + i, true);  // run
+    }
+    bitset.set(3 * BitSet::kChunkBits + 9000, false);  // unset tail bits
+
+    std::string out;
+    bitset.write(out);
+    BitSet().write(out);
+
+    std::string_view in   = out;
+    const BitSet     read = BitSet::read(in);
+    CHECK(read == bitset);
+    CHECK(read.size() == bitset.size());
+    CHECK(read.count() == bitset.count());
+    CHECK(read.prevSetBit(BitSet::npos) == bitset.prevSetBit(BitSet::npos));
+    CHECK(BitSet::read(in) == BitSet());
+    CHECK(in.empty());
+
+    std::string_view cut = std::string_view(out).substr(0, 40);
+    CHECK_THROWS_AS(BitSet::read(cut), std::runtime_error);
+}
+
+TEST_CASE("BitSet rejects indices past 2^32") {
+    BitSet bs;
+    bs.set(BitSet::kMaxBits - 1, true);
+    CHECK(bs.size() == BitSet::kMaxBits);
+    CHECK(bs[BitSet::kMaxBits - 1]);
+
+    CHECK_THROWS_AS(bs.set(BitSet::kMaxBits, true), std::length_error);
+    CHECK_THROWS_AS(bs.set(BitSet::kMaxBits + 3, true), std::length_error);
+    CHECK_THROWS_AS(
+        BitSet::falseMask(BitSet::kMaxBits + 1), std::length_error
+    );
+    CHECK_FALSE(bs[3]);  // would have been hit by a wrapped chunk key
+
+    BitSet src;
+    src.set(5, true);
+    BitSet dst;
+    CHECK_THROWS_AS(
+        dst.appendRange(src, 0, BitSet::kMaxBits - 2), std::length_error
+    );
+    CHECK(dst.count() == 0);
+}
+
+TEST_CASE("BitSet appendRange matches bit-by-bit copying") {
+    std::uint64_t state = 7;
+    auto          rand  = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    // one chunk each of sparse (array), dense (bitmap) and run content
+    BitSet src;
+    for (std::size_t i = 0; i < 3 * BitSet::kChunkBits + 500; ++i) {
+        const auto chunk = i / BitSet::kChunkBits;
+        if ((chunk == 0 && rand() % 100 == 0) ||
+            (chunk == 1 && rand() % 2 == 0) ||
+            (chunk >= 2 && i % 3000 < 1500)) {
+            src.set(i, true);
+        }
+    }
+
+    for (std::size_t from : {std::size_t{0}, std::size_t{1}, std::size_t{100},
+                             BitSet::kChunkBits, BitSet::kChunkBits + 77}) {
+        for (std::size_t shift :
+             {std::size_t{0}, std::size_t{1}, std::size_t{64}, std::size_t{63},
+              std::size_t{1000}, BitSet::kChunkBits,
+              3 * BitSet::kChunkBits - 5}) {
+            CAPTURE(from);
+            CAPTURE(shift);
+            // existing content below and overlapping the destination
+            BitSet dst;
+            for (std::size_t i = 0; i < from + shift + 200; i += 97) {
+                dst.set(i, true);
+            }
+            BitSet expected = dst;
+            for (std::size_t i = from; i < src.size(); ++i) {
+                if (src[i]) {
+                    expected.set(i + shift, true);
+                }
+            }
+            dst.appendRange(src, from, from + shift);
+            CHECK(dst == expected);
+            CHECK(dst.size() == std::max(expected.size(), src.size() + shift));
+            CHECK(dst.count() == expected.count());
+
+            // stopping short of the end, mid-word and mid-chunk
+            for (std::size_t to :
+                 {from + 1, from + 1000, 2 * BitSet::kChunkBits + 3}) {
+                CAPTURE(to);
+                BitSet bounded;
+                BitSet want;
+                for (std::size_t i = from; i < to && i < src.size(); ++i) {
+                    if (src[i]) {
+                        want.set(i + shift, true);
+                    }
+                }
+                bounded.appendRange(src, from, from + shift, to);
+                CHECK(bounded == want);
+                CHECK(bounded.size() == to + shift);
+            }
+        }
+    }
+}
+
+TEST_CASE("BitSet set-bit scans match a linear scan") {
+    std::uint64_t state = 3;
+    auto          rand  = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    // array, bitmap, an empty chunk, then run content; bits at chunk edges
+    BitSet bs;
+    for (std::size_t i = 0; i < 4 * BitSet::kChunkBits + 300; ++i) {
+        const auto chunk = i / BitSet::kChunkBits;
+        const auto low   = i % BitSet::kChunkBits;
+        if ((chunk == 0 && rand() % 50 == 0) ||
+            (chunk == 1 && rand() % 3 == 0) ||
+            (chunk >= 3 && i % 2000 < 700) || low == 0 ||
+            low == BitSet::kChunkBits - 1) {
+            bs.set(i, chunk != 2);
+        }
+    }
+    std::vector<std::size_t> expected;
+    for (std::size_t i = 0; i < bs.size(); ++i) {
+        if (bs[i]) {
+            expected.push_back(i);
+        }
+    }
+
+    std::vector<std::size_t> forward(bs.begin(), bs.end());
+    CHECK(forward == expected);
+
+    std::vector<std::size_t> backward;
+    for (auto it = bs.rbegin(); it != bs.rend(); ++it) {
+        backward.push_back(*it);
+    }
+    CHECK(std::equal(
+        backward.begin(), backward.end(), expected.rbegin(), expected.rend()
+    ));
+
+    // batches of an odd size, so they end mid-container
+    std::size_t buf[37];
+    forward.clear();
+    for (std::size_t from = 0, n;
+         (n = bs.nextSetBits(from, buf, std::size(buf))) > 0;
+         from = buf[n - 1] + 1) {
+        forward.insert(forward.end(), buf, buf + n);
+    }
+    CHECK(forward == expected);
+
+    backward.clear();
+    for (std::size_t from = bs.size() - 1, n;
+         (n = bs.prevSetBits(from, buf, std::size(buf))) > 0;
+         from = buf[n - 1] - 1) {
+        backward.insert(backward.end(), buf, buf + n);
+    }
+    CHECK(std::equal(
+        backward.begin(), backward.end(), expected.rbegin(), expected.rend()
+    ));
+
+    for (std::size_t from = 0; from < bs.size(); from += 997) {
+        CAPTURE(from);
+        auto next = std::lower_bound(expected.begin(), expected.end(), from);
+        CHECK(
+            bs.nextSetBit(from) ==
+            (next == expected.end() ? bs.size() : *next)
+        );
+        auto prev = std::upper_bound(expected.begin(), expected.end(), from);
+        CHECK(
+            bs.prevSetBit(from) ==
+            (prev == expected.begin() ? BitSet::npos : *std::prev(prev))
+        );
+    }
+    CHECK(bs.nextSetBits(bs.size(), buf, std::size(buf)) == 0);
+    CHECK(BitSet().prevSetBits(0, buf, std::size(buf)) == 0);
+}
+
+TEST_CASE("BitSet intersectAll matches repeated &= at every kernel level") {
+    using bit_kernels::Level;
+    std::uint64_t state = 9;
+    auto          rand  = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    // chunks of every container kind, full chunks, and differing lengths
+    auto make = [&](std::size_t n, int every) {
+        BitSet bs;
+        for (std::size_t i = 0; i < n; ++i) {
+            const auto chunk = i / BitSet::kChunkBits;
+            const bool set   = chunk == 0   ? rand() % every == 0
+                               : chunk == 1 ? rand() % 3 != 0
+                               : chunk == 2 ? true
+                                            : i % 5000 < 2500;
+            bs.set(i, set);
+        }
+        return bs;
+    };
+    const std::size_t n   = 4 * BitSet::kChunkBits + 123;
+    const BitSet      a   = make(n, 2);
+    const BitSet      b   = make(n - 1000, 50);
+    const BitSet      c   = make(n, 3);
+    const BitSet      sub = BitSet::trueMask(3 * BitSet::kChunkBits + 7);
+
+    auto results = [&]() {
+        const BitSet* sets[] = {&a, &b, &c, &sub};
+        BitSet        seq    = BitSet::trueMask(n);
+        for (const auto* set : sets) {
+            seq &= *set;
+        }
+        const BitSet all = BitSet::intersectAll(sets, n);
+        CHECK(all == seq);
+        CHECK(all.size() == seq.size());
+        CHECK(all.count() == seq.count());
+        CHECK(BitSet::intersectAll({}, 10) == BitSet::trueMask(10));
+        return std::vector<BitSet>{all, a & c, a | b, a ^ c, ~b};
+    };
+
+    bit_kernels::setLevel(Level::Scalar);
+    const auto expected = results();
+    for (auto level : {Level::Avx2, Level::Avx512}) {
+        bit_kernels::setLevel(level);
+        CAPTURE(static_cast<int>(bit_kernels::active().level));
+        CHECK(results() == expected);
+    }
+    bit_kernels::setLevel(bit_kernels::supported());
+}
+
+TEST_CASE("BitSet expressions evaluate like their dense equivalents") {
+    std::uint64_t state = 17;
+    auto          rand  = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    using Dense = std::vector<bool>;
+    // every container kind, an empty chunk, and a different length each
+    auto make = [&](std::size_t n, int every) {
+        std::pair<BitSet, Dense> out{BitSet(), Dense(n)};
+        for (std::size_t i = 0; i < n; ++i) {
+            const auto chunk = i / BitSet::kChunkBits;
+            const bool set   = chunk == 0   ? rand() % every == 0
+                               : chunk == 1 ? rand() % 2 == 0
+                               : chunk == 2 ? false
+                                            : i % 3000 < 1000;
+            out.first.set(i, set);
+            out.second[i] = set;
+        }
+        // size n even if the last bit is clear
+        out.first.set(n - 1, false);
+        out.second[n - 1] = false;
+        return out;
+    };
+    const auto [a, da] = make(4 * BitSet::kChunkBits + 17, 3);
+    const auto [b, db] = make(3 * BitSet::kChunkBits + 100, 40);
+    const auto [c, dc] = make(4 * BitSet::kChunkBits + 5000, 7);
+
+    auto zip = [](const Dense& x, const Dense& y, std::size_t n, auto op) {
+        Dense out(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            out[i] = op(i < x.size() && x[i], i < y.size() && y[i]);
+        }
+        return out;
+    };
+    auto dAnd = [&](const Dense& x, const Dense& y) {
+        return zip(x, y, std::min(x.size(), y.size()), std::logical_and());
+    };
+    auto dOr = [&](const Dense& x, const Dense& y) {
+        return zip(x, y, std::max(x.size(), y.size()), std::logical_or());
+    };
+    auto dXor = [&](const Dense& x, const Dense& y) {
+        return zip(x, y, std::max(x.size(), y.size()), std::not_equal_to());
+    };
+    auto dNot = [&](const Dense& x) {
+        return zip(x, x, x.size(), [](bool v, bool) { return !v; });
+    };
+    auto same = [](const BitSet& bs, const Dense& ref) {
+        if (bs.size() != ref.size()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < ref.size(); ++i) {
+            if (bs[i] != ref[i]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    const auto expr = (a & ~b) | (c ^ (a & b & c));
+    const auto want = dOr(dAnd(da, dNot(db)), dXor(dc, dAnd(dAnd(da, db), dc)));
+    const BitSet got = expr;
+    CHECK(same(got, want));
+    CHECK(same(~(a | b), dNot(dOr(da, db))));
+    CHECK(same(~~a, da));
+
+    // walking the expression lazily gives the materialized bits
+    std::vector<std::size_t> expected(got.begin(), got.end());
+    std::size_t              buf[53];
+    std::vector<std::size_t> walked;
+    BitCursor                forward(expr);
+    for (std::size_t from = 0, n;
+         (n = forward.nextSetBits(from, buf, std::size(buf))) > 0;
+         from = buf[n - 1] + 1) {
+        walked.insert(walked.end(), buf, buf + n);
+    }
+    CHECK(walked == expected);
+
+    walked.clear();
+    BitCursor backward(expr);
+    for (std::size_t from = backward.size() - 1, n;
+         (n = backward.prevSetBits(from, buf, std::size(buf))) > 0;
+         from = buf[n - 1] - 1) {
+        walked.insert(walked.end(), buf, buf + n);
+    }
+    std::ranges::reverse(walked);
+    CHECK(walked == expected);
+
+    // the runtime-length intersection the query service streams
+    const BitSet* sets[] = {&a, &b, &c};
+    const auto    npos   = BitSet::npos;
+    CHECK(BitSet(BitAllOf(sets, npos)) == BitSet::intersectAll(sets, npos));
+    const auto head = dAnd(dAnd(dAnd(da, db), dc), Dense(100, true));
+    CHECK(same(BitAllOf(sets, 100), head));
+    CHECK(BitSet(BitAllOf({}, 70000)) == BitSet::trueMask(70000));
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+
+// How the ingestor notices that the log file changed.
+enum class FollowMode {
+    Poll,     // wake up every `kPollInterval` and look for new bytes
+    Inotify,  // block in epoll until inotify reports a change (Linux only)
+};
+
+constexpr bool kInotifySupported =
+#ifdef __linux__
+    true;
+#else
+    false;
+#endif
+
+// Blocks the ingestor until the followed file may have changed.
+//
+// In `Inotify` mode an epoll set waits on an eventfd and an inotify watch for
+// IN_MODIFY, IN_MOVE_SELF and IN_DELETE_SELF (plus IN_ATTRIB for unlinks), so
+// an idle file costs no wakeups and `wake()` (called after setting the
+// shutdown flag) interrupts the wait immediately. `Poll` mode keeps the
+// original fixed sleep, then stats the path to notice a rotation.
+class FileWatcher {
+   public:
+    enum Event : unsigned {
+        None     = 0,
+        Modified = 1 << 0,  // new bytes may be available
+        Replaced = 1 << 1,  // file was moved or deleted, e.g. log rotation
+        Woken    = 1 << 2,  // `wake()` was called
+    };
+
+    static constexpr auto kPollInterval = std::chrono::milliseconds(10);
+    // How often to look for a replacement after the watched file went away
+    static constexpr auto kOrphanRetry = std::chrono::milliseconds(250);
+
+    FileWatcher(std::string path, FollowMode mode)
+        : path_(std::move(path)), mode_(mode) {
+#ifdef __linux__
+        if (mode_ != FollowMode::Inotify) {
+            rewatch();
+            return;
+        }
+        inotifyFd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        wakeFd_    = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epollFd_   = ::epoll_create1(EPOLL_CLOEXEC);
+        if (inotifyFd_ < 0 || wakeFd_ < 0 || epollFd_ < 0) {
+            throw std::runtime_error(
+                std::string("Failed to set up inotify: ") +
+                std::strerror(errno)
+            );
+        }
+        for (int fd : {inotifyFd_, wakeFd_}) {
+            epoll_event ev{};
+            ev.events  = EPOLLIN;
+            ev.data.fd = fd;
+            ::epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev);
+        }
+        if (!rewatch()) {
+            throw std::runtime_error("Failed to watch " + path_);
+        }
+#else
+        mode_ = FollowMode::Poll;
+        rewatch();
+#endif
+    }
+
+    FileWatcher(const FileWatcher&)            = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    ~FileWatcher() {
+        for (int fd : {epollFd_, wakeFd_, inotifyFd_}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    [[nodiscard]] FollowMode mode() const {
+        return mode_;
+    }
+
+    // Block until the file changes, `wake()` is called, or (in poll mode) the
+    // poll interval elapses. Returns a mask of `Event`s.
+    unsigned wait() {
+#ifdef __linux__
+        if (mode_ == FollowMode::Inotify) {
+            return waitInotify();
+        }
+#endif
+        std::this_thread::sleep_for(kPollInterval);
+        return unlinked() ? Modified | Replaced : Modified;
+    }
+
+    // Interrupt a blocked `wait()`; safe to call from any thread.
+    void wake() const {
+#ifdef __linux__
+        if (wakeFd_ >= 0) {
+            std::uint64_t         one = 1;
+            [[maybe_unused]] auto n   = ::write(wakeFd_, &one, sizeof(one));
+        }
+#endif
+    }
+
+    // (Re)arm the watch on `path`, e.g. after rotation replaced the file, and
+    // follow the file now there. Returns false if nothing exists at `path` yet.
+    bool rewatch() {
+#ifdef __linux__
+        if (mode_ == FollowMode::Inotify) {
+            if (watchFd_ >= 0) {
+                ::inotify_rm_watch(inotifyFd_, watchFd_);
+            }
+            watchFd_ = ::inotify_add_watch(
+                inotifyFd_, path_.c_str(),
+                IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF
+            );
+            if (watchFd_ < 0) {
+                return false;
+            }
+        }
+#endif
+        struct stat st {};
+        if (::stat(path_.c_str(), &st) != 0) {
+            return false;
+        }
+        inode_ = st.st_ino;
+        return true;
+    }
+
+   private:
+#ifdef __linux__
+    unsigned waitInotify() {
+        // with no live watch (file moved away and not yet recreated), fall back
+        // to a slow retry so the replacement is picked up eventually
+        const int timeout =
+            watchFd_ < 0 ? static_cast<int>(kOrphanRetry.count()) : -1;
+
+        epoll_event events[2];
+        int         n = ::epoll_wait(epollFd_, events, 2, timeout);
+        if (n == 0) {
+            return Replaced;
+        }
+
+        unsigned result = None;
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == wakeFd_) {
+                std::uint64_t         count{};
+                [[maybe_unused]] auto r = ::read(wakeFd_, &count, 8);
+                result |= Woken;
+            } else {
+                result |= drainInotify();
+            }
+        }
+        return result;
+    }
+
+    unsigned drainInotify() {
+        alignas(inotify_event) char buf[4096];
+        unsigned                    result = None;
+        for (;;) {
+            ssize_t len = ::read(inotifyFd_, buf, sizeof(buf));
+            if (len <= 0) {
+                break;
+            }
+            for (char* p = buf; p < buf + len;) {
+                const auto* ev = reinterpret_cast<const inotify_event*>(p);
+                if ((ev->mask & IN_MODIFY) != 0U) {
+                    result |= Modified;
+                }
+                if ((ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) != 0U ||
+                    ((ev->mask & IN_ATTRIB) != 0U && unlinked())) {
+                    result |= Replaced;
+                    ::inotify_rm_watch(inotifyFd_, watchFd_);
+                    watchFd_ = -1;
+                }
+                p += sizeof(inotify_event) + ev->len;
+            }
+        }
+        return result;
+    }
+#endif
+
+    // Whether `path` no longer names the file being followed. With inotify,
+    // IN_DELETE_SELF only fires once the last open handle is gone, and the
+    // ingestor holds one, so an unlink shows up as IN_ATTRIB (link count).
+    [[nodiscard]] bool unlinked() const {
+        struct stat st {};
+        return ::stat(path_.c_str(), &st) != 0 || st.st_ino != inode_;
+    }
+
+    std::string path_;
+    FollowMode  mode_;
+    int         inotifyFd_ = -1;
+    int         watchFd_   = -1;
+    int         wakeFd_    = -1;
+    int         epollFd_   = -1;
+    ino_t       inode_{};
+};
@@ -0,0 +1,367 @@
+#pragma once
+
+#define DOCTEST_CONFIG_NO_SHORT_MACRO_NAMES
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "doctest.h"
+
+// Key extraction straight from raw JSON bytes, without building a DOM.
+//
+// Stage 1 (in the style of simdjson) classifies 64 bytes at a time into
+// bitmasks of quotes, backslashes and structural characters, resolves escaped
+// quotes and computes which bytes sit inside strings with a prefix-xor. Stage 2
+// walks the remaining structural positions with count-trailing-zeros, tracking
+// nesting to find object keys.
+namespace json_scan {
+
+struct BlockMasks {
+    std::uint64_t quote;
+    std::uint64_t backslash;
+    std::uint64_t structural;  // { } [ ] : ,
+};
+
+#if defined(__SSE2__)
+BlockMasks classify(const char* p) {
+    BlockMasks m{0, 0, 0};
+    for (int i = 0; i < 4; ++i) {
+        __m128i v =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+        auto eq = [&](char c) {
+            return static_cast<std::uint64_t>(static_cast<std::uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)))
+            ));
+        };
+        // '[' and ']' are '{' and '}' with bit 0x20 cleared, so setting that
+        // bit folds all four brackets into two comparisons
+        __m128i folded   = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        auto    brackets = static_cast<std::uint64_t>(
+            static_cast<std::uint16_t>(_mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))
+            )))
+        );
+        const int shift = 16 * i;
+        m.quote |= eq('"') << shift;
+        m.backslash |= eq('\\') << shift;
+        m.structural |= (brackets | eq(':') | eq(',')) << shift;
+    }
+    return m;
+}
+#else
+BlockMasks classify(const char* p) {
+    BlockMasks m{0, 0, 0};
+    for (int i = 0; i < 64; ++i) {
+        const std::uint64_t bit = std::uint64_t{1} << i;
+        switch (p[i]) {
+            case '"':
+                m.quote |= bit;
+                break;
+            case '\\':
+                m.backslash |= bit;
+                break;
+            case '{':
+            case '}':
+            case '[':
+            case ']':
+            case ':':
+            case ',':
+                m.structural |= bit;
+                break;
+            default:
+                break;
+        }
+    }
+    return m;
+}
+#endif
+
+// Bit i of the result is the xor of bits 0..i of x
+std::uint64_t prefixXor(std::uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Mask of characters escaped by a backslash. A backslash run of odd length
+// escapes the character after it; `prevEscaped` carries a run that ends on the
+// last byte of the previous block.
+std::uint64_t findEscaped(
+    std::uint64_t  backslash,
+    std::uint64_t& prevEscaped
+) {
+    constexpr std::uint64_t evenBits = 0x5555555555555555ULL;
+
+    backslash &= ~prevEscaped;
+    const std::uint64_t followsEscape = backslash << 1 | prevEscaped;
+    const std::uint64_t oddStarts     = backslash & ~evenBits & ~followsEscape;
+
+    std::uint64_t seqsOnEven{};
+    prevEscaped = static_cast<std::uint64_t>(
+        __builtin_add_overflow(oddStarts, backslash, &seqsOnEven)
+    );
+    const std::uint64_t invertMask = seqsOnEven << 1;
+    return (evenBits ^ invertMask) & followsEscape;
+}
+
+// Positions of every unescaped quote and every structural character outside a
+// string, in order.
+void structuralIndex(
+    std::string_view            s,
+    std::vector<std::uint32_t>& out
+) {
+    out.clear();
+    std::uint64_t prevEscaped  = 0;
+    std::uint64_t prevInString = 0;
+
+    auto process = [&](const char* block, std::uint32_t base) {
+        BlockMasks          m        = classify(block);
+        const std::uint64_t escaped  = findEscaped(m.backslash, prevEscaped);
+        const std::uint64_t quote    = m.quote & ~escaped;
+        const std::uint64_t inString = prefixXor(quote) ^ prevInString;
+        prevInString                 = static_cast<std::uint64_t>(
+            static_cast<std::int64_t>(inString) >> 63
+        );
+
+        std::uint64_t bits = quote | (m.structural & ~inString);
+        while (bits != 0) {
+            out.push_back(base + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    };
+
+    std::size_t i = 0;
+    for (; i + 64 <= s.size(); i += 64) {
+        process(s.data() + i, static_cast<std::uint32_t>(i));
+    }
+    if (i < s.size()) {
+        char tail[64];
+        std::memset(tail, ' ', sizeof(tail));
+        std::memcpy(tail, s.data() + i, s.size() - i);
+        process(tail, static_cast<std::uint32_t>(i));
+    }
+}
+
+// Call `f(std::size_t depth, std::string_view key, std::string_view value)`
+// for each object key of `line` nested at most `maxDepth` objects deep
+// (top-level keys are depth 1), in document order, so a key's parent is the
+// last key seen one level up. `value` is the raw scalar token (strings keep
+// their quotes and escapes) or empty for an object or array. Keys inside
+// arrays are skipped. Keys are passed raw, i.e. still JSON-escaped; see
+// `unescapeKey`. Malformed input yields whatever keys were found before the
+// damage rather than an error.
+template <typename F>
+void forEachKey(std::string_view line, std::size_t maxDepth, F&& f) {
+    thread_local std::vector<std::uint32_t> positions;
+    structuralIndex(line, positions);
+
+    if (positions.empty() || line[positions.front()] != '{') {
+        return;
+    }
+
+    // nesting depth, and how many of the outermost levels are all objects;
+    // keys are only reported while depth == objectDepth
+    std::size_t      depth       = 0;
+    std::size_t      objectDepth = 0;
+    bool             expectKey   = false;
+    bool             inString    = false;
+    bool             inKey       = false;
+    std::size_t      stringStart = 0;
+    // key read but not yet reported, and where its value starts once the
+    // ':' after it has been seen
+    std::string_view key;
+    bool             keyPending = false;
+    std::size_t      valueStart = 0;
+
+    auto trim = [](std::string_view v) {
+        const auto first = v.find_first_not_of(" \t\r\n");
+        const auto last  = v.find_last_not_of(" \t\r\n");
+        return first == std::string_view::npos
+                 ? std::string_view()
+                 : v.substr(first, last - first + 1);
+    };
+
+    for (std::uint32_t pos : positions) {
+        const char c = line[pos];
+        if (c == '"') {
+            if (!inString) {
+                inString    = true;
+                inKey       = expectKey;
+                stringStart = pos;
+            } else {
+                inString = false;
+                if (inKey) {
+                    key = line.substr(stringStart + 1, pos - stringStart - 1);
+                    keyPending = true;
+                    valueStart = 0;
+                    inKey      = false;
+                    expectKey  = false;
+                } else if (keyPending && valueStart != 0) {
+                    f(depth, key,
+                      line.substr(stringStart, pos - stringStart + 1));
+                    keyPending = false;
+                }
+            }
+            continue;
+        }
+        if (keyPending && valueStart != 0) {
+            keyPending = false;
+            f(depth, key,
+              c == '{' || c == '['
+                  ? std::string_view()
+                  : trim(line.substr(valueStart, pos - valueStart)));
+        }
+        switch (c) {
+            case '{':
+                if (objectDepth == depth) {
+                    ++objectDepth;
+                }
+                ++depth;
+                expectKey = depth == objectDepth && depth <= maxDepth;
+                break;
+            case '[':
+                ++depth;
+                expectKey = false;
+                break;
+            case '}':
+            case ']':
+                objectDepth = std::min(objectDepth, depth - 1);
+                if (--depth == 0) {
+                    return;
+                }
+                break;
+            case ',':
+                expectKey = depth == objectDepth && depth <= maxDepth;
+                break;
+            default:  // ':'
+                valueStart = pos + 1;
+                break;
+        }
+    }
+}
+
+// Call `f(std::string_view key)` for each key of the top-level object of
+// `line`, in order; see `forEachKey`.
+template <typename F>
+void forEachTopLevelKey(std::string_view line, F&& f) {
+    forEachKey(line, 1, [&](std::size_t, std::string_view key, auto) {
+        f(key);
+    });
+}
+
+// Decode a raw key as passed by `forEachTopLevelKey`. Keys without escapes
+// (nearly all of them) are returned as is.
+std::string unescapeKey(std::string_view raw) {
+    if (raw.find('\\') == std::string_view::npos) {
+        return std::string(raw);
+    }
+    std::string quoted = "\"";
+    quoted.append(raw);
+    quoted += '"';
+    auto decoded = nlohmann::json::parse(quoted, nullptr, false);
+    if (!decoded.is_string()) {
+        return std::string(raw);
+    }
+    return decoded.get<std::string>();
+}
+
+}  // namespace json_scan
+
+TEST_CASE("json_scan top-level keys") {
+    auto keys = [](std::string_view line) {
+        std::vector<std::string> out;
+        json_scan::forEachTopLevelKey(line, [&](std::string_view k) {
+            out.push_back(json_scan::unescapeKey(k));
+        });
+        return out;
+    };
+    using V = std::vector<std::string>;
+
+    CHECK(keys(R"({"level":"info","msg":"hi"})") == V{"level", "msg"});
+    CHECK(keys(R"({})") == V{});
+    CHECK(keys(R"( { "a" : 1 , "b" : [1, {"c": 2}], "d": {"e": {"f": 3}} })") ==
+          V{"a", "b", "d"});
+    // structural characters and escaped quotes inside strings are ignored
+    CHECK(keys(R"({"msg":"{\"x\":1}, [\\","n":null})") == V{"msg", "n"});
+    CHECK(keys(R"({"we\"ird\\":1,"été":2})") ==
+          V{"we\"ird\\", "\xC3\xA9t\xC3\xA9"});
+    CHECK(keys(R"({"caf\u00e9":1})") == V{"caf\xC3\xA9"});
+    // not an object
+    CHECK(keys(R"(["a", "b"])") == V{});
+    CHECK(keys(R"("a")") == V{});
+    CHECK(keys("") == V{});
+
+    // keys and escapes straddling 64-byte block boundaries
+    std::string pad(61, 'x');
+    std::string line = R"({"pad":")" + pad + R"(\\","after":")" + pad +
+                       R"(\"","last":true})";
+    CHECK(keys(line) == V{"pad", "after", "last"});
+}
+
+TEST_CASE("json_scan nested keys") {
+    auto keys = [](std::string_view line, std::size_t maxDepth) {
+        std::vector<std::pair<std::size_t, std::string>> out;
+        json_scan::forEachKey(
+            line, maxDepth, [&](std::size_t depth, std::string_view k, auto) {
+                out.emplace_back(depth, json_scan::unescapeKey(k));
+            }
+        );
+        return out;
+    };
+    using V = std::vector<std::pair<std::size_t, std::string>>;
+
+    const std::string_view line =
+        R"({"a":1,"http":{"method":"GET","response":{"status":200}},)"
+        R"("arr":[{"x":1},{"y":{"z":2}}],"b":{"c":{}},"d":"}"})";
+    CHECK(keys(line, 1) == V{{1, "a"}, {1, "http"}, {1, "arr"}, {1, "b"},
+                             {1, "d"}});
+    CHECK(keys(line, 2) == V{{1, "a"},
+                             {1, "http"},
+                             {2, "method"},
+                             {2, "response"},
+                             {1, "arr"},
+                             {1, "b"},
+                             {2, "c"},
+                             {1, "d"}});
+    CHECK(keys(line, 8) == V{{1, "a"},
+                             {1, "http"},
+                             {2, "method"},
+                             {2, "response"},
+                             {3, "status"},
+                             {1, "arr"},
+                             {1, "b"},
+                             {2, "c"},
+                             {1, "d"}});
+}
+
+TEST_CASE("json_scan key values") {
+    std::vector<std::pair<std::string, std::string>> out;
+    json_scan::forEachKey(
+        R"({"s":"a,\"}","n": -1.5e3 ,"t":true,"o":{"x":null},"a":[1],"e":""})",
+        2,
+        [&](std::size_t, std::string_view k, std::string_view v) {
+            out.emplace_back(k, v);
+        }
+    );
+    using V = std::vector<std::pair<std::string, std::string>>;
+    CHECK(out == V{{"s", R"("a,\"}")"},
+                   {"n", "-1.5e3"},
+                   {"t", "true"},
+                   {"o", ""},
+                   {"x", "null"},
+                   {"a", ""},
+                   {"e", R"("")"}});
+}
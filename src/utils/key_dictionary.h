@@ -0,0 +1,426 @@
+#pragma once
+
+#define DOCTEST_CONFIG_NO_SHORT_MACRO_NAMES
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "doctest.h"
+
+// Dense id of a key path in a KeyDictionary
+using KeyId = std::uint32_t;
+
+// Interns key paths as small dense ids. A path is its parent's id (kRoot for a
+// top-level key) and its last key, so `{"a": {"b": 1}}` holds the paths
+// (kRoot, "a") and (id of "a", "b"). Ids are handed out in order from 0 and
+// never reused, so they can index per-key arrays. Safe to use from several
+// threads; each thread remembers the keys it interned last and finds them
+// again without taking the lock or hashing the whole key.
+class KeyDictionary {
+   public:
+    // parent of top-level keys; never the id of a key itself
+    static constexpr KeyId kRoot = std::numeric_limits<KeyId>::max();
+
+    KeyDictionary() = default;
+    KeyDictionary(const KeyDictionary&)            = delete;
+    KeyDictionary& operator=(const KeyDictionary&) = delete;
+
+    // The dictionary every Index files its keys under
+    static KeyDictionary& global() {
+        static KeyDictionary dictionary;
+        return dictionary;
+    }
+
+    // Id of `key` under `parent`, adding it if it's new
+    KeyId intern(KeyId parent, std::string_view key) {
+        thread_local std::array<CacheSlot, kCacheSlots> cache;
+        CacheSlot& slot = cache[cacheSlot(parent, key)];
+        if (slot.owner == serial_ && slot.parent == parent && slot.key == key) {
+            return slot.id;
+        }
+        const KeyId id = insert(parent, key);
+        slot.owner     = serial_;
+        slot.parent    = parent;
+        slot.id        = id;
+        slot.key.assign(key);
+        return id;
+    }
+
+    // Id of `key` under `parent`, or nullopt if it was never interned
+    [[nodiscard]] std::optional<KeyId> find(
+        KeyId parent, std::string_view key
+    ) const {
+        std::shared_lock lock(mutex_);
+        const auto       it = ids_.find(KeyView{parent, key});
+        if (it == ids_.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    // Id of the key path `keys`, each nested in the one before it
+    [[nodiscard]] std::optional<KeyId> find(
+        const std::vector<std::string>& keys
+    ) const {
+        KeyId id = kRoot;
+        for (const auto& key : keys) {
+            const auto child = find(id, key);
+            if (!child) {
+                return std::nullopt;
+            }
+            id = *child;
+        }
+        return keys.empty() ? std::nullopt : std::optional<KeyId>(id);
+    }
+
+    [[nodiscard]] KeyId parent(KeyId id) const {
+        std::shared_lock lock(mutex_);
+        return entries_.at(id).parent;
+    }
+
+    // Last key of the path `id`. Entries are never moved, so the view stays
+    // valid for the life of the dictionary.
+    [[nodiscard]] std::string_view key(KeyId id) const {
+        std::shared_lock lock(mutex_);
+        return entries_.at(id).key;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        std::shared_lock lock(mutex_);
+        return entries_.size();
+    }
+
+   private:
+    struct KeyView {
+        KeyId            parent;
+        std::string_view key;
+
+        bool operator==(const KeyView&) const = default;
+    };
+    struct Entry {
+        KeyId       parent;
+        std::string key;
+    };
+    struct KeyHash {
+        using is_transparent = void;
+        std::size_t operator()(const KeyView& k) const {
+            const std::size_t h = std::hash<std::string_view>()(k.key);
+            return h ^ (k.parent + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+        }
+    };
+    struct CacheSlot {
+        std::uint64_t owner{};  // serial_ of the dictionary, 0 if unused
+        KeyId         parent{};
+        KeyId         id{};
+        std::string   key;
+    };
+
+    static constexpr std::size_t kCacheSlots = 256;
+
+    // Cheap slot for the per-thread cache: the parent, the length and a few
+    // bytes of the key rather than a hash of all of it
+    static std::size_t cacheSlot(KeyId parent, std::string_view key) {
+        std::size_t h = parent * 0x9e3779b1u + key.size();
+        if (!key.empty()) {
+            h = h * 31 + static_cast<unsigned char>(key.front());
+            h = h * 31 + static_cast<unsigned char>(key[key.size() / 2]);
+            h = h * 31 + static_cast<unsigned char>(key.back());
+        }
+        return (h ^ (h >> 8)) % kCacheSlots;
+    }
+
+    KeyId insert(KeyId parent, std::string_view key) {
+        if (const auto id = find(parent, key)) {
+            return *id;
+        }
+        std::unique_lock lock(mutex_);
+        if (const auto it = ids_.find(KeyView{parent, key}); it != ids_.end()) {
+            return it->second;  // interned since the shared lock was released
+        }
+        if (entries_.size() == kRoot) {
+            throw std::runtime_error("KeyDictionary is out of ids");
+        }
+        const auto   id    = static_cast<KeyId>(entries_.size());
+        const Entry& entry = entries_.emplace_back(parent, std::string(key));
+        ids_.emplace(KeyView{parent, entry.key}, id);
+        return id;
+    }
+
+    static std::uint64_t nextSerial() {
+        static std::atomic<std::uint64_t> serial{0};
+        return ++serial;
+    }
+
+    // tells apart the entries of different dictionaries in the thread caches
+    const std::uint64_t serial_ = nextSerial();
+
+    mutable std::shared_mutex                        mutex_;
+    std::deque<Entry>                                entries_;  // by id
+    std::unordered_map<KeyView, KeyId, KeyHash, std::equal_to<>> ids_;
+};
+
+// Per-key values of an Index, stored densely: one entry per key added, found
+// by its KeyId through a small open-addressing table of entry positions. A map
+// costs a few bytes per key it holds, however high the dictionary's ids have
+// gone, so segments and batches only pay for their own keys. Iterates over the
+// keys that were added, in the order they were added, as (KeyId, value) pairs.
+template <typename T>
+class KeyMap {
+    struct Entry {
+        KeyId id;
+        T     value;
+    };
+
+   public:
+    class const_iterator {
+       public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = std::pair<KeyId, const T&>;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = void;
+        using reference         = value_type;
+
+        const_iterator() = default;
+        explicit const_iterator(const Entry* entry) : entry_(entry) {}
+
+        value_type operator*() const {
+            return {entry_->id, entry_->value};
+        }
+        const_iterator& operator++() {
+            ++entry_;
+            return *this;
+        }
+        const_iterator operator++(int) {
+            auto old = *this;
+            ++entry_;
+            return old;
+        }
+        bool operator==(const const_iterator& other) const {
+            return entry_ == other.entry_;
+        }
+
+       private:
+        const Entry* entry_{};
+    };
+
+    // Value for `id`, default-constructing it if it isn't there yet
+    T& operator[](KeyId id) {
+        if (T* value = find(id)) {
+            return *value;
+        }
+        if (2 * (entries_.size() + 1) > table_.size()) {
+            rehash(std::max<std::size_t>(kMinTable, 2 * table_.size()));
+        }
+        table_[freeSlot(id)] = static_cast<std::uint32_t>(entries_.size());
+        entries_.push_back({id, T()});
+        return entries_.back().value;
+    }
+
+    // Value for `id`, or nullptr if it was never added
+    [[nodiscard]] const T* find(KeyId id) const {
+        if (table_.empty()) {
+            return nullptr;
+        }
+        for (auto slot = home(id);; slot = (slot + 1) & (table_.size() - 1)) {
+            const auto pos = table_[slot];
+            if (pos == kEmpty) {
+                return nullptr;
+            }
+            if (entries_[pos].id == id) {
+                return &entries_[pos].value;
+            }
+        }
+    }
+    [[nodiscard]] T* find(KeyId id) {
+        return const_cast<T*>(std::as_const(*this).find(id));
+    }
+    // nullptr for a missing path, e.g. from KeyDictionary::find
+    [[nodiscard]] const T* find(std::optional<KeyId> id) const {
+        return id ? find(*id) : nullptr;
+    }
+
+    [[nodiscard]] bool contains(KeyId id) const {
+        return find(id) != nullptr;
+    }
+
+    [[nodiscard]] const T& at(KeyId id) const {
+        if (const T* value = find(id)) {
+            return *value;
+        }
+        throw std::out_of_range("KeyMap::at");
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return entries_.size();
+    }
+    [[nodiscard]] bool empty() const {
+        return entries_.empty();
+    }
+
+    void clear() {
+        entries_.clear();
+        table_.clear();
+    }
+
+    [[nodiscard]] const_iterator begin() const {
+        return const_iterator(entries_.data());
+    }
+    [[nodiscard]] const_iterator end() const {
+        return const_iterator(entries_.data() + entries_.size());
+    }
+
+   private:
+    static constexpr std::uint32_t kEmpty    = ~std::uint32_t{0};
+    static constexpr std::size_t   kMinTable = 16;
+
+    // First slot to probe for `id`: Fibonacci hashing, so ids handed out in
+    // a row spread over the table
+    [[nodiscard]] std::size_t home(KeyId id) const {
+        return static_cast<std::size_t>(
+            (std::uint64_t{id} * 0x9E3779B97F4A7C15ULL) >> (64 - bits_)
+        );
+    }
+
+    [[nodiscard]] std::size_t freeSlot(KeyId id) const {
+        auto slot = home(id);
+        while (table_[slot] != kEmpty) {
+            slot = (slot + 1) & (table_.size() - 1);
+        }
+        return slot;
+    }
+
+    // Grow the table to `slots` (a power of two) and place every entry again
+    void rehash(std::size_t slots) {
+        table_.assign(slots, kEmpty);
+        bits_ = std::countr_zero(slots);
+        for (std::size_t pos = 0; pos < entries_.size(); ++pos) {
+            table_[freeSlot(entries_[pos].id)] =
+                static_cast<std::uint32_t>(pos);
+        }
+    }
+
+    std::vector<Entry>         entries_;  // in insertion order
+    std::vector<std::uint32_t> table_;    // entry positions, kEmpty if free
+    int                        bits_{};   // log2 of table_.size()
+};
+
+TEST_CASE("KeyDictionary interns key paths") {
+    KeyDictionary dict;
+    const KeyId   a  = dict.intern(KeyDictionary::kRoot, "a");
+    const KeyId   b  = dict.intern(KeyDictionary::kRoot, "b");
+    const KeyId   ab = dict.intern(a, "b");
+    CHECK(a == 0);
+    CHECK(b == 1);
+    CHECK(ab == 2);
+    CHECK(dict.intern(KeyDictionary::kRoot, "a") == a);
+    CHECK(dict.intern(a, "b") == ab);
+    CHECK(dict.size() == 3);
+
+    CHECK(dict.find(KeyDictionary::kRoot, "b") == b);
+    CHECK(dict.find(b, "b") == std::nullopt);
+    CHECK(dict.find(std::vector<std::string>{"a", "b"}) == ab);
+    CHECK(dict.find(std::vector<std::string>{"a", "c"}) == std::nullopt);
+    CHECK(dict.parent(ab) == a);
+    CHECK(dict.key(ab) == "b");
+
+    // a second dictionary doesn't see the first one's cached ids
+    KeyDictionary other;
+    CHECK(other.intern(KeyDictionary::kRoot, "b") == 0);
+    CHECK(other.intern(KeyDictionary::kRoot, "a") == 1);
+    CHECK(dict.intern(KeyDictionary::kRoot, "b") == b);
+
+    // many keys, interned from several threads at once, get one id each
+    std::vector<std::thread> threads;
+    std::vector<KeyId>       ids(4 * 1000);
+    for (std::size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+            for (std::size_t i = 0; i < 1000; ++i) {
+                ids[t * 1000 + i] =
+                    dict.intern(KeyDictionary::kRoot, std::to_string(i));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CHECK(dict.size() == 1003);
+    for (std::size_t i = 0; i < 1000; ++i) {
+        CHECK(ids[i] == ids[1000 + i]);
+        CHECK(ids[i] == ids[3000 + i]);
+        CHECK(dict.key(ids[i]) == std::to_string(i));
+    }
+}
+
+TEST_CASE("KeyMap stores values by key id") {
+    KeyMap<int> map;
+    CHECK(map.empty());
+    map[5] = 50;
+    map[2] = 20;
+    map[5] += 1;
+    CHECK(map.size() == 2);
+    CHECK(map.contains(2));
+    CHECK(!map.contains(3));
+    CHECK(map.find(KeyId{9}) == nullptr);
+    CHECK(map.find(std::optional<KeyId>()) == nullptr);
+    CHECK(map.at(5) == 51);
+    CHECK_THROWS_AS((void)map.at(3), std::out_of_range);
+
+    std::vector<std::pair<KeyId, int>> items;
+    for (const auto& [id, value] : map) {
+        items.emplace_back(id, value);
+    }
+    CHECK(items == std::vector<std::pair<KeyId, int>>{{5, 51}, {2, 20}});
+
+    map.clear();
+    CHECK(map.empty());
+    CHECK(map.find(KeyId{5}) == nullptr);
+}
+
+TEST_CASE("KeyMap holds many sparse ids without a slot per id") {
+    // ids scattered up to the top of the range, as a segment sees them once
+    // the dictionary has grown large
+    KeyMap<std::uint64_t> map;
+    std::vector<KeyId>    ids;
+    for (std::uint64_t i = 0; i < 5000; ++i) {
+        ids.push_back(static_cast<KeyId>(i * 214013 % KeyDictionary::kRoot));
+    }
+    ids.push_back(KeyDictionary::kRoot - 1);
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+        map[ids[i]] = i;
+    }
+    REQUIRE(map.size() == ids.size());
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+        REQUIRE(map.contains(ids[i]));
+        CHECK(map.at(ids[i]) == i);
+    }
+    CHECK(!map.contains(1));
+    CHECK(!map.contains(KeyDictionary::kRoot - 2));
+
+    std::size_t i = 0;
+    for (const auto& [id, value] : map) {
+        CHECK(id == ids[i]);
+        CHECK(value == i++);
+    }
+    CHECK(i == ids.size());
+
+    // copies look keys up on their own
+    KeyMap<std::uint64_t> copy = map;
+    copy[ids[0]] += 100;
+    CHECK(copy.at(ids[0]) == 100);
+    CHECK(map.at(ids[0]) == 0);
+}
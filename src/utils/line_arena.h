@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Append-only store of raw lines: every line's bytes back to back in one
+// buffer, with line i spanning [offsets_[i], offsets_[i + 1]).
+class LineArena {
+   public:
+    LineArena() : offsets_{0} {}
+
+    void append(std::string_view line) {
+        bytes_.insert(bytes_.end(), line.begin(), line.end());
+        offsets_.push_back(bytes_.size());
+    }
+
+    // Append lines [from, to) of `other`, to the end by default
+    void append(
+        const LineArena& other,
+        std::size_t      from,
+        std::size_t      to = static_cast<std::size_t>(-1)
+    ) {
+        to = std::min(to, other.size());
+        if (from >= to) {
+            return;
+        }
+        const auto* begin = other.bytes_.data() + other.offsets_[from];
+        const auto* end   = other.bytes_.data() + other.offsets_[to];
+        const auto  shift = bytes_.size() - other.offsets_[from];
+        bytes_.insert(bytes_.end(), begin, end);
+        for (auto i = from + 1; i <= to; ++i) {
+            offsets_.push_back(other.offsets_[i] + shift);
+        }
+    }
+
+    [[nodiscard]] std::string_view operator[](std::size_t i) const {
+        return {bytes_.data() + offsets_[i], offsets_[i + 1] - offsets_[i]};
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return offsets_.size() - 1;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return size() == 0;
+    }
+
+    // Heap bytes held, including unused capacity
+    [[nodiscard]] std::size_t memoryUsage() const {
+        return bytes_.capacity() + offsets_.capacity() * sizeof(std::uint64_t);
+    }
+
+    void clear() {
+        bytes_.clear();
+        offsets_.assign(1, 0);
+    }
+
+   private:
+    std::vector<char>          bytes_;
+    std::vector<std::uint64_t> offsets_;
+};
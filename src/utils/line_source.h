@@ -0,0 +1,266 @@
+#pragma once
+
+#define DOCTEST_CONFIG_NO_SHORT_MACRO_NAMES
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "doctest.h"
+
+// Read-only handle on a log file that lines are read back from with pread.
+// Holding the descriptor keeps a rotated-away file readable.
+class LineSource {
+   public:
+    explicit LineSource(const std::string& path)
+        : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+        if (fd_ < 0) {
+            throw std::runtime_error(
+                "Failed to open " + path + ": " + std::strerror(errno)
+            );
+        }
+    }
+
+    LineSource(const LineSource&)            = delete;
+    LineSource& operator=(const LineSource&) = delete;
+
+    ~LineSource() {
+        ::close(fd_);
+    }
+
+    // Bytes [offset, offset + n) of the file into `out`, fewer if the file
+    // ends first
+    void read(std::uint64_t offset, std::size_t n, std::string& out) const {
+        out.resize(n);
+        std::size_t got = 0;
+        while (got < n) {
+            const auto at = static_cast<off_t>(offset + got);
+            const auto r  = ::pread(fd_, out.data() + got, n - got, at);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r < 0) {
+                throw std::runtime_error(
+                    std::string("pread failed: ") + std::strerror(errno)
+                );
+            }
+            if (r == 0) {
+                break;
+            }
+            got += r;
+        }
+        out.resize(got);
+    }
+
+   private:
+    int fd_;
+};
+
+// Where each line lives in the log, for LineStorage::Offsets: 8 bytes a line,
+// its length and its start relative to the run of lines it's in. A run shares
+// one LineSource and a base offset; a new one starts when the source changes
+// (a rotated log followed into its replacement) or a start no longer fits in
+// 32 bits past the base.
+class LineOffsets {
+   public:
+    struct Line {
+        const LineSource* source;
+        std::uint64_t     offset;
+        std::uint32_t     length;
+    };
+
+    void append(
+        const std::shared_ptr<const LineSource>& source,
+        std::uint64_t                            offset,
+        std::uint32_t                            length
+    ) {
+        if (runs_.empty() || runs_.back().source != source ||
+            offset < runs_.back().base ||
+            offset - runs_.back().base > kMaxStart) {
+            runs_.push_back({size(), offset, source});
+        }
+        starts_.push_back(offset - runs_.back().base);
+        lengths_.push_back(length);
+    }
+
+    // Append lines [from, to) of `other`
+    void append(const LineOffsets& other, std::size_t from, std::size_t to) {
+        to = std::min(to, other.size());
+        for (auto r = other.run(from); from < to; ++r) {
+            const Run& run = other.runs_[r];
+            const auto end = std::min(to, other.runEnd(r));
+            for (; from < end; ++from) {
+                append(
+                    run.source, run.base + other.starts_[from],
+                    other.lengths_[from]
+                );
+            }
+        }
+    }
+
+    [[nodiscard]] Line operator[](std::size_t i) const {
+        const Run& run = runs_[this->run(i)];
+        return {run.source.get(), run.base + starts_[i], lengths_[i]};
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return starts_.size();
+    }
+
+    // Heap bytes held, including unused capacity
+    [[nodiscard]] std::size_t memoryUsage() const {
+        return (starts_.capacity() + lengths_.capacity()) *
+                   sizeof(std::uint32_t) +
+               runs_.capacity() * sizeof(Run);
+    }
+
+    void clear() {
+        starts_.clear();
+        lengths_.clear();
+        runs_.clear();
+    }
+
+   private:
+    static constexpr std::uint64_t kMaxStart =
+        std::numeric_limits<std::uint32_t>::max();
+
+    struct Run {
+        std::size_t                       firstLine;
+        std::uint64_t                     base;
+        std::shared_ptr<const LineSource> source;
+    };
+
+    // Position in runs_ of the run holding line `i`
+    [[nodiscard]] std::size_t run(std::size_t i) const {
+        if (runs_.size() <= 1) {
+            return 0;
+        }
+        const auto it = std::upper_bound(
+            runs_.begin(), runs_.end(), i,
+            [](std::size_t line, const Run& r) { return line < r.firstLine; }
+        );
+        return it - runs_.begin() - 1;
+    }
+
+    // One past the last line of run `r`
+    [[nodiscard]] std::size_t runEnd(std::size_t r) const {
+        return r + 1 < runs_.size() ? runs_[r + 1].firstLine : size();
+    }
+
+    std::vector<std::uint32_t> starts_;  // offset - base of the line's run
+    std::vector<std::uint32_t> lengths_;
+    std::vector<Run>           runs_;  // ascending firstLine
+};
+
+// Reads lines back from their LineSource a block at a time. A line outside
+// the last block read pulls in kBlockBytes of the lines around it, extending
+// the way lines are being visited (backward after a line earlier in the file
+// than the one before, as when a query walks newest first), so a run of
+// nearby candidate lines costs one pread per block instead of one per line.
+class LineReader {
+   public:
+    static constexpr std::size_t kBlockBytes = 256 * 1024;
+
+    // Bytes of `line`, good until the next call; empty if the file no longer
+    // reaches that far, as after it was truncated in place
+    std::string_view read(const LineOffsets::Line& line) {
+        const auto end = line.offset + line.length;
+        if (line.source != source_ || line.offset < begin_ ||
+            end > begin_ + block_.size()) {
+            const std::size_t n =
+                std::max<std::size_t>(line.length, kBlockBytes);
+            const bool backward =
+                source_ == line.source && line.offset < last_;
+            begin_  = backward ? end - std::min<std::uint64_t>(end, n)
+                               : line.offset;
+            source_ = line.source;
+            source_->read(begin_, n, block_);
+            if (end > begin_ + block_.size()) {
+                return {};
+            }
+        }
+        last_ = line.offset;
+        return std::string_view(block_).substr(
+            line.offset - begin_, line.length
+        );
+    }
+
+   private:
+    const LineSource* source_{};
+    std::uint64_t     begin_{};  // file offset of block_
+    std::uint64_t     last_{};   // offset of the line read last
+    std::string       block_;
+};
+
+TEST_CASE("LineReader reads lines back through LineOffsets") {
+    const std::string path = "tmplinesource";
+    auto expected = [](std::size_t i) {
+        return std::to_string(i) + std::string(800 + i % 7, 'x');
+    };
+    // lines long enough that a block holds a few hundred of them
+    std::string data;
+    for (std::size_t i = 0; i < 5000; ++i) {
+        data += expected(i) + '\n';
+    }
+    std::ofstream(path) << data;
+
+    const auto  source = std::make_shared<const LineSource>(path);
+    LineOffsets offsets;
+    for (std::size_t i = 0, offset = 0; i < 5000; ++i) {
+        const auto length = expected(i).size();
+        offsets.append(source, offset, length);
+        offset += length + 1;
+    }
+    LineOffsets copy;
+    copy.append(offsets, 10, 4990);
+    CHECK(copy.size() == 4980);
+    CHECK(copy[0].offset == offsets[10].offset);
+
+    LineReader reader;
+    for (std::size_t i = 5000; i-- > 0;) {
+        REQUIRE(reader.read(offsets[i]) == expected(i));
+    }
+    for (std::size_t i = 0; i < 5000; i += 3) {
+        REQUIRE(reader.read(offsets[i]) == expected(i));
+    }
+    CHECK(reader.read(copy[100]) == expected(110));
+
+    // a second source starts a new run, which appending carries over
+    std::ofstream(path + "2") << "other\n";
+    offsets.append(std::make_shared<const LineSource>(path + "2"), 0, 5);
+    LineOffsets tail;
+    tail.append(offsets, 4998, 5001);
+    CHECK(tail.size() == 3);
+    CHECK(reader.read(tail[1]) == expected(4999));
+    CHECK(reader.read(tail[2]) == "other");
+    CHECK(reader.read(offsets[1]) == expected(1));
+
+    // so does a start too far past its run's base for 32 bits
+    const std::uint64_t far = std::uint64_t{1} << 33;
+    offsets.append(source, far, 7);
+    CHECK(offsets[5001].offset == far);
+    CHECK(offsets[5001].length == 7);
+    CHECK(offsets[5000].offset == 0);
+
+    // lines cut off by a truncation read back as empty
+    std::filesystem::resize_file(path, expected(0).size() + 1);
+    LineReader fresh;
+    CHECK(fresh.read(offsets[4000]).empty());
+    CHECK(fresh.read(offsets[0]) == expected(0));
+    CHECK(fresh.read(offsets[1]).empty());
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(path + "2");
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#define DOCTEST_CONFIG_NO_SHORT_MACRO_NAMES
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+#include "doctest.h"
+
+// Fixed-capacity map that evicts the least recently used entry. Pointers and
+// references returned by `get` and `put` stay valid until that entry is
+// evicted or the cache is cleared.
+template <typename K, typename V>
+class LruCache {
+   public:
+    explicit LruCache(std::size_t capacity) : capacity_(capacity) {}
+
+    V* get(const K& key) {
+        auto it = map_.find(key);
+        if (it == map_.end()) {
+            return nullptr;
+        }
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return &it->second->second;
+    }
+
+    V& put(const K& key, V value) {
+        if (V* existing = get(key)) {
+            *existing = std::move(value);
+            return *existing;
+        }
+        if (map_.size() >= capacity_ && !entries_.empty()) {
+            map_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+        entries_.emplace_front(key, std::move(value));
+        map_.emplace(key, entries_.begin());
+        return entries_.front().second;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return map_.size();
+    }
+
+    void clear() {
+        map_.clear();
+        entries_.clear();
+    }
+
+   private:
+    using Entries = std::list<std::pair<K, V>>;
+
+    std::size_t                                       capacity_;
+    Entries                                           entries_;
+    std::unordered_map<K, typename Entries::iterator> map_;
+};
+
+TEST_CASE("LruCache evicts least recently used") {
+    LruCache<int, int> cache(2);
+    cache.put(1, 10);
+    cache.put(2, 20);
+    CHECK(*cache.get(1) == 10);  // 2 is now least recently used
+    cache.put(3, 30);
+    CHECK(cache.size() == 2);
+    CHECK(cache.get(2) == nullptr);
+    CHECK(*cache.get(1) == 10);
+    CHECK(*cache.get(3) == 30);
+    cache.put(3, 31);
+    CHECK(*cache.get(3) == 31);
+    CHECK(cache.size() == 2);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Read-only memory mapping of a file that may keep growing. `remap()` picks up
+// bytes appended since the last call, so a tailing reader can scan the mapped
+// region directly instead of copying every line through an istream.
+class MappedFile {
+   public:
+    explicit MappedFile(const std::string& path)
+        : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+        if (fd_ < 0) {
+            throw std::runtime_error(
+                "Failed to open " + path + ": " + std::strerror(errno)
+            );
+        }
+        remap();
+    }
+
+    MappedFile(const MappedFile&)            = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        unmap();
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    // What `remap()` found when it re-stat'ed the file
+    enum class Change { None, Grew, Shrank };
+
+    // Re-stat the file and extend the mapping if it grew. If it was truncated,
+    // the old mapping is dropped and the file is mapped again at its new size,
+    // so no byte past the end of the file stays visible; a reader has to start
+    // over since whatever it had read may no longer be there.
+    Change remap() {
+        struct stat st {};
+        if (::fstat(fd_, &st) != 0) {
+            return Change::None;
+        }
+        auto newSize = static_cast<std::size_t>(st.st_size);
+        if (newSize == size_) {
+            return Change::None;
+        }
+        if (newSize < size_) {
+            unmap();
+            map(newSize);
+            return Change::Shrank;
+        }
+
+        void* addr = MAP_FAILED;
+#ifdef __linux__
+        if (data_ != nullptr) {
+            addr = ::mremap(
+                const_cast<char*>(data_), size_, newSize, MREMAP_MAYMOVE
+            );
+        }
+#endif
+        if (addr == MAP_FAILED) {
+            unmap();
+            map(newSize);
+        } else {
+            ::madvise(addr, newSize, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(addr);
+            size_ = newSize;
+        }
+        return Change::Grew;
+    }
+
+    [[nodiscard]] const char* data() const {
+        return data_;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return size_;
+    }
+
+    [[nodiscard]] std::string_view view() const {
+        return {data_, size_};
+    }
+
+    [[nodiscard]] int fd() const {
+        return fd_;
+    }
+
+   private:
+    void map(std::size_t size) {
+        if (size == 0) {
+            return;
+        }
+        void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error(
+                std::string("mmap failed: ") + std::strerror(errno)
+            );
+        }
+        ::madvise(addr, size, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(addr);
+        size_ = size;
+    }
+
+    void unmap() {
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char*>(data_), size_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+    int         fd_ = -1;
+    const char* data_{};
+    std::size_t size_{};
+};
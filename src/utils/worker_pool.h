@@ -0,0 +1,178 @@
+#pragma once
+
+#define DOCTEST_CONFIG_NO_SHORT_MACRO_NAMES
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "doctest.h"
+
+// Long-lived threads that help the calling thread with one job at a time.
+// `run(task, n)` has `task` called on up to `n` threads, the caller's and
+// n - 1 of the pool's, and returns once every call has returned, so a job
+// pays for waking threads rather than creating them. If a call throws, the
+// calls not yet started are skipped, and `run` rethrows the first exception
+// once the rest have returned. Only one thread may call `run` at a time.
+class WorkerPool {
+   public:
+    explicit WorkerPool(unsigned threads) {
+        threads_.reserve(threads);
+        for (unsigned i = 0; i < threads; ++i) {
+            threads_.emplace_back([this]() { loop(); });
+        }
+    }
+
+    WorkerPool(const WorkerPool&)            = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    // Threads of the pool's own, not counting the caller of `run`
+    [[nodiscard]] std::size_t size() const {
+        return threads_.size();
+    }
+
+    void run(const std::function<void()>& task, std::size_t n) {
+        const std::size_t helpers = n == 0 ? 0 : std::min(n - 1, size());
+        {
+            std::lock_guard lock(mutex_);
+            task_    = &task;
+            claims_  = helpers;
+            running_ = helpers;
+        }
+        wake_.notify_all();
+        if (n > 0) {
+            call(task);
+        }
+        std::unique_lock lock(mutex_);
+        done_.wait(lock, [&]() { return running_ == 0; });
+        task_ = nullptr;
+        if (auto error = std::exchange(error_, nullptr)) {
+            std::rethrow_exception(error);
+        }
+    }
+
+   private:
+    // Call `task`, keeping what it throws for `run` to rethrow
+    void call(const std::function<void()>& task) {
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard lock(mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+            running_ -= claims_;  // nobody will pick these up now
+            claims_ = 0;
+        }
+    }
+
+    void loop() {
+        std::unique_lock lock(mutex_);
+        for (;;) {
+            wake_.wait(lock, [&]() { return stopping_ || claims_ > 0; });
+            if (stopping_) {
+                return;
+            }
+            --claims_;
+            const auto* task = task_;
+            lock.unlock();
+            call(*task);
+            lock.lock();
+            if (--running_ == 0) {
+                done_.notify_all();
+            }
+        }
+    }
+
+    std::mutex                   mutex_;  // guards everything below
+    std::condition_variable      wake_;   // a job was posted, or stopping
+    std::condition_variable      done_;   // the job's last call returned
+    const std::function<void()>* task_{};
+    std::size_t                  claims_{};   // calls not yet picked up
+    std::size_t                  running_{};  // calls not yet returned
+    std::exception_ptr           error_;      // the job's first exception
+    bool                         stopping_ = false;
+    std::vector<std::thread>     threads_;
+};
+
+TEST_CASE("WorkerPool runs a job on the caller and its threads") {
+    WorkerPool pool(3);
+    CHECK(pool.size() == 3);
+
+    // every call is made, and all have returned when run does
+    for (std::size_t n : {0, 1, 2, 4, 9}) {
+        CAPTURE(n);
+        std::atomic<std::size_t> calls{0};
+        pool.run([&]() { ++calls; }, n);
+        CHECK(calls.load() == std::min<std::size_t>(n, 4));
+    }
+
+    // the calls run at once: each waits until all of them have started
+    std::atomic<std::size_t> started{0};
+    pool.run(
+        [&]() {
+            ++started;
+            while (started.load() < 4) {
+                std::this_thread::yield();
+            }
+        },
+        4
+    );
+    CHECK(started.load() == 4);
+
+    // jobs are handed out again and again to the same threads
+    std::atomic<std::size_t> total{0};
+    for (int round = 0; round < 1000; ++round) {
+        pool.run([&]() { ++total; }, 4);
+    }
+    CHECK(total.load() == 4000);
+
+    // a throw on any thread comes back out of run once every call is done,
+    // and the pool takes the next job as usual
+    for (int thrower = 0; thrower < 4; ++thrower) {
+        CAPTURE(thrower);
+        std::atomic<int>         ticket{0};
+        std::atomic<std::size_t> finished{0};
+        CHECK_THROWS_AS(
+            pool.run(
+                [&]() {
+                    if (ticket++ == thrower) {
+                        throw std::runtime_error("job failed");
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    ++finished;
+                },
+                4
+            ),
+            std::runtime_error
+        );
+        CHECK(finished.load() + 1 == static_cast<std::size_t>(ticket.load()));
+    }
+    std::atomic<std::size_t> after{0};
+    pool.run([&]() { ++after; }, 4);
+    CHECK(after.load() == 4);
+
+    WorkerPool  none(0);
+    std::size_t calls = 0;
+    none.run([&]() { ++calls; }, 4);
+    CHECK(calls == 1);
+}